@@ -52,6 +52,15 @@ btimer_diff(btimer_diff_t *diff, const btimer_t *start, const btimer_t *end)
 #endif
 }
 
+static void
+btimer_diff_add(btimer_diff_t *total, const btimer_diff_t *diff)
+{
+  total->ns += diff->ns;
+#ifdef USING_OTTERY_CPUTICKS
+  total->ticks += diff->ticks;
+#endif
+}
+
 static const char *
 diff_fmt(btimer_diff_t *diff, uint64_t divisor)
 {
@@ -76,12 +85,94 @@ diff_fmt(btimer_diff_t *diff, uint64_t divisor)
 }
 
 
+/* How many calls do we time one at a time for the latency distribution? */
+#define LATENCY_CALLS 1000000
+
+static uint32_t latency_ns[LATENCY_CALLS];
+
+static uint64_t
+latency_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+}
+
+static int
+latency_cmp(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+  Time 'n' calls to ottery_random() one at a time, and print the shape of
+  the distribution.  The refills land in the top percent or so.
+*/
+static void
+latency_distribution(int n)
+{
+  uint64_t t0, t1;
+  uint32_t overhead;
+  int i;
+
+  for (i = 0; i < n; ++i)
+    {
+      t0 = latency_now();
+      t1 = latency_now();
+      latency_ns[i] = (uint32_t)(t1 - t0);
+    }
+  qsort(latency_ns, n, sizeof(latency_ns[0]), latency_cmp);
+  overhead = latency_ns[n / 2];
+
+  for (i = 0; i < n; ++i)
+    {
+      t0 = latency_now();
+      ottery_random();
+      t1 = latency_now();
+      latency_ns[i] = (uint32_t)(t1 - t0);
+    }
+  qsort(latency_ns, n, sizeof(latency_ns[0]), latency_cmp);
+
+  printf("ottery_random() latency (%s refill, %u ns timer overhead): "
+         "median %u ns, 99%% %u ns, 99.9%% %u ns, 99.99%% %u ns, "
+         "max %u ns\n",
+#ifdef OTTERY_INCREMENTAL_REFILL
+         "incremental",
+#else
+         "whole-buffer",
+#endif
+         overhead, latency_ns[n / 2], latency_ns[n - n / 100],
+         latency_ns[n - n / 1000], latency_ns[n - n / 10000],
+         latency_ns[n - 1]);
+}
+
+/* How many calls does each thread make in the contention test? */
+#define CONTENTION_CALLS 20000
+/* Most threads we start for the contention test. */
+#define CONTENTION_MAX_THREADS 256
+
+static void *
+contention_thread_fn(void *arg)
+{
+  int i;
+  (void)arg;
+  for (i = 0; i < CONTENTION_CALLS; ++i)
+    {
+      ottery_random();
+    }
+  return NULL;
+}
+
 int
 main(int c, char **v)
 {
   btimer_t t_start, t_end;
   btimer_diff_t t_diff;
   u8 block[4096];
+  static u8 big[65536];
+  static const int sizes[] = { 64, 512, 983, 1024, 2048, 4096, 16384, 65536 };
+  struct ottery_rng rng;
   int i, j;
   const int N = 100000;
   const int NENT = 100;
@@ -97,6 +188,27 @@ main(int c, char **v)
   btimer_diff(&t_diff, &t_start, &t_end);
   printf("%s per call to ottery_random()\n", diff_fmt(&t_diff, N * 100));
 
+#ifdef USING_WIPEONFORK
+  if (!RNG_PTR->wipeonfork_failed)
+    {
+      /* This is what every call costs without MADV_WIPEONFORK: we have to
+         call getpid() to notice a fork. */
+      RNG_PTR->wipeonfork_failed = 1;
+      btimer_gettime(&t_start);
+      for (i = 0; i < N * 100; ++i)
+        {
+          ottery_random();
+        }
+      btimer_gettime(&t_end);
+      RNG_PTR->wipeonfork_failed = 0;
+      btimer_diff(&t_diff, &t_start, &t_end);
+      printf("%s per call to ottery_random() with pid checks\n",
+             diff_fmt(&t_diff, N * 100));
+    }
+#endif
+
+
+  latency_distribution(LATENCY_CALLS);
 
   btimer_gettime(&t_start);
   for (i = 0; i < N * 10; ++i)
@@ -107,6 +219,18 @@ main(int c, char **v)
   btimer_diff(&t_diff, &t_start, &t_end);
   printf("%s per call to ottery_random_buf(1024)\n", diff_fmt(&t_diff, N * 10));
 
+  /* Somebody feeding us timing samples between calls. */
+  btimer_gettime(&t_start);
+  for (i = 0; i < N; ++i)
+    {
+      ottery_addrandom((const u8 *)&t_start, sizeof(t_start));
+      ottery_random();
+    }
+  btimer_gettime(&t_end);
+  btimer_diff(&t_diff, &t_start, &t_end);
+  printf("%s per call to ottery_addrandom(%d) and ottery_random()\n",
+         diff_fmt(&t_diff, N), (int)sizeof(t_start));
+
   btimer_gettime(&t_start);
   for (i = 0; i < N; ++i)
     {
@@ -114,7 +238,239 @@ main(int c, char **v)
     }
   btimer_gettime(&t_end);
   btimer_diff(&t_diff, &t_start, &t_end);
-  printf("%s per buffer refill\n", diff_fmt(&t_diff, N));
+  printf("%s per buffer refill (%s)\n", diff_fmt(&t_diff, N),
+         chacha20_impl_->name);
+
+  /* Call the core directly, so we see the buffered path at every size.
+     (ottery_random_buf() switches to a one-shot key at LARGE_BUFFER_CUTOFF.)
+  */
+  memset(&rng, 0, sizeof(rng));
+  ottery_setkey(&rng, block);
+  for (j = 0; j < (int)(sizeof(sizes) / sizeof(sizes[0])); ++j)
+    {
+      const int iters = N * 64 / sizes[j];
+      btimer_gettime(&t_start);
+      for (i = 0; i < iters; ++i)
+        {
+          ottery_bytes(&rng, big, sizes[j]);
+        }
+      btimer_gettime(&t_end);
+      btimer_diff(&t_diff, &t_start, &t_end);
+      printf("%s per call to ottery_bytes(%d)\n",
+             diff_fmt(&t_diff, iters), sizes[j]);
+    }
+
+  {
+    const size_t huge = 64 << 20;
+    u8 *hugebuf = malloc(huge);
+    if (hugebuf)
+      {
+        /* Don't count the first trip through the memory. */
+        ottery_random_buf(hugebuf, huge);
+        btimer_gettime(&t_start);
+        ottery_random_buf(hugebuf, huge);
+        btimer_gettime(&t_end);
+        btimer_diff(&t_diff, &t_start, &t_end);
+        printf("%s per call to ottery_random_buf(64MB)\n",
+               diff_fmt(&t_diff, 1));
+
+        btimer_gettime(&t_start);
+        ottery_random_buf_parallel(hugebuf, huge, 0);
+        btimer_gettime(&t_end);
+        btimer_diff(&t_diff, &t_start, &t_end);
+        printf("%s per call to ottery_random_buf_parallel(64MB) "
+               "(%d threads)\n", diff_fmt(&t_diff, 1),
+               parallel_n_threads_(huge / CHACHA_BLOCKSIZE, 0));
+        free(hugebuf);
+      }
+  }
+
+  /*
+    Bulk output, with and without non-temporal stores.  After each fill, we
+    walk a 1MB working set in a random cycle, to see how much of it the fill
+    pushed out of the cache.
+  */
+  {
+    const size_t bulk = 32 << 20;
+    const size_t ws_len = (1 << 20) / sizeof(uint32_t);
+    u8 *bulkbuf = malloc(bulk + CHACHA_NT_ALIGN), *aligned;
+    uint32_t *ws = malloc(ws_len * sizeof(uint32_t));
+    volatile uint32_t sink = 0;
+    btimer_diff_t fill_total, walk_total;
+    size_t k;
+    int nt;
+
+    if (bulkbuf && ws)
+      {
+        aligned = bulkbuf + (-(uintptr_t)bulkbuf & (CHACHA_NT_ALIGN - 1));
+        memset(bulkbuf, 0, bulk + CHACHA_NT_ALIGN);
+
+        /* Sattolo's algorithm: one cycle through every word. */
+        for (k = 0; k < ws_len; ++k)
+          ws[k] = (uint32_t)k;
+        for (k = ws_len - 1; k > 0; --k)
+          {
+            uint32_t r = ottery_random_uniform((unsigned)k), tmp = ws[k];
+            ws[k] = ws[r];
+            ws[r] = tmp;
+          }
+
+        for (nt = 0; nt <= 1; ++nt)
+          {
+            memset(&fill_total, 0, sizeof(fill_total));
+            memset(&walk_total, 0, sizeof(walk_total));
+            for (i = 0; i < 10; ++i)
+              {
+                uint32_t idx = 0;
+                btimer_gettime(&t_start);
+                chacha20_blocks_at(block, 0, bulk / CHACHA_BLOCKSIZE,
+                                   aligned, nt);
+                btimer_gettime(&t_end);
+                btimer_diff(&t_diff, &t_start, &t_end);
+                btimer_diff_add(&fill_total, &t_diff);
+
+                btimer_gettime(&t_start);
+                for (k = 0; k < ws_len; ++k)
+                  idx = ws[idx];
+                btimer_gettime(&t_end);
+                sink += idx;
+                btimer_diff(&t_diff, &t_start, &t_end);
+                btimer_diff_add(&walk_total, &t_diff);
+              }
+            printf("%s per 32MB fill (%s stores)\n",
+                   diff_fmt(&fill_total, 10), nt ? "non-temporal" : "normal");
+            printf("%s per 1MB working-set walk after it\n",
+                   diff_fmt(&walk_total, 10));
+          }
+      }
+    free(bulkbuf);
+    free(ws);
+  }
+
+  {
+    /* Lots more threads than CPUs, all fighting over one lock.  Build with
+       OTTERY_FUTEX_LOCKS or OTTERY_NO_PTHREAD_SPINLOCKS to compare. */
+    pthread_t threads[CONTENTION_MAX_THREADS];
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n_threads = 4 * (n_cpus > 0 ? (int)n_cpus : 1);
+    if (n_threads < 8)
+      n_threads = 8;
+    if (n_threads > CONTENTION_MAX_THREADS)
+      n_threads = CONTENTION_MAX_THREADS;
+
+    btimer_gettime(&t_start);
+    for (i = 0; i < n_threads; ++i)
+      {
+        if (pthread_create(&threads[i], NULL, contention_thread_fn, NULL))
+          abort();
+      }
+    for (i = 0; i < n_threads; ++i)
+      {
+        pthread_join(threads[i], NULL);
+      }
+    btimer_gettime(&t_end);
+    btimer_diff(&t_diff, &t_start, &t_end);
+    printf("%s per call to ottery_random() with %d threads (%s locks)\n",
+           diff_fmt(&t_diff, (uint64_t)n_threads * CONTENTION_CALLS),
+           n_threads, OTTERY_LOCK_NAME);
+  }
+
+  {
+    u8 entropy[OTTERY_ENTROPY_MAXLEN];
+    int status;
+
+    btimer_gettime(&t_start);
+    for (i = 0; i < NENT; ++i)
+      {
+        ottery_getentropy_impl(entropy, &status,
+                               entropy_sources, (int)N_ENTROPY_SOURCES);
+      }
+    btimer_gettime(&t_end);
+    btimer_diff(&t_diff, &t_start, &t_end);
+    printf("%s per seed, one source at a time\n", diff_fmt(&t_diff, NENT));
+#ifdef USING_PARALLEL_ENTROPY
+    btimer_gettime(&t_start);
+    for (i = 0; i < NENT; ++i)
+      {
+        ottery_getentropy_parallel_impl(entropy, &status,
+                                        entropy_sources,
+                                        (int)N_ENTROPY_SOURCES);
+      }
+    btimer_gettime(&t_end);
+    btimer_diff(&t_diff, &t_start, &t_end);
+    printf("%s per seed, all sources in parallel\n", diff_fmt(&t_diff, NENT));
+#endif
+  }
+
+  /* A routine reseed under each policy, and a whole first-time
+     initialization. */
+  for (j = OTTERY_RESEED_FAST; j <= OTTERY_RESEED_FULL; ++j)
+    {
+      uint64_t total = 0;
+      ottery_set_reseed_policy(j);
+      for (i = 0; i < NENT; ++i)
+        {
+          LOCK();
+          RNG_PTR->count = RESEED_AFTER_BLOCKS + 1;
+          UNLOCK();
+          ottery_random();
+          total += ottery_last_reseed_nsec();
+        }
+      printf("%ld ns per reseed (%s)\n", (long)(total / NENT),
+             j == OTTERY_RESEED_FAST ? "fast" : "full");
+    }
+  ottery_set_reseed_policy(OTTERY_RESEED_FAST);
+
+  btimer_gettime(&t_start);
+  for (i = 0; i < NENT; ++i)
+    {
+      ottery_teardown();
+      ottery_random();
+    }
+  btimer_gettime(&t_end);
+  btimer_diff(&t_diff, &t_start, &t_end);
+  printf("%s per teardown and init\n", diff_fmt(&t_diff, NENT));
+
+#ifdef USING_SEED_FILE
+  {
+    char path[] = "/tmp/ottery_bench_seed_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0)
+      {
+        close(fd);
+        unlink(path); /* We'll make it the first time around. */
+        btimer_gettime(&t_start);
+        for (i = 0; i < NENT; ++i)
+          {
+            ottery_teardown();
+            ottery_set_seed_file(path);
+            ottery_random();
+          }
+        btimer_gettime(&t_end);
+        btimer_diff(&t_diff, &t_start, &t_end);
+        printf("%s per teardown and init with a seed file\n",
+               diff_fmt(&t_diff, NENT));
+        ottery_set_seed_file(NULL);
+        unlink(path);
+      }
+  }
+#endif
+
+#ifdef USING_VGETRANDOM
+  /* The getrandom source below uses the vDSO if it can; here's what the
+     system call costs. */
+  btimer_gettime(&t_start);
+  for (i = 0; i < NENT; ++i)
+    {
+      if (syscall(__NR_getrandom, block, ENTROPY_CHUNK, 0) != ENTROPY_CHUNK)
+        abort();
+    }
+  btimer_gettime(&t_end);
+  btimer_diff(&t_diff, &t_start, &t_end);
+  printf("%s per getrandom system call (vDSO getrandom %s)\n",
+         diff_fmt(&t_diff, NENT),
+         ottery_vgetrandom_status > 0 ? "available" : "not available");
+#endif
 
   for (j = 0; j < (int)N_ENTROPY_SOURCES; ++j)
     {
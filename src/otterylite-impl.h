@@ -26,6 +26,70 @@
   #define OTTERY_DISABLE_LOCKING
 */
 
+/*
+  On Linux, use locks that spin for a short while and then sleep on a
+  futex, instead of pthread spinlocks.  This is a good idea when there can
+  be more threads than CPUs, since a spinlock whose holder gets preempted
+  keeps everybody else spinning.  (Ignored on other platforms.)
+
+  #define OTTERY_FUTEX_LOCKS
+*/
+
+/*
+  Use pthread mutexes instead of pthread spinlocks.
+
+  #define OTTERY_NO_PTHREAD_SPINLOCKS
+*/
+
+/*
+  Give each thread its own RNG, keyed from the global one, so that the
+  common calls don't need to take a lock.  Each thread's RNG gets wiped
+  when the thread exits.  Only works with the static state and pthreads,
+  and the compiler needs to support __thread.
+
+  #define OTTERY_THREAD_LOCAL_RNG
+*/
+
+/*
+  Keep one RNG per CPU instead of one per thread, each with its own lock.
+  Better than OTTERY_THREAD_LOCAL_RNG when there are lots of short-lived
+  threads.  The number of RNGs comes from the CPUs we're allowed to run on.
+  Linux only, and only with the static state.
+
+  #define OTTERY_PER_CPU_RNG
+*/
+
+/*
+  Start seeding the RNG on a helper thread as soon as the library is
+  loaded, so that the first call finds it ready, or only waits for the
+  part of the seed that's left.  Only with the static state, pthreads,
+  and a compiler that does constructors.
+
+  #define OTTERY_EAGER_INIT
+*/
+
+/*
+  When a routine reseed is due, don't read the entropy sources on the
+  thread that noticed: ask a worker thread to do it, and keep using the
+  old key until the worker is done.  (If it takes much too long, we give
+  up waiting and reseed right away.)  Only with the static state,
+  pthreads, and a compiler that does constructors.
+
+  #define OTTERY_ASYNC_RESEED
+*/
+
+/*
+  Make the next buffer a few blocks at a time while the current one is in
+  use, instead of all at once when it runs out, so that no call has to
+  wait for more than OTTERY_REFILL_STEP blocks of ChaCha (default 4; it
+  has to divide the number of blocks in a buffer).  The output is the
+  same.  Total throughput drops a little, since the steps are too small
+  for the widest ChaCha code, and the claim-ahead spare buffer is off.
+
+  #define OTTERY_INCREMENTAL_REFILL
+  #define OTTERY_REFILL_STEP 4
+*/
+
 /*
   Don't try to mmap the ottery RNG state into its own separate page.
 
@@ -51,6 +115,45 @@
   #define OTTERY_DISABLE_FALLBACK_RNG
 */
 
+/*
+  When seeding, call all the entropy sources at once, each on its own
+  thread, instead of one after another.  A source that takes too long gets
+  ignored.  Not on Windows.
+
+  #define OTTERY_PARALLEL_ENTROPY
+*/
+
+/*
+  On Linux, don't look for a getrandom() in the vDSO; always make the
+  system call.
+
+  #define OTTERY_DISABLE_VDSO
+*/
+
+/*
+  Don't use the vectorized ChaCha20 implementations, even if the compiler and
+  CPU support them.  Everything will be a little slower, but the output will
+  be the same.
+
+  #define OTTERY_DISABLE_SIMD
+*/
+
+/*
+  Use the portable vector-extension ChaCha20 implementation even on x86,
+  where we have faster ones.  This is mainly so that we can test it.
+
+  #define OTTERY_CHACHA_FORCE_GENERIC
+*/
+
+/*
+  Write ottery_random_buf() requests of at least this many bytes with
+  non-temporal stores, so that they don't push everything else out of the
+  cache.  (Only the x86 kernels can do this.)  Define it to 0 to turn it
+  off.
+
+  #define OTTERY_NONTEMPORAL_CUTOFF (4 << 20)
+*/
+
 /* Define this for a little debugging output.
    #define TRACE(x) printf x
 */
@@ -102,6 +205,44 @@
 #endif
 #endif
 
+/*
+  Find out which SIMD instruction sets we can assume.  Define
+  OTTERY_HAVE_SSE2 and OTTERY_HAVE_SSSE3 if the compiler is targeting a CPU
+  that has them.
+*/
+#if defined(OTTERY_X86) && !defined(OTTERY_DISABLE_SIMD) && \
+  !defined(OTTERY_CHACHA_FORCE_GENERIC)
+#if defined(__SSE2__) ||                        \
+  defined(_M_AMD64) ||                          \
+  (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define OTTERY_HAVE_SSE2
+#endif
+#if defined(OTTERY_HAVE_SSE2) && defined(__SSSE3__)
+#define OTTERY_HAVE_SSSE3
+#endif
+#endif
+
+/*
+  On x86_64, define OTTERY_HAVE_X86_DISPATCH if the compiler can build code
+  for instruction sets it isn't targeting.  If so, we build AVX2 and AVX-512
+  code too, and decide at runtime whether we can use it.
+*/
+#if defined(OTTERY_X86_64) && defined(OTTERY_HAVE_SSE2)
+#if defined(_MSC_VER) ||                                        \
+  (defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)))
+#define OTTERY_HAVE_X86_DISPATCH
+#endif
+#endif
+
+/*
+  Everywhere else, define OTTERY_HAVE_VECTOR_EXT if the compiler supports
+  GCC-style vector types, so it can vectorize ChaCha20 for us.
+*/
+#if !defined(OTTERY_HAVE_SSE2) && !defined(OTTERY_DISABLE_SIMD) &&     \
+  defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))
+#define OTTERY_HAVE_VECTOR_EXT
+#endif
+
 /* If we're pretending to be arc4random(), then suppress any declarations of
    arc4random_foo in the system headers. */
 #ifdef OTTERY_BE_ARC4RANDOM
@@ -131,6 +272,16 @@
 #ifdef __linux__
 #include <sys/syscall.h>
 #include <linux/random.h>
+#ifdef OTTERY_FUTEX_LOCKS
+#include <linux/futex.h>
+#endif
+#if defined(__NR_getrandom) && !defined(OTTERY_DISABLE_VDSO) &&  \
+  !defined(OTTERY_RNG_NO_MMAP)
+#define USING_VGETRANDOM
+#include <sys/auxv.h>
+#include <elf.h>
+#include <link.h>
+#endif
 #endif
 
 #ifndef _WIN32
@@ -138,6 +289,14 @@
 #include <pthread.h>
 #endif
 
+/* Can we read the current CPU out of glibc's rseq area? */
+#if defined(OTTERY_PER_CPU_RNG) && defined(__GLIBC__) &&                \
+  (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35)) &&       \
+  defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#define OTTERY_HAVE_RSEQ
+#include <sys/rseq.h>
+#endif
+
 #ifndef OTTERY_DISABLE_EGD
 #ifdef _WIN32
 #include <winsock2.h>
@@ -179,6 +338,16 @@
 #include <ucontext.h>
 #endif
 
+#ifdef OTTERY_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef OTTERY_HAVE_SSSE3
+#include <tmmintrin.h>
+#endif
+#if defined(OTTERY_HAVE_X86_DISPATCH) && !defined(_MSC_VER)
+#include <immintrin.h>
+#endif
+
 #ifdef _MSC_VER
 #include <intrin.h>
 #include <immintrin.h>
@@ -204,6 +373,13 @@
 #define __attribute__(x)
 #endif
 
+/* Build a function for a CPU with more features than we're targeting. */
+#if defined(__GNUC__)
+#define OTTERY_TARGET(features) __attribute__((target(features)))
+#else
+#define OTTERY_TARGET(features)
+#endif
+
 #ifdef OTTERY_BUILDING_TESTS
 #define IF_TESTING(x) x
 #else
@@ -242,8 +418,12 @@ typedef unsigned char u8;
 #define ROTR64(x, n)  (((x) >> (n)) | ((x) << (64 - (n))))
 #define ROTR32(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
 
-#ifdef OTTERY_X86
-#define OTTERY_LITTLE_ENDIAN /* FFFF List more little-endian architectures */
+#if defined(OTTERY_X86) || defined(_M_ARM) || defined(_M_ARM64)
+#define OTTERY_LITTLE_ENDIAN
+#elif defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define OTTERY_LITTLE_ENDIAN
+#endif
 #endif
 
 /* Our crypto assumes that we read and write in little-endian order, so here
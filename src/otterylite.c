@@ -18,11 +18,15 @@
    expose them. */
 
 #include "otterylite_wipe.h"
+#include "otterylite_cpuid.h"
 #include "otterylite_rng.h"
+#include "otterylite_parallel.h"
+#include "otterylite_percpu.h"
 #include "otterylite_alloc.h"
 #include "otterylite_digest.h"
-#include "otterylite_entropy.h"
 #include "otterylite_locking.h"
+#include "otterylite_entropy.h"
+#include "otterylite_seedfile.h"
 
 
 /* Magic number for ottery_magic or ottery_state.magic */
@@ -30,8 +34,13 @@
 /* Magic number for the RNG structure */
 #define RNG_MAGIC 0x00480A01 /*ohai*/
 /* How many times can we generate a block of ChaCha20 stuff before we
-   reseed? */
+   reseed?  (Unless set_reseed_interval() says otherwise.) */
 #define RESEED_AFTER_BLOCKS 2048
+/* How many seconds can we go without a reseed?  (Likewise.) */
+#define RESEED_AFTER_SECONDS 600
+/* We reseed up to 1/RESEED_JITTER of the way early, at random, so that
+   identical processes don't all ask the kernel at once. */
+#define RESEED_JITTER 4
 
 #define OTTERY_MAGIC_MAKE_INVALID(m) ((m) = 0)
 #define OTTERY_MAGIC_MAKE_VALID(m) ((m) = OTTERY_MAGIC)
@@ -46,12 +55,21 @@
 #define SETPID(x) ((x) = getpid())
 #endif
 
+#ifdef USING_WIPEONFORK
+/* If MADV_WIPEONFORK didn't work on 'rng', we fall back to checking the
+   pid and the fork count. */
+#define WIPEONFORK_FAILED(rng) UNLIKELY((rng)->wipeonfork_failed)
+#else
+#define WIPEONFORK_FAILED(rng) 0
+#endif
+
 #if defined(OTTERY_DISABLE_LOCKING) || defined(_WIN32) ||       \
-  defined(USING_INHERIT_ZERO)
+  (defined(USING_INHERIT_ZERO) && !defined(USING_WIPEONFORK))
 /*
   no locking or no forking means no pthread_atfork.
 
-  INHERIT_ZERO means that we don't need pthread_atfork.
+  INHERIT_ZERO means that we don't need pthread_atfork.  (MADV_WIPEONFORK
+  might not work, though, so then we still want it.)
 */
 #define install_atfork_handler() ((void)0)
 #else
@@ -97,6 +115,48 @@ install_atfork_handler(void)
 }
 #endif
 
+#ifdef OTTERY_THREAD_LOCAL_RNG
+#if defined(OTTERY_STRUCT) || defined(OTTERY_DISABLE_LOCKING) ||        \
+  defined(_WIN32)
+#error "OTTERY_THREAD_LOCAL_RNG needs the static state and pthreads."
+#endif
+#if defined(OTTERY_RNG_NO_HEAP) && defined(OTTERY_RNG_NO_MMAP)
+#error "OTTERY_THREAD_LOCAL_RNG needs to allocate the RNGs."
+#endif
+#ifdef OTTERY_PER_CPU_RNG
+#error "Pick one of OTTERY_THREAD_LOCAL_RNG and OTTERY_PER_CPU_RNG."
+#endif
+#endif
+
+#ifdef OTTERY_PER_CPU_RNG
+#if defined(OTTERY_STRUCT) || defined(OTTERY_DISABLE_LOCKING) ||        \
+  !defined(__linux__)
+#error "OTTERY_PER_CPU_RNG needs Linux, the static state, and locking."
+#endif
+#if defined(OTTERY_RNG_NO_HEAP) && defined(OTTERY_RNG_NO_MMAP)
+#error "OTTERY_PER_CPU_RNG needs to allocate the RNGs."
+#endif
+#endif
+
+#ifdef OTTERY_EAGER_INIT
+#if defined(OTTERY_STRUCT) || defined(OTTERY_DISABLE_LOCKING) ||        \
+  defined(_WIN32) || !defined(__GNUC__)
+#error "OTTERY_EAGER_INIT needs the static state, pthreads, and constructors."
+#endif
+#endif
+
+#ifdef OTTERY_ASYNC_RESEED
+#if defined(OTTERY_STRUCT) || defined(OTTERY_DISABLE_LOCKING) ||        \
+  defined(_WIN32) || !defined(__GNUC__)
+#error "OTTERY_ASYNC_RESEED needs the static state, pthreads, and constructors."
+#endif
+#endif
+
+#if defined(OTTERY_THREAD_LOCAL_RNG) || defined(OTTERY_PER_CPU_RNG)
+/* We keep extra RNGs, keyed from the global one. */
+#define USING_LOCAL_RNG
+#endif
+
 #ifdef OTTERY_STRUCT
 /*
   Declaration for ottery_state.
@@ -110,9 +170,24 @@ struct ottery_state {
   pid_t pid;
 #endif
   unsigned forkcount;
+  int init_state;
+#ifndef _WIN32
+  pid_t init_pid;
+#endif
   int seeding;
   int entropy_status;
   unsigned seed_counter;
+  int reseed_policy;
+  int want_full_seed;
+  uint64_t reseed_nsec;
+  unsigned reseed_blocks;
+  unsigned reseed_secs;
+  uint64_t reseed_jitter;
+  unsigned reseed_at_count;
+  uint64_t reseed_at_time;
+  int pool_state;
+  unsigned pool_count;
+  u8 pool[OTTERY_DIGEST_LEN];
   DECLARE_RNG(rng)
 };
 #define LOCK()                                  \
@@ -140,6 +215,15 @@ static pid_t ottery_pid;
   The core RNG.  Probably a pointer to it, stored in an mmap.
 */
 static DECLARE_RNG(ottery_rng);
+/*
+  One of the INIT_* values below: is somebody seeding the RNG for the
+  first time right now?  See ottery_init_first().
+*/
+static int ottery_init_state;
+#ifndef _WIN32
+/* The PID of whoever set ottery_init_state to INIT_RUNNING. */
+static pid_t ottery_init_pid;
+#endif
 /*
   True if we are currently doing an on-demand seed because of having written
   too much already.  See ottery_seed.
@@ -150,9 +234,115 @@ static int ottery_seeding;
 */
 static int ottery_entropy_status;
 /*
-  How many times have we called ottery_seed?
+  How many times have we called ottery_seed, or rekeyed after a fork?
 */
 static unsigned ottery_seed_counter;
+/*
+  One of the OTTERY_RESEED_* values: what do we do when we've generated
+  enough output that it's time for a new key?
+*/
+static int ottery_reseed_policy;
+/*
+  True if somebody called ottery_need_reseed(), so the next reseed should
+  read every source whatever the policy says.
+*/
+static int ottery_want_full_seed;
+/*
+  How long the last automatic reseed took, in nanoseconds.
+*/
+static uint64_t ottery_reseed_nsec;
+/*
+  How many blocks and seconds we go between reseeds, or 0 for the
+  defaults.  See set_reseed_interval().
+*/
+static unsigned ottery_reseed_blocks;
+static unsigned ottery_reseed_secs;
+/*
+  Random bits from the last seed, to jitter the schedule with.
+*/
+static uint64_t ottery_reseed_jitter;
+/*
+  We reseed when the RNG's count goes over ottery_reseed_at_count, or when
+  the coarse clock gets to ottery_reseed_at_time.  See
+  ottery_schedule_reseed().
+*/
+static unsigned ottery_reseed_at_count;
+static uint64_t ottery_reseed_at_time;
+#ifdef OTTERY_ASYNC_RESEED
+/*
+  True if we've asked the reseed worker for a new key, and it hasn't given
+  us one yet.  See ottery_async_reseed_().
+*/
+static int ottery_async_pending;
+/* ottery_seed_counter when we asked. */
+static unsigned ottery_async_counter;
+/* If the RNG's count gets past this, or the coarse clock gets to
+   ottery_async_time_limit, we stop waiting for the worker. */
+static unsigned ottery_async_count_limit;
+static uint64_t ottery_async_time_limit;
+#endif
+/*
+  One of the POOL_* values below: has ottery_addrandom put something in
+  ottery_pool that we haven't folded into the RNG yet?
+*/
+static int ottery_pool_state;
+#ifndef USING_LOCAL_RNG
+/*
+  The RNG's count when we first noticed that the pool wasn't empty.
+*/
+static unsigned ottery_pool_count;
+#endif
+/*
+  A digest of everything that ottery_addrandom has given us since we last
+  folded it into the RNG.
+*/
+static u8 ottery_pool[OTTERY_DIGEST_LEN];
+#ifdef USING_LOCAL_RNG
+/*
+  Incremented whenever the global RNG gets a new key that the local
+  RNGs should pick up.  It's written rarely and read on every call, so we
+  keep it on its own cache line.
+*/
+static volatile unsigned ottery_generation __attribute__((aligned(64)));
+#define BUMP_GENERATION() (++ottery_generation)
+/*
+  A per-thread or per-CPU RNG.  Each one is keyed with output from the
+  global RNG, and gets a new key when it has generated too much, or when
+  the global RNG gets a new key.
+*/
+struct ottery_local_rng {
+  /* The RNG, or NULL if we haven't made one yet. */
+  struct ottery_rng *rng;
+  /* The value of ottery_generation when we last keyed 'rng'. */
+  unsigned generation;
+  /* The PID with which we last keyed 'rng'. */
+  pid_t pid;
+  /* How many blocks 'rng' can make before it needs a new key. */
+  unsigned rekey_blocks;
+  /* rng->count when we last checked whether it needed a new key. */
+  unsigned checked_count;
+};
+#endif
+#ifdef OTTERY_THREAD_LOCAL_RNG
+static __thread struct ottery_local_rng ottery_thread;
+#endif
+#ifdef OTTERY_PER_CPU_RNG
+/*
+  One of these for each CPU we can run on.  Each gets its own cache lines,
+  so that threads on different CPUs don't fight over them.
+*/
+struct ottery_shard {
+  DECLARE_LOCK(mutex)
+  struct ottery_local_rng local;
+} __attribute__((aligned(64)));
+/* Array of ottery_n_shards shards, allocated on first use. */
+static struct ottery_shard *ottery_shards;
+static unsigned ottery_n_shards;
+/* Maps CPU numbers to indices in ottery_shards. */
+static unsigned short ottery_shard_map[PERCPU_MAX_CPUS];
+/* The shard this thread has locked, if any. */
+static __thread struct ottery_shard *ottery_current_shard;
+#endif
 #define LOCK()                                  \
   do {                                          \
     GET_STATIC_LOCK(ottery_mutex);              \
@@ -163,32 +353,131 @@ static unsigned ottery_seed_counter;
   } while (0)
 #endif
 
+#ifndef BUMP_GENERATION
+#define BUMP_GENERATION() ((void)0)
+#endif
+
+/* Nothing in the pool. */
+#define POOL_EMPTY 0
+/* Something in the pool, and nobody has looked at it yet. */
+#define POOL_ADDED 1
+/* Something in the pool; we'll fold it in when the RNG's count changes. */
+#define POOL_WAITING 2
+
+/* Nobody is initializing the state. */
+#define INIT_IDLE 0
+/* Somebody is initializing the state, and everybody else should wait. */
+#define INIT_RUNNING 1
+
+IF_TESTING(static unsigned ottery_testing_seed_delay_usec; )
+
 #if OTTERY_DIGEST_LEN < OTTERY_KEYLEN
 /* If we ever need to use a 32-byte digest, we can pad it or stretch it
  * or something */
 #error "We need a digest that is longer then the key we mean to use."
 #endif
+#if OTTERY_DIGEST_LEN < OTTERY_KEYLEN + 8
+#error "We take the reseed jitter from the part of the digest after the key."
+#endif
+
+#if defined(CLOCK_MONOTONIC_COARSE)
+#define OTTERY_COARSE_CLOCK CLOCK_MONOTONIC_COARSE
+#elif defined(CLOCK_MONOTONIC_FAST)
+#define OTTERY_COARSE_CLOCK CLOCK_MONOTONIC_FAST
+#else
+#define OTTERY_COARSE_CLOCK CLOCK_MONOTONIC
+#endif
+
+/*
+  Return the time from some fixed point, in seconds.  We look at this on
+  every call, so we use the cheapest clock we have: it only needs to be
+  good to a few milliseconds.
+*/
+static inline uint64_t
+ottery_coarse_sec(void)
+{
+#ifdef _WIN32
+  return GetTickCount64() / 1000;
+#else
+  struct timespec ts;
+  clock_gettime(OTTERY_COARSE_CLOCK, &ts);
+  return ts.tv_sec;
+#endif
+}
+
+/*
+  Decide when the next automatic reseed happens: once the RNG has
+  generated reseed_blocks blocks, or reseed_secs seconds from now,
+  whichever comes first.  Each of those gets pulled in by up to
+  1/RESEED_JITTER, as reseed_jitter says.
+
+  Callers must hold the lock.
+*/
+static void
+ottery_schedule_reseed(OTTERY_STATE_ARG_ONLY)
+{
+  const unsigned blocks = STATE_FIELD(reseed_blocks) ?
+    STATE_FIELD(reseed_blocks) : RESEED_AFTER_BLOCKS;
+  const unsigned secs = STATE_FIELD(reseed_secs) ?
+    STATE_FIELD(reseed_secs) : RESEED_AFTER_SECONDS;
+  const uint32_t j_blocks = (uint32_t)STATE_FIELD(reseed_jitter);
+  const uint32_t j_secs = (uint32_t)(STATE_FIELD(reseed_jitter) >> 32);
+
+  STATE_FIELD(reseed_at_count) =
+    blocks - j_blocks % (blocks / RESEED_JITTER + 1);
+  STATE_FIELD(reseed_at_time) = ottery_coarse_sec() + secs -
+    j_secs % (secs / RESEED_JITTER + 1);
+}
+
+/*
+  We just gave the RNG a new key from 'digest'.  Take the jitter for the
+  next reseed from the bytes the key didn't use, and schedule it.
+
+  Callers must hold the lock.
+*/
+static void
+ottery_seeded(OTTERY_STATE_ARG_FIRST const u8 digest[OTTERY_DIGEST_LEN])
+{
+  memcpy(&STATE_FIELD(reseed_jitter), digest + OTTERY_KEYLEN, 8);
+  ottery_schedule_reseed(OTTERY_STATE_ARG_OUT);
+}
 
 /*
   Get entropy from the entropy sources, then fold it into the RNG state.
 
   If 'release_lock' is set, then drop the lock while we're reading all the
-  entropy sources.  (We use this when we're doing a "soft reseed" because of
-  having generated a lot of data.)
+  entropy sources, and while we're writing the seed file.  (We use this when
+  we're doing a "soft reseed" because of having generated a lot of data.)
+
+  If there's a seed file we haven't read, mix it in too.  A whole one
+  counts as a strong source: with it, unless somebody wants every source
+  read, one chunk from a strong source is enough for now, and the next
+  reseed reads everything.
 
   Callers must hold the lock.
 */
 static int
 ottery_seed(OTTERY_STATE_ARG_FIRST int release_lock)
 {
-  int n, new_status = 0;
+  int n, n_file = -1, new_status = 0;
+#ifdef USING_SEED_FILE
+  int seed_fd = -1, r;
+#endif
+  const int quick_ok = !STATE_FIELD(want_full_seed) &&
+    STATE_FIELD(reseed_policy) != OTTERY_RESEED_FULL;
+  int quick = 0;
   /*
     We generate one OTTERY_DIGEST_LEN-sized chunk when we begin, and another
-    when we're done.  In the middle, we generate up to OTTERY_ENTROPY_MAXLEN
-    bytes of new entropy.
+    when we're done.  In the middle, we put what we read from the seed file,
+    and up to OTTERY_ENTROPY_MAXLEN bytes of new entropy.
   */
-  unsigned char entropy[OTTERY_DIGEST_LEN * 2 + OTTERY_ENTROPY_MAXLEN];
+  unsigned char entropy[OTTERY_DIGEST_LEN * 2 + SEED_FILE_LEN +
+                        OTTERY_ENTROPY_MAXLEN];
   unsigned char digest[OTTERY_DIGEST_LEN];
+  unsigned char *live = entropy + OTTERY_DIGEST_LEN;
+#ifdef USING_SEED_FILE
+  unsigned char next_file[SEED_FILE_LEN];
+#endif
 
   /*
     Start out with some bytes from the current RNG state.  If the RNG is being
@@ -212,134 +501,635 @@ ottery_seed(OTTERY_STATE_ARG_FIRST int release_lock)
   /* Release the lock in this section, since it can take a while to get
    * entropy. */
 
-  n = ottery_getentropy(entropy + OTTERY_DIGEST_LEN, &new_status);
+#ifdef USING_SEED_FILE
+  n_file = ottery_seed_file_read_(live, &seed_fd);
+  if (n_file > 0)
+    live += n_file;
+  if (n_file == SEED_FILE_LEN && quick_ok &&
+      ottery_getentropy_fast(live) == 0)
+    {
+      n = ENTROPY_CHUNK;
+      new_status = 2;
+      quick = 1;
+    }
+  else
+#endif
+    n = ottery_getentropy(live, &new_status);
+#if defined(OTTERY_BUILDING_TESTS) && !defined(_WIN32)
+  if (ottery_testing_seed_delay_usec)
+    usleep(ottery_testing_seed_delay_usec);
+#endif
+
+  /*
+    If we didn't get enough entropy, or we got an error, we failed.  A seed
+    file doesn't stand in for live entropy: it could be a copy that some
+    other machine booted from too.  Put it back for next time.
+  */
+#ifdef USING_SEED_FILE
+  if (n < OTTERY_ENTROPY_MINLEN && n_file >= 0)
+    (void) ottery_seed_file_done_(seed_fd, NULL);
+#endif
 
   /* Once done, reacquire the lock. */
   if (release_lock)
     LOCK();
 
-  /*
-    If we didn't get enough entropy, or we got an error, we failed.
-  */
   if (n < OTTERY_ENTROPY_MINLEN)
     {
+      memwipe(entropy, sizeof(entropy));
       return -1;
     }
+  live += n;
+  /* If we read everything, that's what anybody who wanted it wanted. */
+  STATE_FIELD(want_full_seed) = quick;
 
   /*
     We do this again here in case more entropy got added in the meantime
     using ottery_addrandom or because of a fork.
   */
-  ottery_bytes(RNG_PTR, entropy + n + OTTERY_DIGEST_LEN, OTTERY_DIGEST_LEN);
+  ottery_bytes(RNG_PTR, live, OTTERY_DIGEST_LEN);
 
   /*
     Now compress the whole input down to an OTTERY_DIGEST_LEN-sized blob
   */
-  ottery_digest(digest, entropy, n + OTTERY_DIGEST_LEN * 2);
+  ottery_digest(digest, entropy, (size_t)(live + OTTERY_DIGEST_LEN - entropy));
 
   /*
     And update our current state once more
   */
-  STATE_FIELD(entropy_status) = new_status;
   STATE_FIELD(seeding) = 0;
   ottery_setkey(RNG_PTR, digest);
   RNG_PTR->count = 0;
   ++STATE_FIELD(seed_counter);
+  ottery_seeded(OTTERY_STATE_ARG_OUT COMMA digest);
+  BUMP_GENERATION();
+  STATE_FIELD(entropy_status) = new_status;
 
   memwipe(digest, sizeof(digest));
   memwipe(entropy, sizeof(entropy));
 
+#ifdef USING_SEED_FILE
+  /*
+    Nobody has seen any output from the new key yet.  Take the next run's
+    seed file from it before anybody does, and then write it without the
+    lock, since a flush to the disk can take a long time.
+
+    A whole file only counts as a strong source once it's been replaced on
+    the disk.  (Any key we've moved on to since then was made from this
+    one, so it still counts.)  If we couldn't replace it, and we leaned on
+    it to skip reading everything, read everything the next time anybody
+    asks.
+  */
+  if (n_file >= 0)
+    {
+      ottery_bytes(RNG_PTR, next_file, SEED_FILE_LEN);
+      if (release_lock)
+        UNLOCK();
+      r = ottery_seed_file_done_(seed_fd, next_file);
+      memwipe(next_file, sizeof(next_file));
+      if (release_lock)
+        LOCK();
+
+      if (r == 0 && n_file == SEED_FILE_LEN &&
+          STATE_FIELD(entropy_status) < 2)
+        {
+          STATE_FIELD(entropy_status) = 2;
+        }
+      else if (r < 0 && quick)
+        {
+          STATE_FIELD(reseed_at_time) = 0;
+          STATE_FIELD(want_full_seed) = 1;
+          BUMP_GENERATION();
+        }
+    }
+#endif
+
   return 0;
 }
 
-#if defined(USING_INHERIT_ZERO)
-/* If we really have inherit_zero, then we can avoid messing with pids
- * and atfork completely. */
-#define RNG_MAGIC_IS_OKAY() (RNG_PTR->magic == RNG_MAGIC)
-#define NEED_REINIT (!RNG_MAGIC_IS_OKAY())
-#else
 /*
-  Otherwise, we have one or two ways of telling whether we forked. We can look
-  to see if getpid() changed, or we can look to see whether the atfork handler
-  was called.  Neither is a perfect method.
+  Give the RNG a new key without reading every entropy source.
 
-  Checking for changes in getpid() can fail if a child doesn't use the RNG,
-  and the grandchild later gets the same pid as its grandparent.
+  A prefork server would otherwise do a whole ottery_seed() in each child,
+  and a long-running process would do one every few megabytes or minutes.
+  Instead, we take one chunk from a single strong source, and mix it with
+  output from the state we have (if it survived the fork) and our pid.  The
+  fresh chunk is what keeps a child independent of its parent and its
+  siblings, and what gets us a new key that an attacker who knew the old
+  one can't predict; the rest is just for luck.
 
-  pthread_atfork() can fail if we invoke the underlying fork() system call
-  directly, or if you clone() instead of fork()ing, or some other trickery.
+  Return 0 on success, -1 if we couldn't get a strong chunk, in which case
+  the caller should fall back to ottery_seed().
 
-  INHERIT_ZERO is a much better solution.
+  Callers must hold the lock.
 */
-#if !defined(USING_ATFORK)
-#define FORK_COUNT_INCREASED() 0
-#define RESET_FORK_COUNT() ((void)0)
-#elif defined(OTTERY_STRUCT)
-#define FORK_COUNT_INCREASED() (state->forkcount != ottery_fork_count)
-#define RESET_FORK_COUNT() (state->forkcount = ottery_fork_count);
+static int
+ottery_seed_fast(OTTERY_STATE_ARG_ONLY)
+{
+#ifdef _WIN32
+  unsigned char entropy[OTTERY_DIGEST_LEN + ENTROPY_CHUNK];
 #else
-#define FORK_COUNT_INCREASED() (ottery_fork_count != 0)
-#define RESET_FORK_COUNT() (ottery_fork_count = 0)
+  unsigned char entropy[OTTERY_DIGEST_LEN + ENTROPY_CHUNK + sizeof(pid_t)];
+  const pid_t pid = getpid();
 #endif
+  unsigned char digest[OTTERY_DIGEST_LEN];
 
-#define NEED_REINIT (!OTTERY_MAGIC_IS_OKAY(STATE_FIELD(magic)) ||       \
-                     !PID_OKAY(STATE_FIELD(pid)) ||                     \
-                     FORK_COUNT_INCREASED())
+  if (ottery_getentropy_fast(entropy + OTTERY_DIGEST_LEN) < 0)
+    return -1;
+
+  /* If the RNG got wiped or reallocated in a fork, this is just output
+     from key 0, which doesn't hurt anything. */
+  ottery_bytes(RNG_PTR, entropy, OTTERY_DIGEST_LEN);
+#ifndef _WIN32
+  memcpy(entropy + OTTERY_DIGEST_LEN + ENTROPY_CHUNK, &pid, sizeof(pid));
+#endif
+
+  ottery_digest(digest, entropy, sizeof(entropy));
+
+  /* We got our chunk from a source that ottery_getentropy() would have
+     called strong. */
+  STATE_FIELD(entropy_status) = 2;
+  ottery_setkey(RNG_PTR, digest);
+  RNG_PTR->count = 0;
+  ++STATE_FIELD(seed_counter);
+  ottery_seeded(OTTERY_STATE_ARG_OUT COMMA digest);
+  BUMP_GENERATION();
+
+  memwipe(digest, sizeof(digest));
+  memwipe(entropy, sizeof(entropy));
+
+  return 0;
+}
+
+/* Return the time from some fixed point, in nanoseconds. */
+static uint64_t
+ottery_monotonic_nsec(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000 +
+    (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 #endif
+}
 
+#ifdef OTTERY_ASYNC_RESEED
 /*
-  (Re)initialize a state.  If 'postfork' is set, then we just forked.
-  Otherwise, we're initializing it for the first time.
+  With OTTERY_ASYNC_RESEED, the thread that finds a routine reseed due
+  doesn't read the entropy sources itself.  It asks a worker thread to do
+  that, and everybody keeps using the old key until the worker folds in
+  the new one.  If that takes more than 1/ASYNC_RESEED_PATIENCE of the
+  reseed interval (in blocks or in seconds, and never more than
+  ASYNC_RESEED_MAX_SECONDS), we stop waiting and reseed the usual way.
+*/
+#define ASYNC_RESEED_PATIENCE 4
+#define ASYNC_RESEED_MAX_SECONDS 10
+
+static pthread_mutex_t ottery_async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ottery_async_cond = PTHREAD_COND_INITIALIZER;
+/* These three are protected by ottery_async_mutex: has somebody asked the
+   worker for entropy, should it read every source, and should it exit? */
+static int ottery_async_wanted;
+static int ottery_async_full;
+static int ottery_async_stop;
+/* The worker, and the process that started it (or 0 if there isn't one). */
+static pthread_t ottery_async_thread;
+static pid_t ottery_async_pid;
+static int ottery_async_atfork_installed;
 
-  Return 0 on success, -1 on failure.
+/*
+  The worker got 'n' bytes of entropy, with status 'status', which took
+  'nsec' nanoseconds.  Fold them into the key, if we still want them.
+
+  Callers must hold the lock.
 */
-static int
-  ottery_init_backend(OTTERY_STATE_ARG_FIRST int postfork)
+static void
+ottery_async_fold_(const u8 *entropy, int n, int status, uint64_t nsec)
 {
-  const int should_reallocate = !postfork
-#ifdef USING_INHERIT_NONE
-    /* If INHERIT_NONE is in use, we must always reallocate the mapping. */
-    || 1
-#endif
-    ;
+  u8 buf[OTTERY_DIGEST_LEN + OTTERY_ENTROPY_MAXLEN];
+  u8 digest[OTTERY_DIGEST_LEN];
 
-#ifdef OTTERY_STRUCT
-  if (!postfork)
-    INIT_LOCK(&STATE_FIELD(mutex));
+  if (!ottery_async_pending)
+    return;
+  /* If it didn't work, we keep waiting until we run out of patience. */
+  if (n < OTTERY_ENTROPY_MINLEN)
+    return;
+  ottery_async_pending = 0;
+  /* Maybe somebody reseeded, or tore down the RNG, while we waited. */
+  if (!OTTERY_MAGIC_IS_OKAY(ottery_magic) ||
+      ottery_seed_counter != ottery_async_counter)
+    return;
+
+  ottery_bytes(RNG_PTR, buf, OTTERY_DIGEST_LEN);
+  memcpy(buf + OTTERY_DIGEST_LEN, entropy, n);
+  ottery_digest(digest, buf, OTTERY_DIGEST_LEN + n);
+
+  ottery_entropy_status = status;
+  ottery_setkey(RNG_PTR, digest);
+  RNG_PTR->count = 0;
+  ++ottery_seed_counter;
+  ottery_seeded(digest);
+  BUMP_GENERATION();
+  ottery_reseed_nsec = nsec;
+
+  memwipe(digest, sizeof(digest));
+  memwipe(buf, sizeof(buf));
+}
+
+static void *
+ottery_async_worker_(void *arg)
+{
+  u8 entropy[OTTERY_ENTROPY_MAXLEN];
+  int n, status, full;
+  uint64_t start;
+
+  (void)arg;
+  for (;;)
+    {
+      pthread_mutex_lock(&ottery_async_mutex);
+      while (!ottery_async_wanted && !ottery_async_stop)
+        pthread_cond_wait(&ottery_async_cond, &ottery_async_mutex);
+      ottery_async_wanted = 0;
+      full = ottery_async_full;
+      if (ottery_async_stop)
+        {
+          pthread_mutex_unlock(&ottery_async_mutex);
+          break;
+        }
+      pthread_mutex_unlock(&ottery_async_mutex);
+
+      start = ottery_monotonic_nsec();
+      n = ENTROPY_CHUNK;
+      status = 2;
+      if (full || ottery_getentropy_fast(entropy) < 0)
+        n = ottery_getentropy(entropy, &status);
+#ifdef OTTERY_BUILDING_TESTS
+      if (ottery_testing_seed_delay_usec)
+        usleep(ottery_testing_seed_delay_usec);
 #endif
 
-  if (should_reallocate)
+      LOCK();
+      ottery_async_fold_(entropy, n, status, ottery_monotonic_nsec() - start);
+      UNLOCK();
+      memwipe(entropy, sizeof(entropy));
+    }
+  return NULL;
+}
+
+/*
+  Keep the worker from holding ottery_async_mutex across a fork.  The
+  child also needs a new condition variable: the old one still thinks the
+  parent's worker is waiting on it, and would give it our signals.
+*/
+static void
+ottery_async_prefork_(void)
+{
+  pthread_mutex_lock(&ottery_async_mutex);
+}
+static void
+ottery_async_postfork_parent_(void)
+{
+  pthread_mutex_unlock(&ottery_async_mutex);
+}
+static void
+ottery_async_postfork_child_(void)
+{
+  pthread_cond_init(&ottery_async_cond, NULL);
+  pthread_mutex_unlock(&ottery_async_mutex);
+}
+
+/*
+  Start a worker for this process.  Return 0 on success, -1 on failure.
+
+  Callers must hold the lock.
+*/
+static int
+ottery_async_start_(void)
+{
+  if (!ottery_async_atfork_installed)
     {
-      if (ALLOCATE_RNG(RNG_PTR) < 0)
+      if (pthread_atfork(ottery_async_prefork_,
+                         ottery_async_postfork_parent_,
+                         ottery_async_postfork_child_))
         return -1;
+      ottery_async_atfork_installed = 1;
     }
+  /* (In a child, these might be left over from the parent's worker.) */
+  ottery_async_wanted = ottery_async_stop = 0;
+  if (pthread_create(&ottery_async_thread, NULL, ottery_async_worker_, NULL))
+    return -1;
+  ottery_async_pid = getpid();
+  return 0;
+}
 
-  install_atfork_handler(); /* This should be idempotent. */
+/* Don't let the library get unloaded out from under the worker. */
+FINALIZER_FUNC(ottery_async_fini_)
+{
+  if (ottery_async_pid != getpid())
+    return;
+  pthread_mutex_lock(&ottery_async_mutex);
+  ottery_async_stop = 1;
+  pthread_cond_signal(&ottery_async_cond);
+  pthread_mutex_unlock(&ottery_async_mutex);
+  pthread_join(ottery_async_thread, NULL);
+  ottery_async_pid = 0;
+}
 
-  STATE_FIELD(entropy_status) = -2; /* We start out uninitialized */
+/*
+  A routine reseed is due.  Ask the worker for it, unless we already did.
+  Return 0 if the worker is on it, or -1 if the caller should reseed right
+  now: because we've waited too long, or because there's no worker.
+
+  Callers must hold the lock.  We drop it for a moment, as
+  ottery_seed() does.
+*/
+static int
+ottery_async_reseed_(void)
+{
+  unsigned blocks, secs;
+  int full;
 
-  if (ottery_seed(OTTERY_STATE_ARG_OUT COMMA 0) < 0)
+  if (ottery_async_pending)
     {
-      FREE_RNG(RNG_PTR);
-      RNG_PTR = NULL;
+      if (RNG_PTR->count <= ottery_async_count_limit &&
+          ottery_coarse_sec() < ottery_async_time_limit)
+        return 0;
+      ottery_async_pending = 0;
       return -1;
     }
 
-  RNG_PTR->magic = RNG_MAGIC;
-  RESET_FORK_COUNT();
-  OTTERY_MAGIC_MAKE_VALID(STATE_FIELD(magic));
-  SETPID(STATE_FIELD(pid));
+  if (ottery_async_pid != getpid() && ottery_async_start_() < 0)
+    return -1;
+
+  /* The same interval that ottery_schedule_reseed() uses. */
+  blocks = ottery_reseed_blocks ? ottery_reseed_blocks : RESEED_AFTER_BLOCKS;
+  secs = ottery_reseed_secs ? ottery_reseed_secs : RESEED_AFTER_SECONDS;
+  secs /= ASYNC_RESEED_PATIENCE;
+  if (secs > ASYNC_RESEED_MAX_SECONDS)
+    secs = ASYNC_RESEED_MAX_SECONDS;
+
+  ottery_async_pending = 1;
+  ottery_async_counter = ottery_seed_counter;
+  ottery_async_count_limit = RNG_PTR->count + blocks / ASYNC_RESEED_PATIENCE;
+  ottery_async_time_limit = ottery_coarse_sec() + secs;
+  full = (ottery_reseed_policy == OTTERY_RESEED_FULL);
+
+  /* Don't hold the lock while we wake the worker: if it gets our CPU,
+     the first thing it wants is that lock. */
+  UNLOCK();
+  pthread_mutex_lock(&ottery_async_mutex);
+  ottery_async_wanted = 1;
+  ottery_async_full = full;
+  pthread_cond_signal(&ottery_async_cond);
+  pthread_mutex_unlock(&ottery_async_mutex);
+  LOCK();
   return 0;
 }
+#endif
 
 /*
-  We've noted that we need to reinitialize.  Figure out whether it's because
-  of a fork, and act accordingly.
+  We've generated enough output that we want a new key.  Get one as the
+  reseed policy says, and remember how long it took.
+
+  Callers must hold the lock.
 */
-static int
-ottery_handle_reinit(OTTERY_STATE_ARG_ONLY)
+static void
+ottery_reseed(OTTERY_STATE_ARG_ONLY)
 {
-  int postfork;
+  uint64_t start;
+
+#ifdef OTTERY_ASYNC_RESEED
+  if (!STATE_FIELD(want_full_seed) && ottery_async_reseed_() == 0)
+    return;
+  /* If the worker comes back after all, we won't want what it has. */
+  ottery_async_pending = 0;
+#endif
+
+  start = ottery_monotonic_nsec();
+  if (STATE_FIELD(reseed_policy) == OTTERY_RESEED_FULL ||
+      STATE_FIELD(want_full_seed) ||
+      ottery_seed_fast(OTTERY_STATE_ARG_OUT) < 0)
+    ottery_seed(OTTERY_STATE_ARG_OUT COMMA 1);
+
+  STATE_FIELD(reseed_nsec) = ottery_monotonic_nsec() - start;
+}
+
+/*
+  Fold whatever ottery_addrandom has put in the pool into the RNG's key,
+  and empty the pool.  This doesn't tell the local RNGs: each one picks
+  the pool up with its next key, unless somebody calls flush_addrandom.
+
+  Callers must hold the lock.
+*/
+static void
+ottery_fold_pool(OTTERY_STATE_ARG_ONLY)
+{
+  u8 buf[OTTERY_DIGEST_LEN * 2];
+  u8 digest[OTTERY_DIGEST_LEN];
+
+  ottery_bytes(RNG_PTR, buf, OTTERY_DIGEST_LEN);
+  memcpy(buf + OTTERY_DIGEST_LEN, STATE_FIELD(pool), OTTERY_DIGEST_LEN);
+  ottery_digest(digest, buf, sizeof(buf));
+  ottery_setkey(RNG_PTR, digest);
+  RNG_PTR->count = 0;
+
+  memwipe(STATE_FIELD(pool), OTTERY_DIGEST_LEN);
+  STATE_FIELD(pool_state) = POOL_EMPTY;
+
+  memwipe(digest, sizeof(digest));
+  memwipe(buf, sizeof(buf));
+}
+
+/*
+  The pool isn't empty.  Fold it into the key if it's time.
+
+  Callers must hold the lock, and the RNG must be initialized.
+*/
+static void
+ottery_check_pool(OTTERY_STATE_ARG_ONLY)
+{
+#ifndef USING_LOCAL_RNG
+  /*
+    We wait until the RNG has started on a new buffer, so that somebody who
+    adds entropy between every call doesn't pay for a new key every time.
+    (The local RNGs only look at the global one when they need a key
+    anyway, so with them we fold as soon as one of them asks.)
+  */
+  if (STATE_FIELD(pool_state) == POOL_ADDED)
+    {
+      STATE_FIELD(pool_count) = RNG_PTR->count;
+      STATE_FIELD(pool_state) = POOL_WAITING;
+      return;
+    }
+  if (RNG_PTR->count == STATE_FIELD(pool_count))
+    return;
+#endif
+  ottery_fold_pool(OTTERY_STATE_ARG_OUT);
+}
+
+/*
+  Without INHERIT_ZERO, we have one or two ways of telling whether we forked.
+  We can look to see if getpid() changed, or we can look to see whether the
+  atfork handler was called.  Neither is a perfect method.
+
+  Checking for changes in getpid() can fail if a child doesn't use the RNG,
+  and the grandchild later gets the same pid as its grandparent.
+
+  pthread_atfork() can fail if we invoke the underlying fork() system call
+  directly, or if you clone() instead of fork()ing, or some other trickery.
+
+  INHERIT_ZERO is a much better solution.
+*/
+#if !defined(USING_ATFORK)
+#define FORK_COUNT_INCREASED() 0
+#define RESET_FORK_COUNT() ((void)0)
+#elif defined(OTTERY_STRUCT)
+#define FORK_COUNT_INCREASED() (state->forkcount != ottery_fork_count)
+#define RESET_FORK_COUNT() (state->forkcount = ottery_fork_count);
+#else
+#define FORK_COUNT_INCREASED() (ottery_fork_count != 0)
+#define RESET_FORK_COUNT() (ottery_fork_count = 0)
+#endif
+
+#if defined(USING_INHERIT_ZERO)
+/* If we really have inherit_zero, then we can avoid messing with pids
+ * and atfork completely.  (Unless MADV_WIPEONFORK turned out not to work
+ * on this RNG: then we need them after all.) */
+#define RNG_MAGIC_IS_OKAY() (RNG_PTR && RNG_PTR->magic == RNG_MAGIC)
+#define NEED_REINIT (!RNG_MAGIC_IS_OKAY() ||                            \
+                     (WIPEONFORK_FAILED(RNG_PTR) &&                     \
+                      (!PID_OKAY(STATE_FIELD(pid)) ||                   \
+                       FORK_COUNT_INCREASED())))
+#else
+#define NEED_REINIT (!OTTERY_MAGIC_IS_OKAY(STATE_FIELD(magic)) ||       \
+                     !PID_OKAY(STATE_FIELD(pid)) ||                     \
+                     FORK_COUNT_INCREASED())
+#endif
+
+/*
+  (Re)initialize a state.  If 'postfork' is set, then we just forked.
+  Otherwise, we're initializing it for the first time.  If 'release_lock'
+  is set, we hold the lock, and we drop it while we read the entropy
+  sources, as ottery_seed() does.
+
+  Return 0 on success, -1 on failure.
+*/
+static int
+  ottery_init_backend(OTTERY_STATE_ARG_FIRST int postfork, int release_lock)
+{
+  const int should_reallocate = !postfork
+#ifdef USING_INHERIT_NONE
+    /* If INHERIT_NONE is in use, we must always reallocate the mapping. */
+    || 1
+#endif
+    ;
+
+#ifdef OTTERY_STRUCT
+  if (!postfork)
+    INIT_LOCK(&STATE_FIELD(mutex));
+#endif
+
+  if (should_reallocate)
+    {
+      if (ALLOCATE_RNG(RNG_PTR) < 0)
+        return -1;
+    }
+  else
+    {
+      /* Whoever was filling the spare buffer didn't come with us. */
+      RNG_PTR->spare_state = SPARE_EMPTY;
+    }
+
+  install_atfork_handler(); /* This should be idempotent. */
+
+#ifdef OTTERY_ASYNC_RESEED
+  /* Whatever we asked the worker for, we're about to seed anyway.  And
+     if we don't have a worker in this process, this is a better time to
+     start one than in the middle of somebody's call. */
+  ottery_async_pending = 0;
+  if (ottery_async_pid != getpid())
+    (void) ottery_async_start_();
+#endif
+
+  /* Look at the CPU once, so we don't have to do it while generating. */
+  if (!postfork)
+    (void) chacha20_select_impl();
+
+#ifndef _WIN32
+  /* A child only needs to get away from its parent's stream; it can do
+     that with much less work than a full seed. */
+  if (postfork && ottery_seed_fast(OTTERY_STATE_ARG_OUT) == 0)
+    goto seeded;
+#endif
+
+  STATE_FIELD(entropy_status) = -2; /* We start out uninitialized */
+
+  if (ottery_seed(OTTERY_STATE_ARG_OUT COMMA release_lock) < 0)
+    {
+      FREE_RNG(RNG_PTR);
+      RNG_PTR = NULL;
+      return -1;
+    }
+
+#ifndef _WIN32
+ seeded:
+#endif
+
+  RNG_PTR->magic = RNG_MAGIC;
+  RESET_FORK_COUNT();
+  OTTERY_MAGIC_MAKE_VALID(STATE_FIELD(magic));
+  SETPID(STATE_FIELD(pid));
+  return 0;
+}
+
+/*
+  Initialize the state for the first time, from a call that wanted some
+  output.  Callers must hold the lock; we return with it held.
+
+  If the strong sources don't work, the first seed can take a long time,
+  so we don't hold the lock while we read them.  Instead, we mark the state
+  INIT_RUNNING, and anybody else who turns up in the meantime goes to sleep
+  until we're done.  (If the mark is left over from a thread in our parent
+  process, though, that thread isn't coming.)
+
+  Return 0 on success, -1 on failure.
+*/
+static int
+ottery_init_first(OTTERY_STATE_ARG_ONLY)
+{
+  int r;
+
+  while (STATE_FIELD(init_state) == INIT_RUNNING &&
+         PID_OKAY(STATE_FIELD(init_pid)))
+    {
+      UNLOCK();
+      ottery_wait_while_(&STATE_FIELD(init_state), INIT_RUNNING);
+      LOCK();
+    }
+  /* Maybe whoever we waited for did it for us. */
+  if (!NEED_REINIT)
+    return 0;
+
+  STATE_FIELD(init_state) = INIT_RUNNING;
+  SETPID(STATE_FIELD(init_pid));
+  r = ottery_init_backend(OTTERY_STATE_ARG_OUT COMMA 0, 1);
+  ottery_set_and_wake_(&STATE_FIELD(init_state), INIT_IDLE);
+  return r;
+}
+
+/*
+  We've noted that we need to reinitialize.  Figure out whether it's because
+  of a fork, and act accordingly.
+*/
+static int
+ottery_handle_reinit(OTTERY_STATE_ARG_ONLY)
+{
+  int postfork;
 
   /* ???? audit this carefully */
 #ifdef _WIN32
@@ -347,13 +1137,17 @@ ottery_handle_reinit(OTTERY_STATE_ARG_ONLY)
   postfork = 0;
 #elif defined(USING_INHERIT_ZERO)
   /* If the magic is set to something but the RNG magic got zeroed, we
-     forked. */
-  postfork = STATE_FIELD(magic) && RNG_PTR && RNG_PTR->magic == 0;
+     forked.  Without a working MADV_WIPEONFORK, we got here because the
+     pid or the fork count changed, so we forked too. */
+  postfork = STATE_FIELD(magic) && RNG_PTR &&
+    (RNG_PTR->magic == 0 || WIPEONFORK_FAILED(RNG_PTR));
 #else
   /* If the magic is set to something, we need to reinit. */
   postfork = STATE_FIELD(magic);
 #endif
-  return ottery_init_backend(OTTERY_STATE_ARG_OUT COMMA postfork);
+  if (!postfork)
+    return ottery_init_first(OTTERY_STATE_ARG_OUT);
+  return ottery_init_backend(OTTERY_STATE_ARG_OUT COMMA 1, 0);
 }
 
 #ifdef OTTERY_STRUCT
@@ -361,14 +1155,14 @@ void
 OTTERY_PUBLIC_FN2 (init)(OTTERY_STATE_ARG_ONLY)
 {
   memset(state, 0, sizeof(*state));
-  if (ottery_init_backend(OTTERY_STATE_ARG_OUT COMMA 0) < 0)
+  if (ottery_init_backend(OTTERY_STATE_ARG_OUT COMMA 0, 0) < 0)
     abort();
 }
 int
 OTTERY_PUBLIC_FN2 (try_init)(OTTERY_STATE_ARG_ONLY)
 {
   memset(state, 0, sizeof(*state));
-  return(ottery_init_backend(OTTERY_STATE_ARG_OUT COMMA 0) < 0 ? -1 : 0);
+  return(ottery_init_backend(OTTERY_STATE_ARG_OUT COMMA 0, 0) < 0 ? -1 : 0);
 }
 #endif
 
@@ -383,8 +1177,43 @@ OTTERY_PUBLIC_FN2 (teardown)(OTTERY_STATE_ARG_ONLY)
 #endif
   FREE_RNG(RNG_PTR);
   OTTERY_MAGIC_MAKE_INVALID(STATE_FIELD(magic));
+  memwipe(STATE_FIELD(pool), OTTERY_DIGEST_LEN);
+  STATE_FIELD(pool_state) = POOL_EMPTY;
+  /* The next seed is a whole new start. */
+  STATE_FIELD(want_full_seed) = 0;
+#ifdef OTTERY_THREAD_LOCAL_RNG
+  FREE_RNG(ottery_thread.rng);
+#endif
+#ifdef OTTERY_PER_CPU_RNG
+  if (ottery_shards)
+    {
+      unsigned i;
+      for (i = 0; i < ottery_n_shards; ++i)
+        {
+          GET_LOCK(&ottery_shards[i].mutex);
+          FREE_RNG(ottery_shards[i].local.rng);
+          RELEASE_LOCK(&ottery_shards[i].mutex);
+        }
+    }
+#endif
+#ifdef USING_LOCAL_RNG
+  /* Other threads will notice the new generation, and reinitialize. */
+  BUMP_GENERATION();
+#endif
+#ifndef OTTERY_STRUCT
+  /* (With OTTERY_STRUCT, other states might still want the devices.) */
+  ottery_devices_close();
+  ottery_entropy_memo_reset(~0u);
+#endif
 }
 
+/*
+  True if ottery_schedule_reseed() says it's time for a reseed.
+*/
+#define RESEED_DUE()                                            \
+  (RNG_PTR->count > STATE_FIELD(reseed_at_count) ||             \
+   ottery_coarse_sec() >= STATE_FIELD(reseed_at_time))
+
 /* XXXX document */
 static inline int
 init_or_reseed_as_needed(OTTERY_STATE_ARG_ONLY)
@@ -392,10 +1221,11 @@ init_or_reseed_as_needed(OTTERY_STATE_ARG_ONLY)
   if (UNLIKELY(NEED_REINIT)) {
     if (ottery_handle_reinit(OTTERY_STATE_ARG_OUT) < 0)
       return -1;
-  } else if (UNLIKELY(RNG_PTR->count > RESEED_AFTER_BLOCKS) &&
-             !STATE_FIELD(seeding)) {
-    ottery_seed(OTTERY_STATE_ARG_OUT COMMA 1);
+  } else if (UNLIKELY(RESEED_DUE()) && !STATE_FIELD(seeding)) {
+    ottery_reseed(OTTERY_STATE_ARG_OUT);
   }
+  if (UNLIKELY(STATE_FIELD(pool_state) != POOL_EMPTY))
+    ottery_check_pool(OTTERY_STATE_ARG_OUT);
   return 0;
 }
 
@@ -410,41 +1240,352 @@ init_or_reseed_as_needed(OTTERY_STATE_ARG_ONLY)
       abort();                                                  \
   } while (0)
 
+#ifdef USING_LOCAL_RNG
+/*
+  Did this local RNG come with us across a fork?  As with the global RNG,
+  INHERIT_ZERO tells us for sure; otherwise, we check the pid and the fork
+  count.
+*/
+#ifdef USING_INHERIT_ZERO
+#define LOCAL_FORKED(l) ((l)->rng->magic != RNG_MAGIC ||        \
+                         (WIPEONFORK_FAILED((l)->rng) &&        \
+                          (!PID_OKAY((l)->pid) || FORK_COUNT_INCREASED())))
+#else
+#define LOCAL_FORKED(l) (!PID_OKAY((l)->pid) || FORK_COUNT_INCREASED())
+#endif
+
+/*
+  The local RNG 'l' has started on a new buffer since we last looked.  Is it
+  time for a new key?
+
+  The local RNGs take a new key after as many blocks as the global RNG
+  would go between reseeds (that doesn't touch the kernel), but they also
+  have to look in when the global RNG's reseed is due by the clock.  We
+  only read the clock here, once a buffer, so that the calls in between
+  stay cheap.  (We read ottery_reseed_at_time without the lock: if we see
+  a torn value, we just rekey for nothing.)
+*/
+static inline int
+ottery_local_due(struct ottery_local_rng *l)
+{
+  l->checked_count = l->rng->count;
+  return l->rng->count > l->rekey_blocks ||
+    ottery_coarse_sec() >= ottery_reseed_at_time;
+}
+
+/* Check for a fork before we look inside the RNG: with INHERIT_NONE, the
+   child doesn't have it any more. */
+#define LOCAL_NEED_REKEY(l)                             \
+  ((l)->rng == NULL ||                                  \
+   (l)->generation != ottery_generation ||              \
+   LOCAL_FORKED(l) ||                                   \
+   ((l)->rng->count != (l)->checked_count &&            \
+    ottery_local_due(l)))
+
+/*
+  Give a local RNG a new key from the global RNG, creating it first if we
+  need to.  Abort on failure.
+*/
+static void
+ottery_local_rekey(struct ottery_local_rng *l)
+{
+  u8 key[OTTERY_KEYLEN];
+  unsigned generation, blocks;
+
+  if (l->rng != NULL && LOCAL_FORKED(l))
+    {
+#ifdef USING_INHERIT_NONE
+      /* The child didn't inherit the mapping, so there's nothing to free. */
+      l->rng = NULL;
+#endif
+    }
+
+  LOCK();
+  INIT();
+  ottery_bytes(RNG_PTR, key, sizeof(key));
+  generation = ottery_generation;
+  blocks = ottery_reseed_blocks ? ottery_reseed_blocks : RESEED_AFTER_BLOCKS;
+  UNLOCK();
+
+  if (l->rng == NULL && ALLOCATE_RNG(l->rng) < 0)
+    abort();
+
+  ottery_setkey(l->rng, key);
+  l->rng->magic = RNG_MAGIC;
+  l->generation = generation;
+  l->rekey_blocks = blocks;
+  l->checked_count = 0;
+  SETPID(l->pid);
+
+  memwipe(key, sizeof(key));
+}
+#endif
+
+#ifdef OTTERY_THREAD_LOCAL_RNG
+/* We use this key's destructor to wipe each thread's RNG when it exits. */
+static pthread_key_t ottery_thread_key;
+static pthread_once_t ottery_thread_key_once = PTHREAD_ONCE_INIT;
+
+static void
+ottery_thread_exit_(void *arg)
+{
+  struct ottery_local_rng *t = arg;
+  FREE_RNG(t->rng);
+}
+
+static void
+ottery_thread_key_init_(void)
+{
+  if (pthread_key_create(&ottery_thread_key, ottery_thread_exit_))
+    abort();
+}
+
+/*
+  Return this thread's RNG, ready to use.
+*/
+static inline struct ottery_rng *
+ottery_thread_rng(void)
+{
+  struct ottery_local_rng *t = &ottery_thread;
+  if (UNLIKELY(LOCAL_NEED_REKEY(t)))
+    {
+      ottery_local_rekey(t);
+      pthread_once(&ottery_thread_key_once, ottery_thread_key_init_);
+      pthread_setspecific(ottery_thread_key, t);
+    }
+  return t->rng;
+}
+
+/*
+  With a thread-local RNG, the common calls don't need to lock anything.
+*/
+#define ACQUIRE_RNG(rng) ((rng) = ottery_thread_rng())
+#define RELEASE_RNG() ((void)0)
+#elif defined(OTTERY_PER_CPU_RNG)
+static pthread_once_t ottery_shards_once = PTHREAD_ONCE_INIT;
+
+static void
+ottery_shards_init_(void)
+{
+  struct ottery_shard *shards;
+  unsigned i, n = percpu_cpuset_(ottery_shard_map);
+
+  if (posix_memalign((void **)&shards, sizeof(*shards), n * sizeof(*shards)))
+    abort();
+  memset(shards, 0, n * sizeof(*shards));
+  for (i = 0; i < n; ++i)
+    INIT_LOCK(&shards[i].mutex);
+
+  ottery_n_shards = n;
+  ottery_shards = shards;
+
+  /* A shard's first rekey would initialize the global RNG while holding
+     the shard's lock, and everybody else on that CPU would spin on it.
+     Do it here instead, where they wait in pthread_once. */
+  LOCK();
+  INIT();
+  UNLOCK();
+}
+
+/*
+  Lock the shard for the CPU we're running on, and return its RNG, ready
+  to use.  The lock is almost never contended: only a thread that gets
+  moved to another CPU in the middle of a call can collide with another.
+*/
+static inline struct ottery_rng *
+ottery_shard_acquire(void)
+{
+  struct ottery_shard *s;
+
+  pthread_once(&ottery_shards_once, ottery_shards_init_);
+  s = &ottery_shards[ottery_shard_map[percpu_current_cpu_()]];
+
+  GET_LOCK(&s->mutex);
+  if (UNLIKELY(LOCAL_NEED_REKEY(&s->local)))
+    ottery_local_rekey(&s->local);
+  ottery_current_shard = s;
+  return s->local.rng;
+}
+
+/*
+  Fill a spare buffer that we claimed for the shard 's' without holding its
+  lock, and hand it back.
+*/
+static void
+ottery_shard_refill_spare(struct ottery_shard *s, u8 *spare,
+                          u8 key[OTTERY_KEYLEN])
+{
+  ottery_fill_spare(spare, key);
+  GET_LOCK(&s->mutex);
+  ottery_spare_done(s->local.rng);
+  RELEASE_LOCK(&s->mutex);
+}
+
+#define ACQUIRE_RNG(rng) ((rng) = ottery_shard_acquire())
+#define RELEASE_RNG()                                                   \
+  do {                                                                  \
+    struct ottery_shard *s_ = ottery_current_shard;                     \
+    u8 spare_key_[OTTERY_KEYLEN];                                       \
+    u8 *spare_ = ottery_claim_spare(s_->local.rng, spare_key_);         \
+    RELEASE_LOCK(&s_->mutex);                                           \
+    if (UNLIKELY(spare_ != NULL))                                       \
+      ottery_shard_refill_spare(s_, spare_, spare_key_);                \
+  } while (0)
+#else
+/*
+  Fill a spare buffer that we claimed with ottery_claim_spare(), and hand it
+  back.  We call this without the lock, so that other threads don't have to
+  wait while we run ChaCha.
+*/
+static void
+ottery_refill_spare(OTTERY_STATE_ARG_FIRST u8 *spare, u8 key[OTTERY_KEYLEN])
+{
+  ottery_fill_spare(spare, key);
+  LOCK();
+  ottery_spare_done(RNG_PTR);
+  UNLOCK();
+}
+
+/*
+  Otherwise, lock the state and use the shared RNG.  On the way out, we
+  make the next buffer ahead of time if it's due.
+*/
+#define ACQUIRE_RNG(rng)                        \
+  do {                                          \
+    LOCK();                                     \
+    INIT();                                     \
+    (rng) = RNG_PTR;                            \
+  } while (0)
+#define RELEASE_RNG()                                                   \
+  do {                                                                  \
+    u8 spare_key_[OTTERY_KEYLEN];                                       \
+    u8 *spare_ = ottery_claim_spare(RNG_PTR, spare_key_);               \
+    UNLOCK();                                                           \
+    if (UNLIKELY(spare_ != NULL))                                       \
+      ottery_refill_spare(OTTERY_STATE_ARG_OUT COMMA spare_, spare_key_); \
+  } while (0)
+#endif
+
+#ifdef OTTERY_EAGER_INIT
+/*
+  We start seeding on this thread when the library gets loaded.  Anybody
+  who wants the RNG before it's done waits for it in ottery_init_first().
+*/
+static pthread_t ottery_eager_thread;
+/* The process that started ottery_eager_thread, or 0 if it's joined. */
+static pid_t ottery_eager_pid;
+
+static void *
+ottery_eager_init_fn_(void *arg)
+{
+  (void)arg;
+  LOCK();
+  /* If this fails, the first real call tries again (and aborts). */
+  (void) init_or_reseed_as_needed(OTTERY_STATE_ARG_OUT);
+  UNLOCK();
+  return NULL;
+}
+
+/*
+  The helper thread might be holding one of our locks when somebody else
+  forks, and then the child could never get it.  So we take them all
+  before a fork, and release them afterwards in both processes.  (This
+  can't deadlock: nobody takes more than one of the entropy locks at a
+  time, and nobody waits for the RNG lock while holding one.)
+*/
+static void
+ottery_eager_prefork_(void)
+{
+  LOCK();
+  GET_STATIC_LOCK(ottery_entropy_memo_mutex);
+  GET_STATIC_LOCK(ottery_device_mutex);
+#ifdef USING_VGETRANDOM
+  GET_STATIC_LOCK(ottery_vgetrandom_mutex);
+#endif
+#ifdef USING_SEED_FILE
+  GET_STATIC_LOCK(ottery_seed_file_mutex);
+#endif
+}
+
+static void
+ottery_eager_postfork_(void)
+{
+#ifdef USING_SEED_FILE
+  RELEASE_STATIC_LOCK(ottery_seed_file_mutex);
+#endif
+#ifdef USING_VGETRANDOM
+  RELEASE_STATIC_LOCK(ottery_vgetrandom_mutex);
+#endif
+  RELEASE_STATIC_LOCK(ottery_device_mutex);
+  RELEASE_STATIC_LOCK(ottery_entropy_memo_mutex);
+  UNLOCK();
+}
+
+/* Wait for the helper thread to finish, if it's ours and still around. */
+static void
+ottery_eager_join_(void)
+{
+  if (ottery_eager_pid == getpid())
+    pthread_join(ottery_eager_thread, NULL);
+  ottery_eager_pid = 0;
+}
+
+INITIALIZER_FUNC(ottery_eager_init_)
+{
+  /* (If we get dlclose()d, the C library forgets these handlers.) */
+  if (pthread_atfork(ottery_eager_prefork_, ottery_eager_postfork_,
+                     ottery_eager_postfork_))
+    return;
+  if (pthread_create(&ottery_eager_thread, NULL,
+                     ottery_eager_init_fn_, NULL) == 0)
+    ottery_eager_pid = getpid();
+}
+
+/* Don't let the library get unloaded out from under the helper thread. */
+FINALIZER_FUNC(ottery_eager_fini_)
+{
+  ottery_eager_join_();
+}
+#endif
+
 void
 OTTERY_PUBLIC_FN2 (need_reseed)(OTTERY_STATE_ARG_ONLY)
 {
   LOCK();
-  RNG_PTR->count = RESEED_AFTER_BLOCKS + 1;
+  STATE_FIELD(reseed_at_time) = 0;
+  STATE_FIELD(want_full_seed) = 1;
+  BUMP_GENERATION();
   UNLOCK();
 }
 
 unsigned
 OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_ONLY)
 {
+  struct ottery_rng *rng;
   unsigned result;
 
-  LOCK();
-  INIT();
-  ottery_bytes(RNG_PTR, &result, sizeof(result));
-  UNLOCK();
+  ACQUIRE_RNG(rng);
+  ottery_bytes(rng, &result, sizeof(result));
+  RELEASE_RNG();
   return result;
 }
 
 uint64_t
 OTTERY_PUBLIC_FN (random64)(OTTERY_STATE_ARG_ONLY)
 {
+  struct ottery_rng *rng;
   uint64_t result;
 
-  LOCK();
-  INIT();
-  ottery_bytes(RNG_PTR, &result, sizeof(result));
-  UNLOCK();
+  ACQUIRE_RNG(rng);
+  ottery_bytes(rng, &result, sizeof(result));
+  RELEASE_RNG();
   return result;
 }
 
 unsigned
 OTTERY_PUBLIC_FN (random_uniform)(OTTERY_STATE_ARG_FIRST unsigned upper)
 {
+  struct ottery_rng *rng;
   unsigned divisor, result;
 
   if (upper == 0)
@@ -454,20 +1595,20 @@ OTTERY_PUBLIC_FN (random_uniform)(OTTERY_STATE_ARG_FIRST unsigned upper)
 
   divisor = UINT_MAX / upper;
 
-  LOCK();
-  INIT();
+  ACQUIRE_RNG(rng);
   do
     {
-      ottery_bytes(RNG_PTR, &result, sizeof(result));
+      ottery_bytes(rng, &result, sizeof(result));
       result /= divisor;
     } while (result >= upper);
-  UNLOCK();
+  RELEASE_RNG();
   return result;
 }
 
 uint64_t
 OTTERY_PUBLIC_FN (random_uniform64)(OTTERY_STATE_ARG_FIRST uint64_t upper)
 {
+  struct ottery_rng *rng;
   uint64_t divisor, result;
 
   if (upper == 0)
@@ -475,63 +1616,127 @@ OTTERY_PUBLIC_FN (random_uniform64)(OTTERY_STATE_ARG_FIRST uint64_t upper)
 
   divisor = UINT64_MAX / upper;
 
-  LOCK();
-  INIT();
+  ACQUIRE_RNG(rng);
   do
     {
-      ottery_bytes(RNG_PTR, &result, sizeof(result));
+      ottery_bytes(rng, &result, sizeof(result));
       result /= divisor;
     } while (result >= upper);
-  UNLOCK();
+  RELEASE_RNG();
   return result;
 }
 
 #define LARGE_BUFFER_CUTOFF  (OTTERY_BUFLEN - OTTERY_KEYLEN)
 
-void
-OTTERY_PUBLIC_FN (random_buf)(OTTERY_STATE_ARG_FIRST void *output, size_t n)
+#ifndef OTTERY_NONTEMPORAL_CUTOFF
+#define OTTERY_NONTEMPORAL_CUTOFF (4 << 20)
+#endif
+
+/*
+  Fill a large buffer: take a fresh key from the RNG, and expand it outside
+  the lock, using up to 'n_threads' threads.
+
+  For really large buffers, we use non-temporal stores.  Those need aligned
+  output, so we fill any unaligned head of the buffer straight from the RNG,
+  just like we do for the partial block at the end.
+*/
+static void
+ottery_random_buf_large(OTTERY_STATE_ARG_FIRST void *output, size_t n,
+                        int n_threads)
 {
+  u8 key[OTTERY_KEYLEN + 2 * (CHACHA_BLOCKSIZE - 1)];
+  u8 *out = output;
+  size_t head = 0, leftovers;
+  int nontemporal = 0;
+
+#if OTTERY_NONTEMPORAL_CUTOFF > 0
+  if (n >= OTTERY_NONTEMPORAL_CUTOFF)
+    {
+      nontemporal = 1;
+      head = (CHACHA_NT_ALIGN - ((uintptr_t)out & (CHACHA_NT_ALIGN - 1))) &
+        (CHACHA_NT_ALIGN - 1);
+    }
+#endif
+  leftovers = (n - head) & (CHACHA_BLOCKSIZE - 1);
+
   LOCK();
   INIT();
+  ottery_bytes(RNG_PTR, key, OTTERY_KEYLEN + head + leftovers);
+  UNLOCK();
+  memcpy(out, key + OTTERY_KEYLEN, head);
+  chacha20_blocks_parallel(key, (n - head) / CHACHA_BLOCKSIZE, out + head,
+                           n_threads, nontemporal);
+  memcpy(out + (n - leftovers),
+         key + OTTERY_KEYLEN + head,
+         leftovers);
+  memwipe(key, sizeof(key));
+}
+
+void
+OTTERY_PUBLIC_FN (random_buf)(OTTERY_STATE_ARG_FIRST void *output, size_t n)
+{
   if (n < LARGE_BUFFER_CUTOFF)
     {
-      ottery_bytes(RNG_PTR, output, n);
-      UNLOCK();
+      struct ottery_rng *rng;
+      ACQUIRE_RNG(rng);
+      ottery_bytes(rng, output, n);
+      RELEASE_RNG();
     }
   else
     {
-      u8 key[OTTERY_KEYLEN + CHACHA_BLOCKSIZE - 1];
-      size_t leftovers = n & (CHACHA_BLOCKSIZE - 1);
-      ottery_bytes(RNG_PTR, key, OTTERY_KEYLEN + leftovers);
-      UNLOCK();
-      chacha20_blocks(key, n / CHACHA_BLOCKSIZE, output);
-      memcpy(((u8*)output) + (n - leftovers),
-             key + OTTERY_KEYLEN,
-             leftovers);
-      memwipe(key, sizeof(key));
+      ottery_random_buf_large(OTTERY_STATE_ARG_OUT COMMA output, n, 1);
     }
 }
 
+void
+OTTERY_PUBLIC_FN (random_buf_parallel)(OTTERY_STATE_ARG_FIRST void *output,
+                                       size_t n, int n_threads)
+{
+  if (n < LARGE_BUFFER_CUTOFF)
+    OTTERY_PUBLIC_FN (random_buf)(OTTERY_STATE_ARG_OUT COMMA output, n);
+  else
+    ottery_random_buf_large(OTTERY_STATE_ARG_OUT COMMA output, n, n_threads);
+}
+
 void
 OTTERY_PUBLIC_FN2 (addrandom)(OTTERY_STATE_ARG_FIRST const unsigned char *inp, int n)
 {
+  u8 buf[OTTERY_DIGEST_LEN * 2];
+
   if (n <= 0)
     return;
+
+  /*
+    Digest the input before we take the lock: it could be long.  Then all
+    we do with the lock held is hash that into the pool, which is one
+    BLAKE2 block.  We won't change the key until somebody needs output.
+  */
+  ottery_digest(buf + OTTERY_DIGEST_LEN, inp, n);
+
+  LOCK();
+  memcpy(buf, STATE_FIELD(pool), OTTERY_DIGEST_LEN);
+  ottery_digest(STATE_FIELD(pool), buf, sizeof(buf));
+  if (STATE_FIELD(pool_state) == POOL_EMPTY)
+    STATE_FIELD(pool_state) = POOL_ADDED;
+  UNLOCK();
+
+  memwipe(buf, sizeof(buf));
+}
+
+void
+OTTERY_PUBLIC_FN2 (flush_addrandom)(OTTERY_STATE_ARG_ONLY)
+{
+  int pending;
+
   LOCK();
+  /* INIT() might fold the pool itself, if the local RNGs are waiting. */
+  pending = STATE_FIELD(pool_state) != POOL_EMPTY;
   INIT();
-  {
-    u8 buf[OTTERY_DIGEST_LEN * 2];
-    u8 digest[OTTERY_DIGEST_LEN];
-
-    ottery_bytes(RNG_PTR, buf, OTTERY_DIGEST_LEN);
-    ottery_digest(buf + OTTERY_DIGEST_LEN, inp, n);
-    ottery_digest(digest, buf, sizeof(buf));
-    ottery_setkey(RNG_PTR, digest);
-    RNG_PTR->count = 0;
-
-    memwipe(digest, sizeof(digest));
-    memwipe(buf, sizeof(buf));
-  }
+  if (STATE_FIELD(pool_state) != POOL_EMPTY)
+    ottery_fold_pool(OTTERY_STATE_ARG_OUT);
+  /* Make the local RNGs come and get it now. */
+  if (pending)
+    BUMP_GENERATION();
   UNLOCK();
 }
 
@@ -553,10 +1758,103 @@ OTTERY_PUBLIC_FN (set_egd_address)(const struct sockaddr *sa, int socklen)
       memcpy(&ottery_egd_sockaddr, sa, socklen);
       ottery_egd_socklen = socklen;
     }
+  /* It might work now, even if it didn't before. */
+  ottery_entropy_memo_reset(ID_EGD);
+  return 0;
+}
+#endif
+
+int
+OTTERY_PUBLIC_FN2 (open_devices)(void)
+{
+  return ottery_devices_open();
+}
+
+void
+OTTERY_PUBLIC_FN2 (close_devices)(void)
+{
+  ottery_devices_close();
+}
+
+void
+OTTERY_PUBLIC_FN2 (reprobe_entropy)(void)
+{
+  ottery_devices_forget_missing();
+  ottery_entropy_memo_reset(~0u);
+}
+
+#ifdef USING_SEED_FILE
+int
+OTTERY_PUBLIC_FN (set_seed_file)(const char *path)
+{
+  size_t len = 0;
+  int fd;
+
+  if (path && *path)
+    {
+      len = strlen(path);
+      if (len >= sizeof(ottery_seed_file_path))
+        {
+          errno = ENAMETOOLONG;
+          return -1;
+        }
+      /* Tell the caller now if we can't use it, rather than ignoring it
+         later. */
+      fd = ottery_seed_file_open_(path, 0);
+      if (fd >= 0)
+        close(fd);
+      else if (errno != ENOENT)
+        return -1;
+    }
+
+  GET_STATIC_LOCK(ottery_seed_file_mutex);
+  if (len)
+    memcpy(ottery_seed_file_path, path, len + 1);
+  else
+    ottery_seed_file_path[0] = '\0';
+  ottery_seed_file_unread = len != 0;
+  RELEASE_STATIC_LOCK(ottery_seed_file_mutex);
   return 0;
 }
 #endif
 
+void
+OTTERY_PUBLIC_FN2 (set_reseed_policy)(OTTERY_STATE_ARG_FIRST int policy)
+{
+  LOCK();
+  STATE_FIELD(reseed_policy) = policy;
+  UNLOCK();
+}
+
+void
+OTTERY_PUBLIC_FN2 (set_reseed_interval)(OTTERY_STATE_ARG_FIRST size_t bytes,
+                                        unsigned seconds)
+{
+  const size_t per_block = OTTERY_BUFLEN - OTTERY_KEYLEN;
+  size_t blocks = (bytes + per_block - 1) / per_block;
+
+  if (blocks > UINT_MAX)
+    blocks = UINT_MAX;
+  LOCK();
+  STATE_FIELD(reseed_blocks) = (unsigned)blocks;
+  STATE_FIELD(reseed_secs) = seconds;
+  ottery_schedule_reseed(OTTERY_STATE_ARG_OUT);
+  /* The local RNGs pick up the new schedule with their next key. */
+  BUMP_GENERATION();
+  UNLOCK();
+}
+
+ottery_u64_t
+OTTERY_PUBLIC_FN2 (last_reseed_nsec)(OTTERY_STATE_ARG_ONLY)
+{
+  uint64_t r;
+
+  LOCK();
+  r = STATE_FIELD(reseed_nsec);
+  UNLOCK();
+  return r;
+}
+
 int
 OTTERY_PUBLIC_FN2 (status)(OTTERY_STATE_ARG_ONLY)
 {
@@ -110,17 +110,33 @@ int OTTERY_PUBLIC_FN2 (try_init)(OTTERY_STATE_ARG_ONLY);
 void OTTERY_PUBLIC_FN2 (teardown)(OTTERY_STATE_ARG_ONLY);
 void OTTERY_PUBLIC_FN2 (need_reseed)(OTTERY_STATE_ARG_ONLY);
 void OTTERY_PUBLIC_FN2 (addrandom)(OTTERY_STATE_ARG_FIRST const unsigned char *inp, int n);
+void OTTERY_PUBLIC_FN2 (flush_addrandom)(OTTERY_STATE_ARG_ONLY);
 int OTTERY_PUBLIC_FN2 (status)(OTTERY_STATE_ARG_ONLY);
+int OTTERY_PUBLIC_FN2 (open_devices)(void);
+void OTTERY_PUBLIC_FN2 (close_devices)(void);
+void OTTERY_PUBLIC_FN2 (reprobe_entropy)(void);
+
+/* Reseed policies, for set_reseed_policy(). */
+#define OTTERY_RESEED_FAST 0
+#define OTTERY_RESEED_FULL 1
+void OTTERY_PUBLIC_FN2 (set_reseed_policy)(OTTERY_STATE_ARG_FIRST int policy);
+void OTTERY_PUBLIC_FN2 (set_reseed_interval)(OTTERY_STATE_ARG_FIRST size_t bytes, unsigned seconds);
+ottery_u64_t OTTERY_PUBLIC_FN2 (last_reseed_nsec)(OTTERY_STATE_ARG_ONLY);
 unsigned OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_ONLY);
 ottery_u64_t OTTERY_PUBLIC_FN (random64)(OTTERY_STATE_ARG_ONLY);
 unsigned OTTERY_PUBLIC_FN (random_uniform)(OTTERY_STATE_ARG_FIRST unsigned limit);
 ottery_u64_t OTTERY_PUBLIC_FN (random_uniform64)(OTTERY_STATE_ARG_FIRST ottery_u64_t limit);
 void OTTERY_PUBLIC_FN (random_buf)(OTTERY_STATE_ARG_FIRST void *out, size_t n);
+void OTTERY_PUBLIC_FN (random_buf_parallel)(OTTERY_STATE_ARG_FIRST void *out, size_t n, int n_threads);
 
 #ifdef OTTERY_BE_ARC4RANDOM
 #define arc4random_stir() ((void)0)
 #endif
 
+#ifndef _WIN32
+int OTTERY_PUBLIC_FN (set_seed_file)(const char *path);
+#endif
+
 #ifndef OTTERY_DISABLE_EGD
 struct sockaddr;
 int OTTERY_PUBLIC_FN (set_egd_address)(const struct sockaddr *sa, int socklen);
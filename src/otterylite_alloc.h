@@ -193,11 +193,27 @@ allocate_rng_(struct ottery_rng **rng)
       *rng = NULL;
       return -1;
     }
+#elif defined(MADV_WIPEONFORK)
+  /*
+    This is Linux's version of INHERIT_ZERO.  If the kernel doesn't know
+    about it (it's older than 4.14), we leave the child with a copy of the
+    RNG, and notice the fork by checking the pid and the fork count.  (We
+    can't use MADV_DONTFORK then: a child that touched the RNG would
+    crash.)  We remember that in the RNG itself, since it's this mapping
+    that we have to worry about.
+  */
+#define USING_INHERIT_ZERO
+#define USING_WIPEONFORK
+  (*rng)->wipeonfork_failed =
+    madvise(*rng, sizeof(**rng), MADV_WIPEONFORK) < 0;
+#ifdef MADV_DONTDUMP
+  (void) madvise(*rng, sizeof(**rng), MADV_DONTDUMP);
+#endif
 #elif defined(MADV_DONTFORK)
 #define USING_INHERIT_NONE
   if (madvise(*rng, sizeof(**rng), MADV_DONTFORK) < 0
 #ifdef MADV_DONTDUMP
-      || madvise(*rng, sizeof(**rng), MADV_DONTDUMP) < 0)
+      || madvise(*rng, sizeof(**rng), MADV_DONTDUMP) < 0
 #endif
       )
     {
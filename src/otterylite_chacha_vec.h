@@ -0,0 +1,104 @@
+/* otterylite_chacha_vec.h -- portable vectorized ChaCha20 */
+
+/*
+  To the extent possible under law, Nick Mathewson has waived all copyright and
+  related or neighboring rights to libottery-lite, using the creative commons
+  "cc0" public domain dedication.  See doc/cc0.txt or
+  <http://creativecommons.org/publicdomain/zero/1.0/> for full details.
+*/
+
+/*
+  This is the same algorithm as the kernels in otterylite_chacha_x86.h, but
+  written with the GCC/clang vector extensions instead of intrinsics.  The
+  compiler turns it into NEON, AltiVec, or whatever else the target has.
+  It's not as fast as hand-written code, but it's a lot faster than doing
+  one block at a time.
+*/
+
+#ifndef OTTERYLITE_CHACHA_VEC_H_INCLUDED
+#define OTTERYLITE_CHACHA_VEC_H_INCLUDED
+
+#ifdef OTTERY_HAVE_VECTOR_EXT
+
+/* How many blocks do we do at once with the generic vector code? */
+#define CHACHA_VEC_BLOCKS 4
+
+typedef uint32_t chacha_vec_u32 __attribute__((vector_size(16)));
+
+#define VEC_SPLAT(w) ((chacha_vec_u32){ (w), (w), (w), (w) })
+#define VEC_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define VEC_QUARTER_ROUND(a, b, c, d)           \
+  do {                                          \
+    a += b; d ^= a; d = VEC_ROTL(d, 16);        \
+    c += d; b ^= c; b = VEC_ROTL(b, 12);        \
+    a += b; d ^= a; d = VEC_ROTL(d, 8);         \
+    c += d; b ^= c; b = VEC_ROTL(b, 7);         \
+  } while (0)
+
+static void
+chacha20_blocks_vec_(uint32_t x[16], size_t n_blocks, unsigned char *output)
+{
+  const chacha_vec_u32 lanes = { 0, 1, 2, 3 };
+  chacha_vec_u32 in[16], v[16];
+  uint32_t y[16];
+  size_t i;
+  int j, k;
+
+  for (j = 0; j < 16; ++j)
+    {
+      in[j] = VEC_SPLAT(x[j]);
+    }
+
+  for (i = 0; i < n_blocks; i += CHACHA_VEC_BLOCKS)
+    {
+      /* Each lane gets its own block counter.  Comparisons yield -1 in
+         each lane where they're true, so subtracting carries. */
+      in[12] = VEC_SPLAT(x[12]) + lanes;
+      in[13] = VEC_SPLAT(x[13]) -
+        (chacha_vec_u32)(in[12] < VEC_SPLAT(x[12]));
+
+      memcpy(v, in, sizeof(v));
+
+      for (j = 0; j < (CHACHA_ROUNDS / 2); ++j)
+        {
+          VEC_QUARTER_ROUND(v[0], v[4], v[8], v[12]);
+          VEC_QUARTER_ROUND(v[1], v[5], v[9], v[13]);
+          VEC_QUARTER_ROUND(v[2], v[6], v[10], v[14]);
+          VEC_QUARTER_ROUND(v[3], v[7], v[11], v[15]);
+          VEC_QUARTER_ROUND(v[0], v[5], v[10], v[15]);
+          VEC_QUARTER_ROUND(v[1], v[6], v[11], v[12]);
+          VEC_QUARTER_ROUND(v[2], v[7], v[8], v[13]);
+          VEC_QUARTER_ROUND(v[3], v[4], v[9], v[14]);
+        }
+
+      for (j = 0; j < 16; ++j)
+        {
+          v[j] += in[j];
+        }
+
+      /* Pull each block out of its lane. */
+      for (k = 0; k < CHACHA_VEC_BLOCKS; ++k)
+        {
+          for (j = 0; j < 16; ++j)
+            y[j] = v[j][k];
+          write_u32_le(output, y, 16);
+          output += CHACHA_BLOCKSIZE;
+        }
+
+      x[12] += CHACHA_VEC_BLOCKS;
+      if (x[12] < CHACHA_VEC_BLOCKS)
+        ++x[13];
+    }
+
+  memwipe(in, sizeof(in));
+  memwipe(v, sizeof(v));
+  memwipe(y, sizeof(y));
+}
+
+#undef VEC_SPLAT
+#undef VEC_ROTL
+#undef VEC_QUARTER_ROUND
+
+#endif /* OTTERY_HAVE_VECTOR_EXT */
+#endif /* OTTERYLITE_CHACHA_VEC_H_INCLUDED */
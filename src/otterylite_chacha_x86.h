@@ -0,0 +1,487 @@
+/* otterylite_chacha_x86.h -- vectorized ChaCha20 for x86 CPUs */
+
+/*
+  To the extent possible under law, Nick Mathewson has waived all copyright and
+  related or neighboring rights to libottery-lite, using the creative commons
+  "cc0" public domain dedication.  See doc/cc0.txt or
+  <http://creativecommons.org/publicdomain/zero/1.0/> for full details.
+*/
+
+/*
+  These functions compute several ChaCha20 blocks at once.  Vector j holds
+  word j of each block, one block per lane, so the rounds look just like the
+  scalar ones.  Afterwards, we transpose the vectors back into blocks.
+
+  Every function here takes the same arguments as chacha20_blocks_ref_(), and
+  must produce the same output.  The number of blocks must be a multiple of
+  the function's width.
+
+  Each kernel also has an _nt_ version, which writes its output with
+  non-temporal stores, so that a huge request doesn't push everything else
+  out of the cache.  Those need 'output' to be CHACHA_NT_ALIGN-byte aligned.
+*/
+
+#ifndef OTTERYLITE_CHACHA_X86_H_INCLUDED
+#define OTTERYLITE_CHACHA_X86_H_INCLUDED
+
+#ifdef OTTERY_HAVE_SSE2
+
+/* How many blocks do we do at once with SSE2? */
+#define CHACHA_SSE2_BLOCKS 4
+
+#define SSE2_ROTL(v, n)                                                 \
+  _mm_or_si128(_mm_slli_epi32((v), (n)), _mm_srli_epi32((v), 32 - (n)))
+#ifdef OTTERY_HAVE_SSSE3
+/* With SSSE3, rotating by a multiple of 8 bits is a single byte shuffle. */
+#define SSE2_ROTL16(v) _mm_shuffle_epi8((v), rot16)
+#define SSE2_ROTL8(v) _mm_shuffle_epi8((v), rot8)
+#else
+/* Without it, we can still swap the 16-bit halves of each word. */
+#define SSE2_ROTL16(v)                                          \
+  _mm_shufflehi_epi16(_mm_shufflelo_epi16((v), 0xb1), 0xb1)
+#define SSE2_ROTL8(v) SSE2_ROTL((v), 8)
+#endif
+
+#define SSE2_QUARTER_ROUND(a, b, c, d)          \
+  do {                                          \
+    a = _mm_add_epi32(a, b);                    \
+    d = SSE2_ROTL16(_mm_xor_si128(d, a));       \
+    c = _mm_add_epi32(c, d);                    \
+    b = SSE2_ROTL(_mm_xor_si128(b, c), 12);     \
+    a = _mm_add_epi32(a, b);                    \
+    d = SSE2_ROTL8(_mm_xor_si128(d, a));        \
+    c = _mm_add_epi32(c, d);                    \
+    b = SSE2_ROTL(_mm_xor_si128(b, c), 7);      \
+  } while (0)
+
+#define SSE2_STORE(p, v)                                \
+  do {                                                  \
+    if (nontemporal)                                    \
+      _mm_stream_si128((__m128i*)(p), (v));             \
+    else                                                \
+      _mm_storeu_si128((__m128i*)(p), (v));             \
+  } while (0)
+
+/*
+  Given four vectors holding words j..j+3 of four consecutive blocks,
+  transpose them and store them as words j..j+3 of each block at 'out'.
+*/
+#define SSE2_STORE4(out, a, b, c, d)                                    \
+  do {                                                                  \
+    __m128i t0_ = _mm_unpacklo_epi32((a), (b));                         \
+    __m128i t1_ = _mm_unpacklo_epi32((c), (d));                         \
+    __m128i t2_ = _mm_unpackhi_epi32((a), (b));                         \
+    __m128i t3_ = _mm_unpackhi_epi32((c), (d));                         \
+    SSE2_STORE((out) + 0 * CHACHA_BLOCKSIZE,                            \
+               _mm_unpacklo_epi64(t0_, t1_));                           \
+    SSE2_STORE((out) + 1 * CHACHA_BLOCKSIZE,                            \
+               _mm_unpackhi_epi64(t0_, t1_));                           \
+    SSE2_STORE((out) + 2 * CHACHA_BLOCKSIZE,                            \
+               _mm_unpacklo_epi64(t2_, t3_));                           \
+    SSE2_STORE((out) + 3 * CHACHA_BLOCKSIZE,                            \
+               _mm_unpackhi_epi64(t2_, t3_));                           \
+  } while (0)
+
+static void
+chacha20_blocks_sse2_impl_(uint32_t x[16], size_t n_blocks,
+                           unsigned char *output, const int nontemporal)
+{
+#ifdef OTTERY_HAVE_SSSE3
+  const __m128i rot16 = _mm_set_epi8(13, 12, 15, 14, 9, 8, 11, 10,
+                                     5, 4, 7, 6, 1, 0, 3, 2);
+  const __m128i rot8 = _mm_set_epi8(14, 13, 12, 15, 10, 9, 8, 11,
+                                    6, 5, 4, 7, 2, 1, 0, 3);
+#endif
+  const __m128i lanes = _mm_set_epi32(3, 2, 1, 0);
+  /* We flip the top bit of each word to do unsigned comparisons. */
+  const __m128i bias = _mm_set1_epi32(INT_MIN);
+  __m128i in[16], v[16];
+  size_t i;
+  int j;
+
+  for (j = 0; j < 16; ++j)
+    {
+      in[j] = _mm_set1_epi32((int)x[j]);
+    }
+
+  for (i = 0; i < n_blocks; i += CHACHA_SSE2_BLOCKS)
+    {
+      __m128i carry;
+
+      /* Each lane gets its own block counter.  If the low word wraps
+         around, carry into the high word. */
+      in[12] = _mm_add_epi32(_mm_set1_epi32((int)x[12]), lanes);
+      carry = _mm_cmpgt_epi32(_mm_xor_si128(_mm_set1_epi32((int)x[12]), bias),
+                              _mm_xor_si128(in[12], bias));
+      in[13] = _mm_sub_epi32(_mm_set1_epi32((int)x[13]), carry);
+
+      memcpy(v, in, sizeof(v));
+
+      for (j = 0; j < (CHACHA_ROUNDS / 2); ++j)
+        {
+          SSE2_QUARTER_ROUND(v[0], v[4], v[8], v[12]);
+          SSE2_QUARTER_ROUND(v[1], v[5], v[9], v[13]);
+          SSE2_QUARTER_ROUND(v[2], v[6], v[10], v[14]);
+          SSE2_QUARTER_ROUND(v[3], v[7], v[11], v[15]);
+          SSE2_QUARTER_ROUND(v[0], v[5], v[10], v[15]);
+          SSE2_QUARTER_ROUND(v[1], v[6], v[11], v[12]);
+          SSE2_QUARTER_ROUND(v[2], v[7], v[8], v[13]);
+          SSE2_QUARTER_ROUND(v[3], v[4], v[9], v[14]);
+        }
+
+      for (j = 0; j < 16; ++j)
+        {
+          v[j] = _mm_add_epi32(v[j], in[j]);
+        }
+
+      SSE2_STORE4(output, v[0], v[1], v[2], v[3]);
+      SSE2_STORE4(output + 16, v[4], v[5], v[6], v[7]);
+      SSE2_STORE4(output + 32, v[8], v[9], v[10], v[11]);
+      SSE2_STORE4(output + 48, v[12], v[13], v[14], v[15]);
+      output += CHACHA_SSE2_BLOCKS * CHACHA_BLOCKSIZE;
+
+      x[12] += CHACHA_SSE2_BLOCKS;
+      if (x[12] < CHACHA_SSE2_BLOCKS)
+        ++x[13];
+    }
+
+  memwipe(in, sizeof(in));
+  memwipe(v, sizeof(v));
+}
+
+static void
+chacha20_blocks_sse2_(uint32_t x[16], size_t n_blocks, unsigned char *output)
+{
+  chacha20_blocks_sse2_impl_(x, n_blocks, output, 0);
+}
+
+static void
+chacha20_blocks_sse2_nt_(uint32_t x[16], size_t n_blocks,
+                         unsigned char *output)
+{
+  chacha20_blocks_sse2_impl_(x, n_blocks, output, 1);
+  _mm_sfence();
+}
+
+#undef SSE2_ROTL
+#undef SSE2_ROTL16
+#undef SSE2_ROTL8
+#undef SSE2_QUARTER_ROUND
+#undef SSE2_STORE4
+#undef SSE2_STORE
+
+#endif /* OTTERY_HAVE_SSE2 */
+
+#ifdef OTTERY_HAVE_X86_DISPATCH
+
+/*
+  AVX2: Eight blocks at a time.
+*/
+#define CHACHA_AVX2_BLOCKS 8
+
+#define AVX2_ROTL(v, n)                                                 \
+  _mm256_or_si256(_mm256_slli_epi32((v), (n)),                          \
+                  _mm256_srli_epi32((v), 32 - (n)))
+#define AVX2_ROTL16(v) _mm256_shuffle_epi8((v), rot16)
+#define AVX2_ROTL8(v) _mm256_shuffle_epi8((v), rot8)
+
+#define AVX2_QUARTER_ROUND(a, b, c, d)          \
+  do {                                          \
+    a = _mm256_add_epi32(a, b);                 \
+    d = AVX2_ROTL16(_mm256_xor_si256(d, a));    \
+    c = _mm256_add_epi32(c, d);                 \
+    b = AVX2_ROTL(_mm256_xor_si256(b, c), 12);  \
+    a = _mm256_add_epi32(a, b);                 \
+    d = AVX2_ROTL8(_mm256_xor_si256(d, a));     \
+    c = _mm256_add_epi32(c, d);                 \
+    b = AVX2_ROTL(_mm256_xor_si256(b, c), 7);   \
+  } while (0)
+
+/*
+  Transpose words j..j+3 of eight blocks, within each 128-bit half.
+  Afterwards, the low half of r[k] holds words j..j+3 of block k, and the
+  high half holds them for block k+4.
+*/
+#define AVX2_TRANSPOSE4(r, a, b, c, d)                          \
+  do {                                                          \
+    __m256i t0_ = _mm256_unpacklo_epi32((a), (b));              \
+    __m256i t1_ = _mm256_unpacklo_epi32((c), (d));              \
+    __m256i t2_ = _mm256_unpackhi_epi32((a), (b));              \
+    __m256i t3_ = _mm256_unpackhi_epi32((c), (d));              \
+    (r)[0] = _mm256_unpacklo_epi64(t0_, t1_);                   \
+    (r)[1] = _mm256_unpackhi_epi64(t0_, t1_);                   \
+    (r)[2] = _mm256_unpacklo_epi64(t2_, t3_);                   \
+    (r)[3] = _mm256_unpackhi_epi64(t2_, t3_);                   \
+  } while (0)
+
+#define AVX2_STORE(p, v)                                \
+  do {                                                  \
+    if (nontemporal)                                    \
+      _mm256_stream_si256((__m256i*)(p), (v));          \
+    else                                                \
+      _mm256_storeu_si256((__m256i*)(p), (v));          \
+  } while (0)
+
+OTTERY_TARGET("avx2")
+static void
+chacha20_blocks_avx2_impl_(uint32_t x[16], size_t n_blocks,
+                           unsigned char *output, const int nontemporal)
+{
+  const __m256i rot16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10,
+                                        5, 4, 7, 6, 1, 0, 3, 2,
+                                        13, 12, 15, 14, 9, 8, 11, 10,
+                                        5, 4, 7, 6, 1, 0, 3, 2);
+  const __m256i rot8 = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11,
+                                       6, 5, 4, 7, 2, 1, 0, 3,
+                                       14, 13, 12, 15, 10, 9, 8, 11,
+                                       6, 5, 4, 7, 2, 1, 0, 3);
+  const __m256i lanes = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+  const __m256i bias = _mm256_set1_epi32(INT_MIN);
+  __m256i in[16], v[16], r[16];
+  size_t i;
+  int j, k;
+
+  for (j = 0; j < 16; ++j)
+    {
+      in[j] = _mm256_set1_epi32((int)x[j]);
+    }
+
+  for (i = 0; i < n_blocks; i += CHACHA_AVX2_BLOCKS)
+    {
+      __m256i carry;
+
+      in[12] = _mm256_add_epi32(_mm256_set1_epi32((int)x[12]), lanes);
+      carry = _mm256_cmpgt_epi32(
+                 _mm256_xor_si256(_mm256_set1_epi32((int)x[12]), bias),
+                 _mm256_xor_si256(in[12], bias));
+      in[13] = _mm256_sub_epi32(_mm256_set1_epi32((int)x[13]), carry);
+
+      memcpy(v, in, sizeof(v));
+
+      for (j = 0; j < (CHACHA_ROUNDS / 2); ++j)
+        {
+          AVX2_QUARTER_ROUND(v[0], v[4], v[8], v[12]);
+          AVX2_QUARTER_ROUND(v[1], v[5], v[9], v[13]);
+          AVX2_QUARTER_ROUND(v[2], v[6], v[10], v[14]);
+          AVX2_QUARTER_ROUND(v[3], v[7], v[11], v[15]);
+          AVX2_QUARTER_ROUND(v[0], v[5], v[10], v[15]);
+          AVX2_QUARTER_ROUND(v[1], v[6], v[11], v[12]);
+          AVX2_QUARTER_ROUND(v[2], v[7], v[8], v[13]);
+          AVX2_QUARTER_ROUND(v[3], v[4], v[9], v[14]);
+        }
+
+      for (j = 0; j < 16; ++j)
+        {
+          v[j] = _mm256_add_epi32(v[j], in[j]);
+        }
+
+      AVX2_TRANSPOSE4(r + 0, v[0], v[1], v[2], v[3]);
+      AVX2_TRANSPOSE4(r + 4, v[4], v[5], v[6], v[7]);
+      AVX2_TRANSPOSE4(r + 8, v[8], v[9], v[10], v[11]);
+      AVX2_TRANSPOSE4(r + 12, v[12], v[13], v[14], v[15]);
+
+      /* Now put the halves back together into whole blocks. */
+      for (k = 0; k < 4; ++k)
+        {
+          unsigned char *lo = output + k * CHACHA_BLOCKSIZE;
+          unsigned char *hi = output + (k + 4) * CHACHA_BLOCKSIZE;
+          AVX2_STORE(lo, _mm256_permute2x128_si256(r[k], r[k + 4], 0x20));
+          AVX2_STORE(lo + 32,
+                     _mm256_permute2x128_si256(r[k + 8], r[k + 12], 0x20));
+          AVX2_STORE(hi, _mm256_permute2x128_si256(r[k], r[k + 4], 0x31));
+          AVX2_STORE(hi + 32,
+                     _mm256_permute2x128_si256(r[k + 8], r[k + 12], 0x31));
+        }
+      output += CHACHA_AVX2_BLOCKS * CHACHA_BLOCKSIZE;
+
+      x[12] += CHACHA_AVX2_BLOCKS;
+      if (x[12] < CHACHA_AVX2_BLOCKS)
+        ++x[13];
+    }
+
+  memwipe(in, sizeof(in));
+  memwipe(v, sizeof(v));
+  memwipe(r, sizeof(r));
+}
+
+OTTERY_TARGET("avx2")
+static void
+chacha20_blocks_avx2_(uint32_t x[16], size_t n_blocks, unsigned char *output)
+{
+  chacha20_blocks_avx2_impl_(x, n_blocks, output, 0);
+}
+
+OTTERY_TARGET("avx2")
+static void
+chacha20_blocks_avx2_nt_(uint32_t x[16], size_t n_blocks,
+                         unsigned char *output)
+{
+  chacha20_blocks_avx2_impl_(x, n_blocks, output, 1);
+  _mm_sfence();
+}
+
+#undef AVX2_ROTL
+#undef AVX2_ROTL16
+#undef AVX2_ROTL8
+#undef AVX2_QUARTER_ROUND
+#undef AVX2_TRANSPOSE4
+#undef AVX2_STORE
+
+/*
+  AVX-512: Sixteen blocks at a time.  Here we have a real rotate
+  instruction (vprold), so we don't need to shift or shuffle.
+*/
+#define CHACHA_AVX512_BLOCKS 16
+
+#define AVX512_QUARTER_ROUND(a, b, c, d)                        \
+  do {                                                          \
+    a = _mm512_add_epi32(a, b);                                 \
+    d = _mm512_rol_epi32(_mm512_xor_si512(d, a), 16);           \
+    c = _mm512_add_epi32(c, d);                                 \
+    b = _mm512_rol_epi32(_mm512_xor_si512(b, c), 12);           \
+    a = _mm512_add_epi32(a, b);                                 \
+    d = _mm512_rol_epi32(_mm512_xor_si512(d, a), 8);            \
+    c = _mm512_add_epi32(c, d);                                 \
+    b = _mm512_rol_epi32(_mm512_xor_si512(b, c), 7);            \
+  } while (0)
+
+/*
+  Transpose words j..j+3 of sixteen blocks, within each 128-bit lane.
+  Afterwards, lane L of r[k] holds words j..j+3 of block 4*L+k.
+*/
+#define AVX512_TRANSPOSE4(r, a, b, c, d)                        \
+  do {                                                          \
+    __m512i t0_ = _mm512_unpacklo_epi32((a), (b));              \
+    __m512i t1_ = _mm512_unpacklo_epi32((c), (d));              \
+    __m512i t2_ = _mm512_unpackhi_epi32((a), (b));              \
+    __m512i t3_ = _mm512_unpackhi_epi32((c), (d));              \
+    (r)[0] = _mm512_unpacklo_epi64(t0_, t1_);                   \
+    (r)[1] = _mm512_unpackhi_epi64(t0_, t1_);                   \
+    (r)[2] = _mm512_unpacklo_epi64(t2_, t3_);                   \
+    (r)[3] = _mm512_unpackhi_epi64(t2_, t3_);                   \
+  } while (0)
+
+/*
+  GCC's AVX-512 headers fill unused result lanes with a deliberately
+  uninitialized placeholder, and then GCC warns about it.
+*/
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+#define AVX512_STORE(p, v)                              \
+  do {                                                  \
+    if (nontemporal)                                    \
+      _mm512_stream_si512((void*)(p), (v));             \
+    else                                                \
+      _mm512_storeu_si512((p), (v));                    \
+  } while (0)
+
+OTTERY_TARGET("avx512f")
+static void
+chacha20_blocks_avx512_impl_(uint32_t x[16], size_t n_blocks,
+                             unsigned char *output, const int nontemporal)
+{
+  const __m512i lanes = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8,
+                                         7, 6, 5, 4, 3, 2, 1, 0);
+  const __m512i one = _mm512_set1_epi32(1);
+  __m512i in[16], v[16], r[16];
+  size_t i;
+  int j, k;
+
+  for (j = 0; j < 16; ++j)
+    {
+      in[j] = _mm512_set1_epi32((int)x[j]);
+    }
+
+  for (i = 0; i < n_blocks; i += CHACHA_AVX512_BLOCKS)
+    {
+      __mmask16 carry;
+
+      in[12] = _mm512_add_epi32(_mm512_set1_epi32((int)x[12]), lanes);
+      carry = _mm512_cmplt_epu32_mask(in[12], _mm512_set1_epi32((int)x[12]));
+      in[13] = _mm512_mask_add_epi32(_mm512_set1_epi32((int)x[13]), carry,
+                                     _mm512_set1_epi32((int)x[13]), one);
+
+      memcpy(v, in, sizeof(v));
+
+      for (j = 0; j < (CHACHA_ROUNDS / 2); ++j)
+        {
+          AVX512_QUARTER_ROUND(v[0], v[4], v[8], v[12]);
+          AVX512_QUARTER_ROUND(v[1], v[5], v[9], v[13]);
+          AVX512_QUARTER_ROUND(v[2], v[6], v[10], v[14]);
+          AVX512_QUARTER_ROUND(v[3], v[7], v[11], v[15]);
+          AVX512_QUARTER_ROUND(v[0], v[5], v[10], v[15]);
+          AVX512_QUARTER_ROUND(v[1], v[6], v[11], v[12]);
+          AVX512_QUARTER_ROUND(v[2], v[7], v[8], v[13]);
+          AVX512_QUARTER_ROUND(v[3], v[4], v[9], v[14]);
+        }
+
+      for (j = 0; j < 16; ++j)
+        {
+          v[j] = _mm512_add_epi32(v[j], in[j]);
+        }
+
+      AVX512_TRANSPOSE4(r + 0, v[0], v[1], v[2], v[3]);
+      AVX512_TRANSPOSE4(r + 4, v[4], v[5], v[6], v[7]);
+      AVX512_TRANSPOSE4(r + 8, v[8], v[9], v[10], v[11]);
+      AVX512_TRANSPOSE4(r + 12, v[12], v[13], v[14], v[15]);
+
+      /*
+        Lane L of r[4*g+k] holds words 4g..4g+3 of block 4L+k.  For each k,
+        that's a 4x4 transpose of 128-bit lanes.
+      */
+      for (k = 0; k < 4; ++k)
+        {
+          __m512i t0 = _mm512_shuffle_i32x4(r[k], r[k + 4], 0x44);
+          __m512i t1 = _mm512_shuffle_i32x4(r[k], r[k + 4], 0xee);
+          __m512i t2 = _mm512_shuffle_i32x4(r[k + 8], r[k + 12], 0x44);
+          __m512i t3 = _mm512_shuffle_i32x4(r[k + 8], r[k + 12], 0xee);
+          AVX512_STORE(output + (k + 0) * CHACHA_BLOCKSIZE,
+                       _mm512_shuffle_i32x4(t0, t2, 0x88));
+          AVX512_STORE(output + (k + 4) * CHACHA_BLOCKSIZE,
+                       _mm512_shuffle_i32x4(t0, t2, 0xdd));
+          AVX512_STORE(output + (k + 8) * CHACHA_BLOCKSIZE,
+                       _mm512_shuffle_i32x4(t1, t3, 0x88));
+          AVX512_STORE(output + (k + 12) * CHACHA_BLOCKSIZE,
+                       _mm512_shuffle_i32x4(t1, t3, 0xdd));
+        }
+      output += CHACHA_AVX512_BLOCKS * CHACHA_BLOCKSIZE;
+
+      x[12] += CHACHA_AVX512_BLOCKS;
+      if (x[12] < CHACHA_AVX512_BLOCKS)
+        ++x[13];
+    }
+
+  memwipe(in, sizeof(in));
+  memwipe(v, sizeof(v));
+  memwipe(r, sizeof(r));
+}
+
+OTTERY_TARGET("avx512f")
+static void
+chacha20_blocks_avx512_(uint32_t x[16], size_t n_blocks, unsigned char *output)
+{
+  chacha20_blocks_avx512_impl_(x, n_blocks, output, 0);
+}
+
+OTTERY_TARGET("avx512f")
+static void
+chacha20_blocks_avx512_nt_(uint32_t x[16], size_t n_blocks,
+                           unsigned char *output)
+{
+  chacha20_blocks_avx512_impl_(x, n_blocks, output, 1);
+  _mm_sfence();
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#undef AVX512_QUARTER_ROUND
+#undef AVX512_TRANSPOSE4
+#undef AVX512_STORE
+
+#endif /* OTTERY_HAVE_X86_DISPATCH */
+#endif /* OTTERYLITE_CHACHA_X86_H_INCLUDED */
@@ -0,0 +1,99 @@
+/* otterylite_cpuid.h -- find out what the CPU supports */
+
+/*
+  To the extent possible under law, Nick Mathewson has waived all copyright and
+  related or neighboring rights to libottery-lite, using the creative commons
+  "cc0" public domain dedication.  See doc/cc0.txt or
+  <http://creativecommons.org/publicdomain/zero/1.0/> for full details.
+*/
+
+#ifndef OTTERYLITE_CPUID_H_INCLUDED
+#define OTTERYLITE_CPUID_H_INCLUDED
+
+#ifdef OTTERY_X86
+
+/*
+  CPUID implementation.  We always ask for subleaf 0, which is what leaf 7
+  wants, and which the other leaves we use ignore.
+*/
+#ifdef _MSC_VER
+#define cpuid_(i, result) __cpuidex((int*)(result), (i), 0)
+#else
+static void
+cpuid_(int index, unsigned result[4])
+{
+  unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+#ifdef OTTERY_X86_64
+  __asm("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+        : "0" (index), "2" (0));
+#else
+  __asm volatile (
+                  "xchgl %%ebx, %1; cpuid; xchgl %%ebx, %1"
+                  : "=a" (eax), "=r" (ebx), "=c" (ecx), "=d" (edx)
+                  : "0" (index), "2" (0)
+                  : "cc");
+#endif
+  result[0] = eax;
+  result[1] = ebx;
+  result[2] = ecx;
+  result[3] = edx;
+}
+#endif
+
+#ifdef OTTERY_HAVE_X86_DISPATCH
+
+#define CPU_AVX2    (1u << 0)
+#define CPU_AVX512F (1u << 1)
+
+/* Read the OS-enabled register state mask from XCR0. */
+#ifdef _MSC_VER
+#define xgetbv_() ((uint64_t)_xgetbv(0))
+#else
+static uint64_t
+xgetbv_(void)
+{
+  unsigned int eax, edx;
+
+  __asm volatile (".byte 0x0f, 0x01, 0xd0" /* xgetbv */
+                  : "=a" (eax), "=d" (edx) : "c" (0));
+  return ((uint64_t)edx << 32) | eax;
+}
+#endif
+
+/*
+  Return a bitmask of the CPU_* features that both the CPU and the OS
+  support.  (The OS has to save the wide registers on a context switch, or
+  we can't use them.)
+*/
+static unsigned
+cpu_features_(void)
+{
+  unsigned result[4], max_leaf;
+  unsigned features = 0;
+  uint64_t xcr0 = 0;
+
+  cpuid_(0, result);
+  max_leaf = result[0];
+  if (max_leaf < 1)
+    return 0;
+
+  cpuid_(1, result);
+  if (0 == (result[2] & (1u << 27)))
+    return 0; /* No OSXSAVE, so no AVX of any kind. */
+  xcr0 = xgetbv_();
+
+  if (max_leaf < 7 || (xcr0 & 0x6) != 0x6)
+    return 0; /* The OS doesn't save the YMM registers. */
+
+  cpuid_(7, result);
+  if (result[1] & (1u << 5))
+    features |= CPU_AVX2;
+  if ((result[1] & (1u << 16)) && (xcr0 & 0xe0) == 0xe0)
+    features |= CPU_AVX512F;
+
+  return features;
+}
+#endif /* OTTERY_HAVE_X86_DISPATCH */
+#endif /* OTTERY_X86 */
+#endif /* OTTERYLITE_CPUID_H_INCLUDED */
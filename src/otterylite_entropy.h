@@ -58,24 +58,66 @@
 /* Giving RDRAND too many chances to fail seems risky to me. */
 #define RDRAND_MAXATTEMPTS 16
 
-/* Low-level rdrand implementation */
+/*
+  RDSEED is allowed to fail whenever the CPU's entropy conditioner is
+  running behind, so it gets more chances, with a pause between them.
+*/
+#define RDSEED_MAXATTEMPTS 128
+
+/* On x86_64, we get 64 bits per instruction, so we need half as many. */
+#ifdef OTTERY_X86_64
+typedef uint64_t rdrand_word_t;
+#else
+typedef uint32_t rdrand_word_t;
+#endif
+
+/* Low-level rdrand and rdseed implementations.  Return 0 on success. */
 #ifdef _MSC_VER
-#define rdrand_ll_ _rdrand32_step
+#ifdef OTTERY_X86_64
+#define rdrand_ll_(p) (_rdrand64_step(p) ? 0 : -1)
+#define rdseed_ll_(p) (_rdseed64_step(p) ? 0 : -1)
+#else
+#define rdrand_ll_(p) (_rdrand32_step(p) ? 0 : -1)
+#define rdseed_ll_(p) (_rdseed32_step(p) ? 0 : -1)
+#endif
+#define rdseed_pause_() _mm_pause()
 #else
 static int
-rdrand_ll_(uint32_t *therand)
+rdrand_ll_(rdrand_word_t *therand)
 {
   unsigned char status;
+#ifdef OTTERY_X86_64
+  __asm volatile (".byte 0x48, 0x0F, 0xC7, 0xF0 ; setc %1"
+                  : "=a" (*therand), "=qm" (status));
+#else
   __asm volatile (".byte 0x0F, 0xC7, 0xF0 ; setc %1"
                   : "=a" (*therand), "=qm" (status));
+#endif
+
+  return (status) == 1 ? 0 : -1;
+}
+
+static int
+rdseed_ll_(rdrand_word_t *therand)
+{
+  unsigned char status;
+#ifdef OTTERY_X86_64
+  __asm volatile (".byte 0x48, 0x0F, 0xC7, 0xF8 ; setc %1"
+                  : "=a" (*therand), "=qm" (status));
+#else
+  __asm volatile (".byte 0x0F, 0xC7, 0xF8 ; setc %1"
+                  : "=a" (*therand), "=qm" (status));
+#endif
 
   return (status) == 1 ? 0 : -1;
 }
+
+#define rdseed_pause_() __asm volatile ("pause")
 #endif
 
 /* Call rdrand until it succeeds or we give up. */
 static int
-rdrand_(uint32_t *therand)
+rdrand_(rdrand_word_t *therand)
 {
   int i;
 
@@ -87,31 +129,21 @@ rdrand_(uint32_t *therand)
   return -1;
 }
 
-/* CPUID implementation to see whether we even have RDRAND */
-#ifdef _MSC_VER
-#define cpuid_(i, result) __cpuid((result), (i))
-#else
-static void
-cpuid_(int index, unsigned result[4])
+/* Call rdseed until it succeeds or we give up, giving the CPU a moment
+   to catch up between tries. */
+static int
+rdseed_(rdrand_word_t *therand)
 {
-  unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+  int i;
 
-#ifdef OTTERY_X86_64
-  __asm("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
-        : "0" (index));
-#else
-  __asm volatile (
-                  "xchgl %%ebx, %1; cpuid; xchgl %%ebx, %1"
-                  : "=a" (eax), "=r" (ebx), "=c" (ecx), "=d" (edx)
-                  : "0" (index)
-                  : "cc");
-#endif
-  result[0] = eax;
-  result[1] = ebx;
-  result[2] = ecx;
-  result[3] = edx;
+  for (i = 0; i < RDSEED_MAXATTEMPTS; ++i)
+    {
+      if (rdseed_ll_(therand) == 0)
+        return 0;
+      rdseed_pause_();
+    }
+  return -1;
 }
-#endif
 
 static int
 cpuid_says_rdrand_supported_(void)
@@ -122,34 +154,76 @@ cpuid_says_rdrand_supported_(void)
   return 0 != (result[2] & (1u << 30));
 }
 
-/* Entropy source using rdrand. */
 static int
-ottery_getentropy_rdrand(unsigned char *output, unsigned *flags_out)
+cpuid_says_rdseed_supported_(void)
 {
-  int i;
+  unsigned result[4];
 
-  *flags_out = 0;
+  cpuid_(0, result);
+  if (result[0] < 7)
+    return 0;
+  cpuid_(7, result);
+  return 0 != (result[1] & (1u << 18));
+}
 
-  if (!cpuid_says_rdrand_supported_())
-    return -2; /* RDRAND not supported. */
+/*
+  Fill 'output' with ENTROPY_CHUNK bytes from 'fn', one word at a time.
+*/
+static int
+ottery_getentropy_x86_(unsigned char *output, int (*fn)(rdrand_word_t *))
+{
+  rdrand_word_t w;
+  unsigned i;
 
-  for (i = 0; i < ENTROPY_CHUNK / 4; ++i, output += 4)
+  for (i = 0; i < ENTROPY_CHUNK / sizeof(w); ++i)
     {
-      if (rdrand_((uint32_t*)output) < 0)
+      if (fn(&w) < 0)
         {
           /*
             A tricky point -- if rdrand stops working partway through, do
             we use what it gave us before?  I don't think so; let's allow
             minimum space for shenanigans.
           */
+          memwipe(&w, sizeof(w));
           return -1;
         }
+      memcpy(output + i * sizeof(w), &w, sizeof(w));
     }
+  memwipe(&w, sizeof(w));
   return ENTROPY_CHUNK;
 }
 
+/* Entropy source using rdrand. */
+static int
+ottery_getentropy_rdrand(unsigned char *output, unsigned *flags_out)
+{
+  *flags_out = 0;
+
+  if (!cpuid_says_rdrand_supported_())
+    return -2; /* RDRAND not supported. */
+
+  return ottery_getentropy_x86_(output, rdrand_);
+}
+
+/*
+  Entropy source using rdseed.  Unlike rdrand, which hands out the output
+  of a DRBG, this gives us the conditioned entropy that reseeds it.  It's
+  slower, but it's the better thing to seed with, when we have it.
+*/
+static int
+ottery_getentropy_rdseed(unsigned char *output, unsigned *flags_out)
+{
+  *flags_out = 0;
+
+  if (!cpuid_says_rdseed_supported_())
+    return -2; /* RDSEED not supported. */
+
+  return ottery_getentropy_x86_(output, rdseed_);
+}
+
 #else
 #define ottery_getentropy_rdrand NULL
+#define ottery_getentropy_rdseed NULL
 #endif
 
 
@@ -178,11 +252,26 @@ ottery_getentropy_getentropy(unsigned char *out, unsigned *flags)
   than the situation before that I really don't want to complain.
 */
 
-/* Define a getrandom, since glibc doesn't wrap it as of this writing. */
+#ifdef USING_VGETRANDOM
+#include "otterylite_vdso.h"
+#endif
+
+/*
+  Define a getrandom, since glibc doesn't wrap it as of this writing.  Like
+  the kernel, return a negative errno on failure.  Use the vDSO's if it
+  has one, since that doesn't need to enter the kernel.
+*/
 static int
 ottery_getrandom_ll_(void *out, size_t n, unsigned flags)
 {
-  return syscall(__NR_getrandom, out, n, flags);
+  int r;
+#ifdef USING_VGETRANDOM
+  r = ottery_vgetrandom_(out, n, flags);
+  if (r != -ENOSYS)
+    return r;
+#endif
+  r = (int)syscall(__NR_getrandom, out, n, flags);
+  return r < 0 ? -errno : r;
 }
 /*
   Wrap getrandom to make it try harder.
@@ -249,21 +338,20 @@ ottery_getentropy_cryptgenrandom(unsigned char *out, unsigned *flags)
 /* Everything besides windows has device files */
 
 /*
-  Try to read 'len' bytes from the device file named 'fname', storing them
-  into 'out'.  Return the actual number of bytes read, or -1 on error.  If
-  need_mode_flags, fail if the st_mode field of the file does not have all the
-  bits in need_mode_flags set.
+  Open the device file named 'fname', and check that it looks right.
+  Return a file descriptor on success, or -1 on error.  If need_mode_flags,
+  fail if the st_mode field of the file does not have all the bits in
+  need_mode_flags set.  If it doesn't have the major and minor device
+  numbers we want, set FLAG_WEAK in *'flags_out'.  Put what fstat() said in
+  *'st_out'.
 */
 static int
-ottery_getentropy_device_(unsigned char *out, unsigned *flags_out,
-                          int len,
-                          const char *fname,
-                          unsigned need_mode_flags,
-                          int want_major, int want_minor)
+ottery_device_open_(const char *fname, unsigned *flags_out,
+                    unsigned need_mode_flags,
+                    int want_major, int want_minor,
+                    struct stat *st_out)
 {
   int fd;
-  int r, output = -1, remain = len;
-  struct stat st;
 
   /*
     Open with O_NOFOLLOW -- this stuff should not be a symlink.
@@ -271,22 +359,36 @@ ottery_getentropy_device_(unsigned char *out, unsigned *flags_out,
   fd = open(fname, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
   if (fd < 0)
     return -1;
-  if (fstat(fd, &st))
-    goto out; /* Can't fstat?  That's an error */
-  if ((st.st_mode & need_mode_flags) != need_mode_flags)
-    goto out; /* If it's not a device, and we asked for one, that's a bad
+  if (fstat(fd, st_out))
+    goto err; /* Can't fstat?  That's an error */
+  if ((st_out->st_mode & need_mode_flags) != need_mode_flags)
+    goto err; /* If it's not a device, and we asked for one, that's a bad
                * sign. */
   if (want_major >= 0 && want_minor >= 0)
     {
-      if ((int)major(st.st_rdev) != want_major ||
-          (int)minor(st.st_rdev) != want_minor)
+      if ((int)major(st_out->st_rdev) != want_major ||
+          (int)minor(st_out->st_rdev) != want_minor)
         {
           *flags_out |= FLAG_WEAK;
         }
     }
+  return fd;
+
+ err:
+  close(fd);
+  return -1;
+}
+
+/*
+  Read up to 'len' bytes from 'fd' into 'out'.  Return the actual number
+  of bytes read, or -1 on error.
+*/
+static int
+ottery_device_read_(int fd, unsigned char *out, int len)
+{
+  int r, output = 0, remain = len;
 
   /* Read until we hit EOF, an error, or the number of bytes we wanted */
-  output = 0;
   while (remain)
     {
       r = (int)read(fd, out, remain);
@@ -294,8 +396,7 @@ ottery_getentropy_device_(unsigned char *out, unsigned *flags_out,
         {
           if (errno == EINTR || errno == EAGAIN)
             continue;
-          output = -1;
-          goto out;
+          return -1;
         }
       else if (r == 0)   /* EOF */
         {
@@ -306,7 +407,30 @@ ottery_getentropy_device_(unsigned char *out, unsigned *flags_out,
       remain -= r;
     }
 
- out:
+  return output;
+}
+
+/*
+  Try to read 'len' bytes from the device file named 'fname', storing them
+  into 'out'.  Return the actual number of bytes read, or -1 on error.  If
+  need_mode_flags, fail if the st_mode field of the file does not have all the
+  bits in need_mode_flags set.
+*/
+static int
+ottery_getentropy_device_(unsigned char *out, unsigned *flags_out,
+                          int len,
+                          const char *fname,
+                          unsigned need_mode_flags,
+                          int want_major, int want_minor)
+{
+  int fd, output;
+  struct stat st;
+
+  fd = ottery_device_open_(fname, flags_out, need_mode_flags,
+                           want_major, want_minor, &st);
+  if (fd < 0)
+    return -1;
+  output = ottery_device_read_(fd, out, len);
   close(fd);
   return output;
 }
@@ -327,58 +451,252 @@ ottery_getentropy_device_(unsigned char *out, unsigned *flags_out,
 #define DEV_HWRNG_MINOR -1
 #endif
 
+/* A device file that an entropy source can read, in order of preference. */
+struct ottery_device_name {
+  const char *fname;
+  int want_major, want_minor;
+};
+
 /*
-  Try to read from the most urandom-like file available.
+  We keep the devices that we read from open, so that a reseed doesn't have
+  to open, fstat, and close them again, and so that we can still read them
+  after a chroot or a seccomp sandbox takes /dev away.
 */
+struct ottery_device_cache {
+  /* The open device, or -1. */
+  int fd;
+  /* True if we looked for all the files last time, and none existed. */
+  int missing;
+  /* FLAG_WEAK if it wasn't the device we expected. */
+  unsigned flags;
+  /* What fstat() said when we opened it, so we can tell if somebody closed
+     it on us and something else got the same fd. */
+  dev_t dev;
+  ino_t ino;
+};
+
+DECLARE_INITIALIZED_LOCK(static, ottery_device_mutex)
+static struct ottery_device_cache ottery_urandom_cache = { -1, 0, 0, 0, 0 };
+static struct ottery_device_cache ottery_hwrandom_cache = { -1, 0, 0, 0, 0 };
+
+/* Return true if the fd in 'c' is still the one we opened.  (The program
+   might have closed all its fds, say, after a fork.) */
 static int
-ottery_getentropy_dev_urandom(unsigned char *out, unsigned *flags_out)
+ottery_device_cache_ok_(const struct ottery_device_cache *c)
 {
-#define TRY(fname, maj, min)                                            \
-  do {                                                                  \
-    r = ottery_getentropy_device_(out, flags_out,                       \
-                                  ENTROPY_CHUNK, fname, S_IFCHR,        \
-                                  maj, min);                            \
-    if (r == ENTROPY_CHUNK)                                             \
-      return r;                                                         \
-  } while (0)
-  int r;
+  struct stat st;
+  return c->fd >= 0 && fstat(c->fd, &st) == 0 &&
+    st.st_dev == c->dev && st.st_ino == c->ino;
+}
+
+/*
+  Make sure that 'c' holds the first of the 'n_names' files in 'names' that
+  we can open.  Return 0 on success, -1 if none of them would open.
+  Callers must hold ottery_device_mutex.
+*/
+static int
+ottery_device_cache_open_(struct ottery_device_cache *c,
+                          const struct ottery_device_name *names,
+                          int n_names)
+{
+  struct stat st;
+  int i, all_missing = 1;
+
+  if (c->fd >= 0)
+    {
+      if (ottery_device_cache_ok_(c))
+        return 0;
+      /* It isn't ours any more, so it's not ours to close. */
+      c->fd = -1;
+    }
+  if (c->missing)
+    return -1;
+
+  for (i = 0; i < n_names; ++i)
+    {
+      c->flags = 0;
+      c->fd = ottery_device_open_(names[i].fname, &c->flags, S_IFCHR,
+                                  names[i].want_major, names[i].want_minor,
+                                  &st);
+      if (c->fd >= 0)
+        {
+          c->dev = st.st_dev;
+          c->ino = st.st_ino;
+          return 0;
+        }
+      if (errno != ENOENT)
+        all_missing = 0;
+    }
+
+  /* If the files just aren't there, don't look again every time.  (But if
+     we're out of fds or something, we might have better luck later.) */
+  c->missing = all_missing;
+  return -1;
+}
+
+/* Close the device in 'c', if we have one, and forget what we knew. */
+static void
+ottery_device_cache_close_(struct ottery_device_cache *c)
+{
+  if (ottery_device_cache_ok_(c))
+    close(c->fd);
+  c->fd = -1;
+  c->missing = 0;
+}
+
+#ifndef F_DUPFD_CLOEXEC
+#define F_DUPFD_CLOEXEC F_DUPFD
+#endif
+
+/*
+  Read an ENTROPY_CHUNK into 'out' from the cached device 'c', opening it
+  from 'names' first if we need to.
+
+  We only hold ottery_device_mutex long enough to check the cached fd and
+  make a copy of it: a read from a slow device like a hardware RNG can
+  block for a while, and everybody else who wants a device (or who wants
+  to fork, under OTTERY_EAGER_INIT) would have to wait for it.
+*/
+static int
+ottery_getentropy_device_cached_(unsigned char *out, unsigned *flags_out,
+                                 struct ottery_device_cache *c,
+                                 const struct ottery_device_name *names,
+                                 int n_names)
+{
+  int r, fd = -1, cached_fd = -1;
+  unsigned flags = 0;
 
   *flags_out = 0;
+
+  GET_STATIC_LOCK(ottery_device_mutex);
+  if (ottery_device_cache_open_(c, names, n_names) == 0)
+    {
+      cached_fd = c->fd;
+      flags = c->flags;
+      fd = fcntl(cached_fd, F_DUPFD_CLOEXEC, 0);
+    }
+  RELEASE_STATIC_LOCK(ottery_device_mutex);
+
+  if (fd < 0)
+    return -1;
+  r = ottery_device_read_(fd, out, ENTROPY_CHUNK);
+  close(fd);
+  if (r == ENTROPY_CHUNK)
+    {
+      *flags_out = flags;
+      return r;
+    }
+
+  /* Something's wrong with it; try again from scratch next time, unless
+     somebody already has. */
+  GET_STATIC_LOCK(ottery_device_mutex);
+  if (c->fd == cached_fd)
+    ottery_device_cache_close_(c);
+  RELEASE_STATIC_LOCK(ottery_device_mutex);
+  return -1;
+}
+
+/* Where to look for an urandom-like device. */
+static const struct ottery_device_name ottery_urandom_names[] = {
 #if defined(__sun) || defined(sun)
   /*
     According to the libressl-portable people, this is where you have to look
     if you're doing O_NOFOLLOW and trying to find a urandom device on sunos.
   */
-  TRY("/devices/pseudo/random@0:urandom", -1, -1);
+  { "/devices/pseudo/random@0:urandom", -1, -1 },
 #endif
 #ifdef __OpenBSD__
   /*
     OpenBSD puts its RNG in srandom.  ????? Is this so?
   */
-  TRY("/dev/srandom", -1, -1);
+  { "/dev/srandom", -1, -1 },
 #endif
-  TRY("/dev/urandom", DEV_URANDOM_MAJOR, DEV_URANDOM_MINOR);
-  TRY("/dev/random", DEV_RANDOM_MAJOR, DEV_RANDOM_MINOR);
-  return -1;
+  { "/dev/urandom", DEV_URANDOM_MAJOR, DEV_URANDOM_MINOR },
+  { "/dev/random", DEV_RANDOM_MAJOR, DEV_RANDOM_MINOR },
+};
+
+/* Where to look for a hardware RNG. */
+static const struct ottery_device_name ottery_hwrandom_names[] = {
+  { "/dev/hwrandom", -1, -1 },
+  { "/dev/hw_random", -1, -1 },
+  { "/dev/hwrng", DEV_HWRNG_MAJOR, DEV_HWRNG_MINOR },
+};
+
+#define N_DEVICE_NAMES(names) ((int)(sizeof(names) / sizeof(names[0])))
+
+/*
+  Try to read from the most urandom-like file available.
+*/
+static int
+ottery_getentropy_dev_urandom(unsigned char *out, unsigned *flags_out)
+{
+  return ottery_getentropy_device_cached_(out, flags_out,
+                                          &ottery_urandom_cache,
+                                          ottery_urandom_names,
+                                          N_DEVICE_NAMES(ottery_urandom_names));
 }
 
 /* Try a /dev/hw{_,}random, if it exists */
 static int
 ottery_getentropy_dev_hwrandom(unsigned char *out, unsigned *flags_out)
+{
+  return ottery_getentropy_device_cached_(out, flags_out,
+                                          &ottery_hwrandom_cache,
+                                          ottery_hwrandom_names,
+                                          N_DEVICE_NAMES(ottery_hwrandom_names));
+}
+
+/*
+  Open the entropy devices now, if we haven't.  Return 0 if we have an
+  urandom-like device open, -1 if not.
+*/
+static int
+ottery_devices_open(void)
 {
   int r;
 
-  *flags_out = 0;
+  GET_STATIC_LOCK(ottery_device_mutex);
+  /* Look again even if they weren't there last time. */
+  ottery_urandom_cache.missing = ottery_hwrandom_cache.missing = 0;
+  r = ottery_device_cache_open_(&ottery_urandom_cache, ottery_urandom_names,
+                                N_DEVICE_NAMES(ottery_urandom_names));
+  (void) ottery_device_cache_open_(&ottery_hwrandom_cache,
+                                   ottery_hwrandom_names,
+                                   N_DEVICE_NAMES(ottery_hwrandom_names));
+  RELEASE_STATIC_LOCK(ottery_device_mutex);
+
+  return r;
+}
 
-  TRY("/dev/hwrandom", -1, -1);
-  TRY("/dev/hw_random", -1, -1);
-  TRY("/dev/hwrng", DEV_HWRNG_MAJOR, DEV_HWRNG_MINOR);
-  return -1;
+/*
+  Close any entropy devices that we have open.
+*/
+static void
+ottery_devices_close(void)
+{
+  GET_STATIC_LOCK(ottery_device_mutex);
+  ottery_device_cache_close_(&ottery_urandom_cache);
+  ottery_device_cache_close_(&ottery_hwrandom_cache);
+  RELEASE_STATIC_LOCK(ottery_device_mutex);
+}
+
+/*
+  Look for the entropy devices again next time, even if they weren't
+  there before.
+*/
+static void
+ottery_devices_forget_missing(void)
+{
+  GET_STATIC_LOCK(ottery_device_mutex);
+  ottery_urandom_cache.missing = ottery_hwrandom_cache.missing = 0;
+  RELEASE_STATIC_LOCK(ottery_device_mutex);
 }
-#undef TRY
 #else
 #define ottery_getentropy_dev_urandom NULL
 #define ottery_getentropy_dev_hwrandom NULL
+#define ottery_devices_open() (-1)
+#define ottery_devices_close() ((void)0)
+#define ottery_devices_forget_missing() ((void)0)
 #endif
 
 #ifdef __linux__
@@ -593,6 +911,7 @@ ottery_getentropy_bsd_sysctl(unsigned char *out, unsigned *flags_out)
 #define ID_LINUX_SYSCTL    (1u << 8)
 #define ID_BSD_SYSCTL      (1u << 9)
 #define ID_FALLBACK_KLUDGE (1u << 10)
+#define ID_RDSEED          (1u << 11)
 
 #define GROUP_HW      (1u << 0)
 #define GROUP_CPU     (1u << 1)
@@ -602,26 +921,39 @@ ottery_getentropy_bsd_sysctl(unsigned char *out, unsigned *flags_out)
 #define GROUP_KLUDGE  (1u << 5)
 
 
-#define SOURCE(name, id, group, flags)                          \
-  { #name, ottery_getentropy_ ## name, (id), (group), (flags) }
+/*
+  When we poll the sources in parallel, this is the longest we'll wait for
+  all of them together, in milliseconds.
+*/
+#define ENTROPY_DEADLINE_MSEC 1000
+
+#define SOURCE(name, id, group, flags, deadline)                        \
+  { #name, ottery_getentropy_ ## name, (id), (group), (flags), (deadline) }
 static const struct entropy_source {
   const char *name;
   int (*getentropy_fn)(unsigned char *out, unsigned *flags_out);
   unsigned id;
   unsigned group;
   unsigned flags;
+  /* When we poll the sources in parallel, give up on this one after this
+     many milliseconds.  0 means ENTROPY_DEADLINE_MSEC. */
+  unsigned deadline_msec;
 } entropy_sources[] = {
-  SOURCE(rdrand, ID_RDRAND, GROUP_CPU, FLAG_WEAK),
-  SOURCE(getrandom, ID_GETRANDOM, GROUP_SYSCALL, 0),
-  SOURCE(getentropy, ID_GETENTROPY, GROUP_SYSCALL, 0),
-  SOURCE(cryptgenrandom, ID_CRYPTGENRANDOM, GROUP_SYSCALL, 0),
-  SOURCE(dev_urandom, ID_DEV_URANDOM, GROUP_DEVICE, 0),
-  SOURCE(dev_hwrandom, ID_DEV_HWRANDOM, GROUP_HW, 0),
-  SOURCE(egd, ID_EGD, GROUP_EGD, 0),
-  SOURCE(proc_uuid, ID_PROC_UUID, GROUP_DEVICE, FLAG_AVOID),
-  SOURCE(linux_sysctl, ID_LINUX_SYSCTL, GROUP_SYSCALL, FLAG_AVOID),
-  SOURCE(bsd_sysctl, ID_BSD_SYSCTL, GROUP_SYSCALL, 0),
-  SOURCE(fallback_kludge, ID_FALLBACK_KLUDGE, GROUP_KLUDGE, FLAG_AVOID | FLAG_WEAK)
+  /* If we get a whole chunk from RDSEED, we don't need RDRAND. */
+  SOURCE(rdseed, ID_RDSEED, GROUP_CPU, FLAG_WEAK, 0),
+  SOURCE(rdrand, ID_RDRAND, GROUP_CPU, FLAG_WEAK, 0),
+  SOURCE(getrandom, ID_GETRANDOM, GROUP_SYSCALL, 0, 0),
+  SOURCE(getentropy, ID_GETENTROPY, GROUP_SYSCALL, 0, 0),
+  SOURCE(cryptgenrandom, ID_CRYPTGENRANDOM, GROUP_SYSCALL, 0, 0),
+  SOURCE(dev_urandom, ID_DEV_URANDOM, GROUP_DEVICE, 0, 0),
+  /* A hardware RNG can be slow, or missing; so can an EGD. */
+  SOURCE(dev_hwrandom, ID_DEV_HWRANDOM, GROUP_HW, 0, 100),
+  SOURCE(egd, ID_EGD, GROUP_EGD, 0, 100),
+  SOURCE(proc_uuid, ID_PROC_UUID, GROUP_DEVICE, FLAG_AVOID, 0),
+  SOURCE(linux_sysctl, ID_LINUX_SYSCTL, GROUP_SYSCALL, FLAG_AVOID, 0),
+  SOURCE(bsd_sysctl, ID_BSD_SYSCTL, GROUP_SYSCALL, 0, 0),
+  SOURCE(fallback_kludge, ID_FALLBACK_KLUDGE, GROUP_KLUDGE,
+         FLAG_AVOID | FLAG_WEAK, 0)
 };
 
 #define N_ENTROPY_SOURCES (sizeof(entropy_sources) / sizeof(entropy_sources[0]))
@@ -632,17 +964,346 @@ static const struct entropy_source {
 #define OTTERY_ENTROPY_MAXLEN (ENTROPY_CHUNK * N_ENTROPY_SOURCES)
 
 /*
-  Helper: As ottery_getentropy, but consider the 'n_sources' entropy
-  sources in 'sources'.
+  What we remember about each of the entropy_sources, so that we don't keep
+  asking the ones that don't work.  A source that says it isn't supported
+  here (by returning -2) is dead until somebody calls
+  ottery_entropy_memo_reset().  A source that fails gets skipped for the
+  next 1, 3, 7, ... seeds, up to ENTROPY_BACKOFF_MAX, until it works again.
+*/
+struct entropy_source_memo {
+  /* True if this source returned -2. */
+  unsigned char unsupported;
+  /* How many times in a row it has failed. */
+  unsigned char failures;
+  /* How many more seeds to skip it for. */
+  unsigned skip;
+};
 
-  This is done as a different function so that we can test it.
+#define ENTROPY_BACKOFF_MAX 63
+
+DECLARE_INITIALIZED_LOCK(static, ottery_entropy_memo_mutex)
+static struct entropy_source_memo entropy_source_memos[N_ENTROPY_SOURCES];
+
+/*
+  Return a bitmask of which of the first 'n_sources' sources we should skip
+  this time, according to 'memo', and count down their backoffs.
+*/
+static unsigned
+entropy_memo_skip_(struct entropy_source_memo *memo, int n_sources)
+{
+  unsigned skip = 0;
+  int i;
+
+  if (!memo)
+    return 0;
+
+  GET_STATIC_LOCK(ottery_entropy_memo_mutex);
+  for (i = 0; i < n_sources; ++i)
+    {
+      if (memo[i].unsupported)
+        {
+          skip |= 1u << i;
+        }
+      else if (memo[i].skip)
+        {
+          --memo[i].skip;
+          skip |= 1u << i;
+        }
+    }
+  RELEASE_STATIC_LOCK(ottery_entropy_memo_mutex);
+
+  return skip;
+}
+
+/* Remember that source 'i' gave us 'n'. */
+static void
+entropy_memo_note_(struct entropy_source_memo *memo, int i, int n)
+{
+  struct entropy_source_memo *m;
+
+  if (!memo)
+    return;
+  m = &memo[i];
+
+  GET_STATIC_LOCK(ottery_entropy_memo_mutex);
+  if (n == -2)
+    {
+      m->unsupported = 1;
+    }
+  else if (n < 0)
+    {
+      if (m->failures < 8)
+        ++m->failures;
+      m->skip = (1u << m->failures) - 1;
+      if (m->skip > ENTROPY_BACKOFF_MAX)
+        m->skip = ENTROPY_BACKOFF_MAX;
+    }
+  else
+    {
+      m->failures = 0;
+      m->skip = 0;
+    }
+  RELEASE_STATIC_LOCK(ottery_entropy_memo_mutex);
+}
+
+/* Forget what we remembered about the entropy sources whose IDs are in
+   'ids', so that we try them again next time. */
+static void
+ottery_entropy_memo_reset(unsigned ids)
+{
+  size_t i;
+
+  GET_STATIC_LOCK(ottery_entropy_memo_mutex);
+  for (i = 0; i < N_ENTROPY_SOURCES; ++i)
+    {
+      if (entropy_sources[i].id & ids)
+        memset(&entropy_source_memos[i], 0, sizeof(entropy_source_memos[i]));
+    }
+  RELEASE_STATIC_LOCK(ottery_entropy_memo_mutex);
+}
+
+#if defined(OTTERY_PARALLEL_ENTROPY) && !defined(_WIN32)
+#define USING_PARALLEL_ENTROPY
+
+/* We don't poll more sources than this in parallel. */
+#define ENTROPY_POLL_MAX 16
+
+/*
+  The clock we measure deadlines with.  It shouldn't jump if somebody sets
+  the time while we're waiting, so we use the monotonic clock wherever we
+  can tell pthread_cond_timedwait() to use it too.  (Not on macOS.)
+*/
+#if defined(CLOCK_MONOTONIC) && !defined(__APPLE__)
+#define ENTROPY_POLL_MONOTONIC
+#define ENTROPY_POLL_CLOCK CLOCK_MONOTONIC
+#else
+#define ENTROPY_POLL_CLOCK CLOCK_REALTIME
+#endif
+
+struct entropy_poll;
+
+/* One source's part of a parallel poll. */
+struct entropy_poll_job {
+  struct entropy_poll *poll;
+  int (*getentropy_fn)(unsigned char *out, unsigned *flags_out);
+  /* True once we've started this source. */
+  int started;
+  /* True once it has finished. */
+  int done;
+  /* When we stop waiting for it. */
+  struct timespec deadline;
+  /* What it gave us. */
+  int n;
+  unsigned flags;
+  unsigned char buf[ENTROPY_CHUNK];
+};
+
+/*
+  A set of sources that we're polling at once.  A source that misses its
+  deadline keeps running in its own thread, so whoever finishes with the
+  poll last (the caller or a straggler) frees it.
 */
+struct entropy_poll {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  /* The caller, plus every thread that hasn't finished. */
+  int refs;
+  /* Bitmask of sources that we aren't asking this time. */
+  unsigned skip;
+  /* When we started; the overall deadline is counted from here. */
+  struct timespec start;
+  struct entropy_poll_job jobs[ENTROPY_POLL_MAX];
+};
+
+/* Set 'ts' to 'msec' milliseconds after 'base'. */
+static void
+entropy_timespec_add_(struct timespec *ts, const struct timespec *base,
+                      unsigned msec)
+{
+  ts->tv_sec = base->tv_sec + msec / 1000;
+  ts->tv_nsec = base->tv_nsec + (long)(msec % 1000) * 1000000;
+  if (ts->tv_nsec >= 1000000000)
+    {
+      ++ts->tv_sec;
+      ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* Return true if 'a' is before 'b'. */
 static int
-ottery_getentropy_impl(unsigned char *out, int *status_out,
-                       const struct entropy_source * const sources,
-                       int n_sources)
+entropy_timespec_lt_(const struct timespec *a, const struct timespec *b)
+{
+  return a->tv_sec < b->tv_sec ||
+    (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Drop a reference to 'poll', and free it if that was the last one.
+   Callers must hold its lock; we release it. */
+static void
+entropy_poll_decref_(struct entropy_poll *poll)
+{
+  int last = (--poll->refs == 0);
+  pthread_mutex_unlock(&poll->lock);
+  if (!last)
+    return;
+  pthread_cond_destroy(&poll->cond);
+  pthread_mutex_destroy(&poll->lock);
+  memwipe(poll, sizeof(*poll));
+  free(poll);
+}
+
+/* Thread body: run one source, and record what it gave us. */
+static void *
+entropy_poll_run_(void *arg)
+{
+  struct entropy_poll_job *job = arg;
+  struct entropy_poll *poll = job->poll;
+  unsigned char buf[ENTROPY_CHUNK];
+  unsigned flags = 0;
+  int n;
+
+  n = job->getentropy_fn(buf, &flags);
+
+  pthread_mutex_lock(&poll->lock);
+  if (n > 0)
+    memcpy(job->buf, buf, n);
+  job->n = n;
+  job->flags = flags;
+  job->done = 1;
+  pthread_cond_broadcast(&poll->cond);
+  entropy_poll_decref_(poll);
+
+  memwipe(buf, sizeof(buf));
+  return NULL;
+}
+
+/*
+  Start every source in 'sources' from 'first' on that we haven't started
+  yet, skipping the Avoided ones unless 'avoided' is set.  Then wait until
+  they've all finished or missed their deadlines.
+*/
+static void
+entropy_poll_start_(struct entropy_poll *poll,
+                    const struct entropy_source * const sources,
+                    int first, int n_sources, int avoided)
+{
+  struct timespec now, overall, next;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int i, waiting;
+
+  clock_gettime(ENTROPY_POLL_CLOCK, &now);
+  entropy_timespec_add_(&overall, &poll->start, ENTROPY_DEADLINE_MSEC);
+  next = overall;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  pthread_mutex_lock(&poll->lock);
+  for (i = first; i < n_sources; ++i)
+    {
+      struct entropy_poll_job *job = &poll->jobs[i];
+      if (job->started || NULL == sources[i].getentropy_fn ||
+          (poll->skip & (1u << i)))
+        continue;
+      if (!avoided && (sources[i].flags & FLAG_AVOID))
+        continue;
+
+      job->poll = poll;
+      job->getentropy_fn = sources[i].getentropy_fn;
+      job->started = 1;
+      job->n = -1;
+      if (sources[i].deadline_msec)
+        entropy_timespec_add_(&job->deadline, &now, sources[i].deadline_msec);
+      if (!sources[i].deadline_msec ||
+          entropy_timespec_lt_(&overall, &job->deadline))
+        job->deadline = overall;
+
+      ++poll->refs;
+      if (pthread_create(&thread, &attr, entropy_poll_run_, job))
+        {
+          /* No thread?  Do it ourselves, without the lock. */
+          pthread_mutex_unlock(&poll->lock);
+          entropy_poll_run_(job);
+          pthread_mutex_lock(&poll->lock);
+        }
+    }
+
+  /* Wait until everybody is done, or until everybody who isn't done has
+     run out of time. */
+  for (;;)
+    {
+      clock_gettime(ENTROPY_POLL_CLOCK, &now);
+      waiting = 0;
+      for (i = 0; i < n_sources; ++i)
+        {
+          const struct entropy_poll_job *job = &poll->jobs[i];
+          if (!job->started || job->done ||
+              !entropy_timespec_lt_(&now, &job->deadline))
+            continue;
+          if (!waiting || entropy_timespec_lt_(&job->deadline, &next))
+            next = job->deadline;
+          waiting = 1;
+        }
+      if (!waiting)
+        break;
+      pthread_cond_timedwait(&poll->cond, &poll->lock, &next);
+    }
+  pthread_mutex_unlock(&poll->lock);
+
+  pthread_attr_destroy(&attr);
+}
+
+/*
+  Give the caller what source 'i' gave us, as if they'd called it, starting
+  it (and the ones after it) first if we haven't yet.  A source that missed
+  its deadline counts as having failed.
+*/
+static int
+entropy_poll_result_(struct entropy_poll *poll,
+                     const struct entropy_source * const sources,
+                     int i, int n_sources,
+                     unsigned char *out, unsigned *flags_out)
+{
+  struct entropy_poll_job *job = &poll->jobs[i];
+  int n = -1;
+
+  /* We only get here for an Avoided source if we didn't get anything
+     strong from the others.  Start all the rest now. */
+  if (!job->started)
+    entropy_poll_start_(poll, sources, i, n_sources, 1);
+
+  pthread_mutex_lock(&poll->lock);
+  if (job->done)
+    {
+      n = job->n;
+      *flags_out = job->flags;
+      if (n > 0)
+        memcpy(out, job->buf, n);
+    }
+  pthread_mutex_unlock(&poll->lock);
+
+  return n;
+}
+#else
+struct entropy_poll;
+#endif
+
+/*
+  Helper: As ottery_getentropy, but consider the 'n_sources' entropy
+  sources in 'sources'.  If 'poll' is set, take each source's output from
+  there instead of calling it.  If 'memo' is set, skip the sources that it
+  says aren't worth asking, and remember how the others did.
+*/
+static int
+ottery_getentropy_impl_(unsigned char *out, int *status_out,
+                        const struct entropy_source * const sources,
+                        int n_sources, struct entropy_poll *poll,
+                        struct entropy_source_memo *memo)
 {
   int i, n;
+  /* bitmask: which sources aren't we asking this time? */
+  unsigned skip;
   /* Pointer to the next place in 'out' where we should write. */
   unsigned char *outp = out;
   /* boolean: set to true if we have gotten an ENTROPY_CHUNK from any
@@ -660,11 +1321,20 @@ ottery_getentropy_impl(unsigned char *out, int *status_out,
   */
   memset(out, 0, ENTROPY_CHUNK * n_sources);
 
+#ifdef USING_PARALLEL_ENTROPY
+  if (poll)
+    skip = poll->skip; /* We already decided, when we started them. */
+  else
+#endif
+    skip = entropy_memo_skip_(memo, n_sources);
+
   for (i = 0; i < n_sources; ++i)
     {
       unsigned flags;
       if (NULL == sources[i].getentropy_fn)
         continue; /* Not implemented; skip */
+      if (skip & (1u << i))
+        continue; /* Unsupported, or failing lately; skip */
       /* assert(outp - out < OTTERY_ENTROPY_MAXLEN - ENTROPY_CHUNK); */
       if (have_strong && (sources[i].flags & FLAG_AVOID))
         continue; /* We already have strong entropy; avoid this one */
@@ -674,7 +1344,16 @@ ottery_getentropy_impl(unsigned char *out, int *status_out,
       flags = 0;
 
       /* Try calling the function that implements this source. */
-      n = sources[i].getentropy_fn(outp, &flags);
+#ifdef USING_PARALLEL_ENTROPY
+      if (poll)
+        n = entropy_poll_result_(poll, sources, i, n_sources, outp, &flags);
+      else
+#else
+      (void)poll;
+#endif
+        n = sources[i].getentropy_fn(outp, &flags);
+
+      entropy_memo_note_(memo, i, n);
 
       if (n < 0)
         continue; /* Failed or not implemented */
@@ -707,6 +1386,75 @@ ottery_getentropy_impl(unsigned char *out, int *status_out,
   return (int)(outp - out);
 }
 
+/*
+  Return the memo to use for 'sources': we only remember how our own
+  sources did.
+*/
+#define ENTROPY_MEMO_FOR(sources)                                       \
+  ((sources) == entropy_sources ? entropy_source_memos : NULL)
+
+/*
+  Helper: As ottery_getentropy, but consider the 'n_sources' entropy
+  sources in 'sources'.
+
+  This is done as a different function so that we can test it.
+*/
+static int
+ottery_getentropy_impl(unsigned char *out, int *status_out,
+                       const struct entropy_source * const sources,
+                       int n_sources)
+{
+  return ottery_getentropy_impl_(out, status_out, sources, n_sources,
+                                 NULL, ENTROPY_MEMO_FOR(sources));
+}
+
+#ifdef USING_PARALLEL_ENTROPY
+/*
+  As ottery_getentropy_impl, but call the sources all at once, each on its
+  own thread, so that a slow one doesn't hold up the rest.  We give up on
+  any source that misses its deadline.
+
+  We still combine what they give us by the rules above, in order, so we
+  get the same answer as ottery_getentropy_impl would have (unless somebody
+  was too slow).  We only call the Avoided sources if we need them.
+*/
+static int
+ottery_getentropy_parallel_impl(unsigned char *out, int *status_out,
+                                const struct entropy_source * const sources,
+                                int n_sources)
+{
+  struct entropy_source_memo *memo = ENTROPY_MEMO_FOR(sources);
+  struct entropy_poll *poll;
+  pthread_condattr_t attr;
+  int n;
+
+  if (n_sources > ENTROPY_POLL_MAX ||
+      NULL == (poll = calloc(1, sizeof(*poll))))
+    return ottery_getentropy_impl_(out, status_out, sources, n_sources,
+                                   NULL, memo);
+
+  pthread_mutex_init(&poll->lock, NULL);
+  pthread_condattr_init(&attr);
+#ifdef ENTROPY_POLL_MONOTONIC
+  pthread_condattr_setclock(&attr, ENTROPY_POLL_CLOCK);
+#endif
+  pthread_cond_init(&poll->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  poll->refs = 1;
+  poll->skip = entropy_memo_skip_(memo, n_sources);
+  clock_gettime(ENTROPY_POLL_CLOCK, &poll->start);
+
+  entropy_poll_start_(poll, sources, 0, n_sources, 0);
+  n = ottery_getentropy_impl_(out, status_out, sources, n_sources, poll,
+                              memo);
+
+  pthread_mutex_lock(&poll->lock);
+  entropy_poll_decref_(poll);
+
+  return n;
+}
+#endif
+
 /*
   Fill 'out' with up to OTTERY_ENTROPY_MAXLEN bytes of entropy.  Return
   the number of bytes we added.
@@ -715,10 +1463,55 @@ ottery_getentropy_impl(unsigned char *out, int *status_out,
   entropy but not from good sources, and 2 if we're doing as well
   as we're likely to do.
 */
+IF_TESTING(static unsigned ottery_testing_getentropy_calls; )
 static int
 ottery_getentropy(unsigned char *out, int *status_out)
 {
+  IF_TESTING(++ottery_testing_getentropy_calls; )
+#ifdef USING_PARALLEL_ENTROPY
+  return ottery_getentropy_parallel_impl(out, status_out,
+                                         entropy_sources,
+                                         (int)N_ENTROPY_SOURCES);
+#else
   return ottery_getentropy_impl(out, status_out,
                                 entropy_sources, (int)N_ENTROPY_SOURCES);
+#endif
+}
+
+/*
+  Fill 'out' with ENTROPY_CHUNK bytes from the first strong source that will
+  give us that many.  Return 0 on success, -1 if none of them would.
+
+  This is much cheaper than ottery_getentropy(), which tries everything.  We
+  use it after a fork, when we only need to make the child's stream
+  independent of its parent's, and for routine reseeds.
+*/
+static int
+ottery_getentropy_fast(unsigned char *out)
+{
+  size_t i;
+  unsigned flags;
+
+  for (i = 0; i < N_ENTROPY_SOURCES; ++i)
+    {
+      if (NULL == entropy_sources[i].getentropy_fn)
+        continue; /* Not implemented; skip */
+      if (entropy_sources[i].flags & (FLAG_WEAK | FLAG_AVOID))
+        continue; /* Not good enough to use on its own */
+      if (entropy_source_memos[i].unsupported)
+        continue; /* Never going to work here */
+
+      flags = 0;
+      if (entropy_sources[i].getentropy_fn(out, &flags) == ENTROPY_CHUNK &&
+          0 == (flags & FLAG_WEAK))
+        {
+          TRACE(("source %s rekeyed us quickly\n",
+                 entropy_sources[i].name));
+          return 0;
+        }
+    }
+
+  memwipe(out, ENTROPY_CHUNK);
+  return -1;
 }
 #endif /* OTTERYLITE_ENTROPY_H_INCLUDED */
@@ -13,6 +13,9 @@
 #define INITIALIZER_FUNC(name)                          \
   static void name(void) __attribute__((constructor));  \
   static void name(void)
+#define FINALIZER_FUNC(name)                            \
+  static void name(void) __attribute__((destructor));   \
+  static void name(void)
 #elif defined(_MSC_VER)
 #pragma section(".CRT$XCU",read)
 #define INITIALIZER_FUNC(name)                                              \
@@ -26,6 +29,7 @@
   If locking is disabled, a lot of things become a no-op.
 */
 
+#define OTTERY_LOCK_NAME "none"
 #define DECLARE_INITIALIZED_LOCK(scope, name)
 #define DECLARE_LOCK(name)
 #define INIT_LOCK(lock) ((void)0)
@@ -41,6 +45,7 @@
   On Windows, the fast mutex is called "CRITICAL_SECTION".
 */
 
+#define OTTERY_LOCK_NAME "CRITICAL_SECTION"
 #define DECLARE_LOCK(name)                      \
   CRITICAL_SECTION name;
 #define INIT_LOCK(lock)                                 \
@@ -66,6 +71,7 @@
 
 #elif defined(__APPLE__)
 
+#define OTTERY_LOCK_NAME "OSSpinLock"
 #define DECLARE_INITIALIZED_LOCK(scope, name)   \
   scope OSSpinLock name = OS_SPINLOCK_INIT;     \
   INITIALIZER_FUNC(init_spinlock_ ## name) {    \
@@ -84,8 +90,86 @@
 #define GET_STATIC_LOCK(lock) GET_LOCK(&lock)
 #define RELEASE_STATIC_LOCK(lock) RELEASE_LOCK(&lock)
 
+#elif defined(OTTERY_FUTEX_LOCKS) && defined(__linux__)
+
+/*
+  A lock that spins for a little while, and then goes to sleep on a futex.
+  A pthread spinlock never sleeps, so if the holder gets preempted (or is
+  busy gathering entropy), everybody else spins until it runs again.
+
+  This is the usual three-state futex mutex: 0 is unlocked, 1 is locked,
+  and 2 is locked with somebody (maybe) asleep waiting for it.
+*/
+
+#define OTTERY_LOCK_NAME "futex"
+
+/* How many times do we look at a held lock before we go to sleep? */
+#define FUTEX_LOCK_SPINS 100
+
+#if defined(__i386__) || defined(__x86_64__)
+#define FUTEX_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define FUTEX_CPU_RELAX() __asm volatile ("yield" ::: "memory")
+#else
+#define FUTEX_CPU_RELAX() ((void)0)
+#endif
+
+static void
+futex_lock_slow_(int *lock)
+{
+  int i, c;
+
+  for (i = 0; i < FUTEX_LOCK_SPINS; ++i)
+    {
+      c = __atomic_load_n(lock, __ATOMIC_RELAXED);
+      if (c == 0 &&
+          __atomic_compare_exchange_n(lock, &c, 1, 0,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+      if (c == 2)
+        break; /* Somebody's already asleep; no point in spinning. */
+      FUTEX_CPU_RELAX();
+    }
+
+  /* Mark the lock as contended, and sleep until it's free. */
+  while (__atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE) != 0)
+    syscall(SYS_futex, lock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+}
+
+static inline void
+futex_lock_(int *lock)
+{
+  int c = 0;
+  if (!__atomic_compare_exchange_n(lock, &c, 1, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    futex_lock_slow_(lock);
+}
+
+static inline void
+futex_unlock_(int *lock)
+{
+  if (__atomic_exchange_n(lock, 0, __ATOMIC_RELEASE) == 2)
+    syscall(SYS_futex, lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+#define DECLARE_INITIALIZED_LOCK(scope, name)   \
+  scope int name = 0;
+#define DECLARE_LOCK(name)                      \
+  int name;
+#define INIT_LOCK(lock)                         \
+  (*(lock) = 0)
+#define DESTROY_LOCK(lock)                      \
+  ((void)0)
+#define GET_LOCK(lock)                          \
+  futex_lock_(lock)
+#define RELEASE_LOCK(lock)                      \
+  futex_unlock_(lock)
+#define GET_STATIC_LOCK(lock) GET_LOCK(&lock)
+#define RELEASE_STATIC_LOCK(lock) RELEASE_LOCK(&lock)
+
 #elif !defined(OTTERY_NO_PTHREAD_SPINLOCKS)
 
+#define OTTERY_LOCK_NAME "pthread_spinlock"
 #define DECLARE_INITIALIZED_LOCK(scope, name)   \
   scope pthread_spinlock_t name;                \
   INITIALIZER_FUNC(initialize_cs_ ## name)      \
@@ -113,6 +197,8 @@
 
 /* pthreads makes all of that stuff fairly easy. */
 
+#define OTTERY_LOCK_NAME "pthread_mutex"
+
 #define DECLARE_INITIALIZED_LOCK(scope, name)                   \
   scope pthread_mutex_t name = PTHREAD_MUTEX_INITIALIZER;
 #define DECLARE_LOCK(name)                      \
@@ -128,4 +214,88 @@
 #define GET_STATIC_LOCK(lock) GET_LOCK(&lock)
 #define RELEASE_STATIC_LOCK(lock) RELEASE_LOCK(&lock)
 #endif /* !_WIN32, !__APPLE__, !DISABLED */
+
+/*
+  Sometimes a thread has to wait for another one to finish something slow,
+  like seeding the RNG for the first time.  It shouldn't spin on a lock
+  all that while, so it goes to sleep instead:
+
+  ottery_wait_while_(word, val) sleeps until *word isn't 'val'.
+
+  ottery_set_and_wake_(word, val) sets *word to 'val', and wakes up
+  everybody who is waiting on it.
+
+  These are for slow paths only.
+*/
+#if defined(OTTERY_DISABLE_LOCKING)
+
+/* With only one thread, there's nobody to wait for. */
+#define ottery_wait_while_(word, val) ((void)0)
+#define ottery_set_and_wake_(word, val) ((void)(*(word) = (val)))
+
+#elif defined(_WIN32)
+
+static SRWLOCK ottery_wait_lock = SRWLOCK_INIT;
+static CONDITION_VARIABLE ottery_wait_cond = CONDITION_VARIABLE_INIT;
+
+static void
+ottery_wait_while_(int *word, int val)
+{
+  AcquireSRWLockExclusive(&ottery_wait_lock);
+  while (*word == val)
+    SleepConditionVariableSRW(&ottery_wait_cond, &ottery_wait_lock,
+                              INFINITE, 0);
+  ReleaseSRWLockExclusive(&ottery_wait_lock);
+}
+
+static void
+ottery_set_and_wake_(int *word, int val)
+{
+  AcquireSRWLockExclusive(&ottery_wait_lock);
+  *word = val;
+  ReleaseSRWLockExclusive(&ottery_wait_lock);
+  WakeAllConditionVariable(&ottery_wait_cond);
+}
+
+#elif defined(OTTERY_FUTEX_LOCKS) && defined(__linux__)
+
+static void
+ottery_wait_while_(int *word, int val)
+{
+  while (__atomic_load_n(word, __ATOMIC_ACQUIRE) == val)
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void
+ottery_set_and_wake_(int *word, int val)
+{
+  __atomic_store_n(word, val, __ATOMIC_RELEASE);
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+#else
+
+/* One condition variable will do for everybody: nobody waits often. */
+static pthread_mutex_t ottery_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ottery_wait_cond = PTHREAD_COND_INITIALIZER;
+
+static void
+ottery_wait_while_(int *word, int val)
+{
+  pthread_mutex_lock(&ottery_wait_lock);
+  while (*word == val)
+    pthread_cond_wait(&ottery_wait_cond, &ottery_wait_lock);
+  pthread_mutex_unlock(&ottery_wait_lock);
+}
+
+static void
+ottery_set_and_wake_(int *word, int val)
+{
+  pthread_mutex_lock(&ottery_wait_lock);
+  *word = val;
+  pthread_cond_broadcast(&ottery_wait_cond);
+  pthread_mutex_unlock(&ottery_wait_lock);
+}
+
+#endif
 #endif /* OTTERYLITE_LOCKING_H_INCLUDED */
@@ -0,0 +1,143 @@
+/* otterylite_parallel.h -- generate one keystream on several threads */
+
+/*
+  To the extent possible under law, Nick Mathewson has waived all copyright and
+  related or neighboring rights to libottery-lite, using the creative commons
+  "cc0" public domain dedication.  See doc/cc0.txt or
+  <http://creativecommons.org/publicdomain/zero/1.0/> for full details.
+*/
+
+#ifndef OTTERYLITE_PARALLEL_H_INCLUDED
+#define OTTERYLITE_PARALLEL_H_INCLUDED
+
+/*
+  ChaCha20 can start at any block, so we can split a huge request into
+  ranges of blocks and hand each range to its own thread.  The output is
+  exactly what chacha20_blocks() would have produced.
+*/
+
+/* Don't bother starting a thread for less than this much output. */
+#define PARALLEL_MIN_BYTES_PER_THREAD (1024 * 1024)
+/* Never use more than this many threads for one request. */
+#define PARALLEL_MAX_THREADS 64
+/* Start each thread on a multiple of this many blocks, so that every
+   thread but the last gets to use the widest kernel the whole way. */
+#define PARALLEL_BLOCK_ALIGN 16
+
+#if PARALLEL_BLOCK_ALIGN * CHACHA_BLOCKSIZE % CHACHA_NT_ALIGN != 0
+#error "Threads need to start on aligned addresses for non-temporal stores."
+#endif
+
+#ifndef _WIN32
+#define USING_PARALLEL_FILL
+
+/* One thread's share of the work. */
+struct chacha20_job {
+  const unsigned char *key;
+  uint64_t counter;
+  size_t n_blocks;
+  unsigned char *output;
+  int nontemporal;
+};
+
+static void *
+chacha20_job_run_(void *arg)
+{
+  const struct chacha20_job *job = arg;
+  chacha20_blocks_at(job->key, job->counter, job->n_blocks, job->output,
+                     job->nontemporal);
+  return NULL;
+}
+
+/*
+  Decide how many threads to use for 'n_blocks' blocks, when the caller
+  asked for 'n_threads'.  (0 means "one per online CPU".)
+*/
+static int
+parallel_n_threads_(size_t n_blocks, int n_threads)
+{
+  const size_t max_useful =
+    n_blocks / (PARALLEL_MIN_BYTES_PER_THREAD / CHACHA_BLOCKSIZE);
+
+  if (n_threads <= 0)
+    {
+#ifdef _SC_NPROCESSORS_ONLN
+      long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      n_threads = (n_cpus > 0 && n_cpus < INT_MAX) ? (int)n_cpus : 1;
+#else
+      n_threads = 1;
+#endif
+    }
+  if (n_threads > PARALLEL_MAX_THREADS)
+    n_threads = PARALLEL_MAX_THREADS;
+  if ((size_t)n_threads > max_useful)
+    n_threads = max_useful ? (int)max_useful : 1;
+
+  return n_threads;
+}
+
+/*
+  As chacha20_blocks_at() starting at block 0, but split the work across up
+  to 'n_threads' threads (counting the caller).  If we can't start a thread,
+  we do its work ourselves.
+*/
+static void
+chacha20_blocks_parallel(const unsigned char key[CHACHA_KEYLEN + CHACHA_IVLEN],
+                         size_t n_blocks,
+                         unsigned char *const output,
+                         int n_threads,
+                         int nontemporal)
+{
+  struct chacha20_job jobs[PARALLEL_MAX_THREADS];
+  pthread_t threads[PARALLEL_MAX_THREADS];
+  int started[PARALLEL_MAX_THREADS];
+  size_t per_thread, done = 0;
+  int i, n_jobs = 0;
+
+  n_threads = parallel_n_threads_(n_blocks, n_threads);
+  if (n_threads <= 1)
+    {
+      chacha20_blocks_at(key, 0, n_blocks, output, nontemporal);
+      return;
+    }
+
+  per_thread = (n_blocks + n_threads - 1) / n_threads;
+  per_thread = (per_thread + PARALLEL_BLOCK_ALIGN - 1) &
+    ~(size_t)(PARALLEL_BLOCK_ALIGN - 1);
+
+  while (done < n_blocks)
+    {
+      struct chacha20_job *job = &jobs[n_jobs++];
+      job->key = key;
+      job->counter = done;
+      job->n_blocks = (n_blocks - done < per_thread) ? n_blocks - done
+        : per_thread;
+      job->output = output + done * CHACHA_BLOCKSIZE;
+      job->nontemporal = nontemporal;
+      done += job->n_blocks;
+    }
+
+  /* The caller takes the first job; everybody else gets a thread. */
+  for (i = 1; i < n_jobs; ++i)
+    {
+      started[i] = 0 == pthread_create(&threads[i], NULL,
+                                       chacha20_job_run_, &jobs[i]);
+      if (!started[i])
+        chacha20_job_run_(&jobs[i]);
+    }
+  chacha20_job_run_(&jobs[0]);
+
+  for (i = 1; i < n_jobs; ++i)
+    {
+      if (started[i])
+        pthread_join(threads[i], NULL);
+    }
+}
+
+#else
+
+#define chacha20_blocks_parallel(key, n_blocks, output, n_threads, nt)  \
+  chacha20_blocks_at((key), 0, (n_blocks), (output), (nt))
+
+#endif /* _WIN32 */
+#endif /* OTTERYLITE_PARALLEL_H_INCLUDED */
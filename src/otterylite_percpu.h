@@ -0,0 +1,92 @@
+/* otterylite_percpu.h -- find out which CPU we're on, and which we can use */
+
+/*
+  To the extent possible under law, Nick Mathewson has waived all copyright and
+  related or neighboring rights to libottery-lite, using the creative commons
+  "cc0" public domain dedication.  See doc/cc0.txt or
+  <http://creativecommons.org/publicdomain/zero/1.0/> for full details.
+*/
+
+#ifndef OTTERYLITE_PERCPU_H_INCLUDED
+#define OTTERYLITE_PERCPU_H_INCLUDED
+
+#ifdef OTTERY_PER_CPU_RNG
+
+/* We don't look at any CPU numbered this high or higher. */
+#define PERCPU_MAX_CPUS 1024
+
+/*
+  Fill 'map' so that map[cpu] is the index of the shard that 'cpu' should
+  use, and return the number of shards.
+
+  We only count the CPUs that we're allowed to run on, so that a process in
+  a small container on a big machine doesn't make a shard for every CPU on
+  the host.  CPUs outside our affinity mask (we can be moved later) share
+  with the ones inside it.
+*/
+static unsigned
+percpu_cpuset_(unsigned short map[PERCPU_MAX_CPUS])
+{
+  unsigned long mask[PERCPU_MAX_CPUS / (8 * sizeof(unsigned long))];
+  const unsigned bits = 8 * sizeof(unsigned long);
+  unsigned cpu, n = 0;
+  long r;
+
+  memset(mask, 0, sizeof(mask));
+  /* The raw syscall returns the number of bytes it filled in. */
+  r = syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask);
+
+  if (r > 0)
+    {
+      for (cpu = 0; cpu < PERCPU_MAX_CPUS; ++cpu)
+        {
+          if (mask[cpu / bits] & (1ul << (cpu % bits)))
+            map[cpu] = (unsigned short)n++;
+        }
+    }
+  if (n == 0)
+    {
+      long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      n = (n_cpus > 0 && n_cpus < PERCPU_MAX_CPUS) ? (unsigned)n_cpus : 1;
+      memset(mask, 0, sizeof(mask));
+    }
+
+  for (cpu = 0; cpu < PERCPU_MAX_CPUS; ++cpu)
+    {
+      if (0 == (mask[cpu / bits] & (1ul << (cpu % bits))))
+        map[cpu] = (unsigned short)(cpu % n);
+    }
+
+  return n;
+}
+
+/*
+  Return the number of the CPU we're running on.  This is only a hint: we
+  could get moved as soon as we've read it, so callers still need a lock.
+
+  With glibc 2.35 or later, the kernel keeps the number up to date in our
+  thread's rseq area, so reading it is just a load.  Otherwise we have to
+  ask.
+*/
+static inline unsigned
+percpu_current_cpu_(void)
+{
+  unsigned cpu = 0;
+#ifdef OTTERY_HAVE_RSEQ
+  if (__rseq_size > 0)
+    {
+      const volatile struct rseq *rs = (const volatile struct rseq *)
+        ((char *)__builtin_thread_pointer() + __rseq_offset);
+      /* Unregistered threads have a "negative" cpu_id. */
+      cpu = rs->cpu_id;
+      if (cpu < PERCPU_MAX_CPUS)
+        return cpu;
+    }
+#endif
+  if (syscall(SYS_getcpu, &cpu, NULL, NULL) < 0 || cpu >= PERCPU_MAX_CPUS)
+    return 0;
+  return cpu;
+}
+
+#endif /* OTTERY_PER_CPU_RNG */
+#endif /* OTTERYLITE_PERCPU_H_INCLUDED */
@@ -17,6 +17,8 @@
 #define CHACHA_ROUNDS 20
 #define CHACHA_KEYLEN 32
 #define CHACHA_IVLEN 8
+/* Output alignment that the non-temporal kernels need. */
+#define CHACHA_NT_ALIGN 64
 
 #define CHACHA_QUARTER_ROUND(a, b, c, d)        \
   do {                                          \
@@ -30,35 +32,24 @@
     b = ROTL32(b ^ c, 7);                       \
   } while (0)
 
+/*
+  Generate 'n_blocks' blocks of ChaCha20 output from the input block 'x', and
+  write them to 'output'.  The block counter starts out at x[12] and x[13];
+  when we're done, we leave it pointing at the next block.
+
+  This is the reference implementation.  The vectorized ones must produce
+  exactly the same output.
+*/
 static void
-chacha20_blocks(const unsigned char key[CHACHA_KEYLEN + CHACHA_IVLEN],
-                size_t n_blocks,
-                unsigned char *const output)
+chacha20_blocks_ref_(uint32_t x[16], size_t n_blocks, unsigned char *output)
 {
-  uint32_t x[16];
   uint32_t y[16];
   size_t i;
   int j;
-  unsigned char *outp = output;
-
-  x[0] = 1634760805u;
-  x[1] = 857760878u;
-  x[2] = 2036477234u;
-  x[3] = 1797285236u;
-  read_u32_le(&x[4], key, 8);
-  x[12] = 0;
-  x[13] = 0;
-  read_u32_le(&x[14], key + 32, 2);
 
   for (i = 0; i < n_blocks; ++i)
     {
-      x[12] = (i & 0xffffffffu);
-#if SIZE_MAX > 0xffffffff
-      x[13] = (i >> 32);
-#else
-      x[13] = 0;
-#endif
-      memcpy(y, x, sizeof(x));
+      memcpy(y, x, sizeof(y));
 
       for (j = 0; j < (CHACHA_ROUNDS / 2); ++j)
         {
@@ -77,16 +68,154 @@ chacha20_blocks(const unsigned char key[CHACHA_KEYLEN + CHACHA_IVLEN],
           y[j] += x[j];
         }
 
-      write_u32_le(outp, y, 16);
-      outp += sizeof(y);
+      write_u32_le(output, y, 16);
+      output += sizeof(y);
+
+      if (++x[12] == 0)
+        ++x[13];
     }
 
-  memwipe(x, sizeof(x));
   memwipe(y, sizeof(y));
 }
 
 #undef CHACHA_QUARTER_ROUND
 
+/* The vectorized implementations live in their own files. */
+#include "otterylite_chacha_x86.h"
+#include "otterylite_chacha_vec.h"
+
+/*
+  A way to compute ChaCha20 blocks, 'width' blocks at a time.
+*/
+struct chacha20_impl {
+  const char *name;
+  void (*blocks_fn)(uint32_t x[16], size_t n_blocks, unsigned char *output);
+  /* As blocks_fn, but with non-temporal stores.  NULL if we don't have
+     one. */
+  void (*blocks_nt_fn)(uint32_t x[16], size_t n_blocks, unsigned char *output);
+  size_t width;
+  /* Which CPU_* features does it need at runtime? */
+  unsigned cpu_features;
+};
+
+/*
+  The implementations we know about, fastest first.  Each one must only need
+  a subset of the CPU features that the ones before it need, since
+  chacha20_blocks_at() hands leftover blocks to the next one down without
+  checking again.  That's why the AVX-512 entry asks for AVX2 too.
+*/
+static const struct chacha20_impl chacha20_impls[] = {
+#ifdef OTTERY_HAVE_X86_DISPATCH
+  { "avx512", chacha20_blocks_avx512_, chacha20_blocks_avx512_nt_,
+    CHACHA_AVX512_BLOCKS, CPU_AVX512F | CPU_AVX2 },
+  { "avx2", chacha20_blocks_avx2_, chacha20_blocks_avx2_nt_,
+    CHACHA_AVX2_BLOCKS, CPU_AVX2 },
+#endif
+#ifdef OTTERY_HAVE_SSE2
+#ifdef OTTERY_HAVE_SSSE3
+  { "ssse3", chacha20_blocks_sse2_, chacha20_blocks_sse2_nt_,
+    CHACHA_SSE2_BLOCKS, 0 },
+#else
+  { "sse2", chacha20_blocks_sse2_, chacha20_blocks_sse2_nt_,
+    CHACHA_SSE2_BLOCKS, 0 },
+#endif
+#endif
+#ifdef OTTERY_HAVE_VECTOR_EXT
+  { "generic", chacha20_blocks_vec_, NULL, CHACHA_VEC_BLOCKS, 0 },
+#endif
+  { "ref", chacha20_blocks_ref_, NULL, 1, 0 },
+};
+
+/* The implementation we're using, or NULL if we haven't picked one yet. */
+static const struct chacha20_impl *chacha20_impl_ = NULL;
+
+/*
+  Pick the fastest ChaCha20 implementation that this CPU supports.  We only
+  need to do this once, but it's harmless to do it again.
+*/
+static const struct chacha20_impl *
+chacha20_select_impl(void)
+{
+  const struct chacha20_impl *impl;
+  unsigned features = 0;
+
+#ifdef OTTERY_HAVE_X86_DISPATCH
+  features = cpu_features_();
+#endif
+
+  /* The last one needs nothing, so this always finds something. */
+  impl = chacha20_impls;
+  while ((impl->cpu_features & ~features) != 0)
+    ++impl;
+
+  chacha20_impl_ = impl;
+  return impl;
+}
+
+/*
+  Generate 'n_blocks' blocks of ChaCha20 output, using the key and nonce in
+  'key', starting at block number 'counter'.  Write them to 'output'.
+
+  If 'nontemporal' is set, try to write the output without pulling it into
+  the cache.  We can only do that if 'output' is CHACHA_NT_ALIGN-aligned,
+  and we have a kernel that supports it; otherwise we ignore the flag.
+*/
+static void
+chacha20_blocks_at(const unsigned char key[CHACHA_KEYLEN + CHACHA_IVLEN],
+                   uint64_t counter,
+                   size_t n_blocks,
+                   unsigned char *const output,
+                   int nontemporal)
+{
+  const struct chacha20_impl *impl = chacha20_impl_;
+  unsigned char *out = output;
+  uint32_t x[16];
+  size_t n_done;
+
+  if (UNLIKELY(impl == NULL))
+    impl = chacha20_select_impl();
+
+  x[0] = 1634760805u;
+  x[1] = 857760878u;
+  x[2] = 2036477234u;
+  x[3] = 1797285236u;
+  read_u32_le(&x[4], key, 8);
+  x[12] = (uint32_t)counter;
+  x[13] = (uint32_t)(counter >> 32);
+  read_u32_le(&x[14], key + 32, 2);
+
+  /* Do as many blocks as we can with the widest code, then hand the rest to
+     the narrower implementations after it in the table.  The last one is
+     one block wide, so it finishes the job. */
+  for (; n_blocks; ++impl)
+    {
+      n_done = n_blocks - (n_blocks % impl->width);
+      if (n_done == 0)
+        continue;
+      if (nontemporal && impl->blocks_nt_fn &&
+          ((uintptr_t)out & (CHACHA_NT_ALIGN - 1)) == 0)
+        impl->blocks_nt_fn(x, n_done, out);
+      else
+        impl->blocks_fn(x, n_done, out);
+      out += n_done * CHACHA_BLOCKSIZE;
+      n_blocks -= n_done;
+    }
+
+  memwipe(x, sizeof(x));
+}
+
+/*
+  Generate 'n_blocks' blocks of ChaCha20 output, using the key and nonce in
+  'key', starting at block 0.  Write them to 'output'.
+*/
+static inline void
+chacha20_blocks(const unsigned char key[CHACHA_KEYLEN + CHACHA_IVLEN],
+                size_t n_blocks,
+                unsigned char *const output)
+{
+  chacha20_blocks_at(key, 0, n_blocks, output, 0);
+}
+
 /* The amount of secret material that we use to fill an ottery buffer.
 
    (Even though we're using 320 bits here, I do not claim 320-bit security.)
@@ -120,6 +249,30 @@ struct ottery_rng {
     How many times have we regenerated buf?  If this gets large, we rekey.
   */
   unsigned count;
+  /*
+    Which of bufs[] is the current buffer?  (We call it 'buf' below.)
+  */
+  unsigned cur;
+  /*
+    One of the SPARE_* values below, to say what's in the other buffer.
+  */
+  unsigned spare_state;
+#ifdef MADV_WIPEONFORK
+  /*
+    Set if MADV_WIPEONFORK didn't work on this RNG, so a child would get a
+    copy of it instead of zeros.  (If it did work, a child sees 0 here,
+    along with everything else.)
+  */
+  unsigned wipeonfork_failed;
+#endif
+#ifdef OTTERY_INCREMENTAL_REFILL
+  /*
+    How many blocks of the next buffer we've made in the spare so far, and
+    the value of idx at which we make some more.
+  */
+  unsigned spare_blocks;
+  unsigned spare_next;
+#endif
   /*
     For all 0 <= j < idx, buf[j] contains 0.
 
@@ -128,10 +281,118 @@ struct ottery_rng {
 
     The last KEYLEN bytes of buf will be the key material for the next
     buffer.
+
+    The other buffer is the spare: when it's ready, it holds a whole buffer
+    that somebody generated without holding the lock, from a key that they
+    took out of the stream.  When buf runs out, we switch to the spare
+    instead of generating a new buffer.
+
+    With OTTERY_INCREMENTAL_REFILL, the spare is the next buffer instead,
+    made from the key at the end of buf, a step at a time.
   */
-  unsigned char buf[OTTERY_BUFLEN];
+  unsigned char bufs[2][OTTERY_BUFLEN];
 };
 
+/* The current buffer, and the spare. */
+#define RNG_BUF(st) ((st)->bufs[(st)->cur])
+#define RNG_SPARE(st) ((st)->bufs[(st)->cur ^ 1])
+
+/* Nothing in the spare buffer; nobody is working on it. */
+#define SPARE_EMPTY 0
+/* Somebody has a key for the spare buffer, and is filling it. */
+#define SPARE_FILLING 1
+/* The spare buffer is ready to use. */
+#define SPARE_READY 2
+/* Somebody is filling the spare buffer, but we rekeyed in the meantime, so
+   we'll throw it away when they're done. */
+#define SPARE_STALE 3
+
+/* Once this much of the current buffer is used, start on the spare. */
+#define SPARE_CLAIM_AFTER ((OTTERY_BUFLEN - OTTERY_KEYLEN) / 2)
+
+#ifdef OTTERY_INCREMENTAL_REFILL
+#ifndef OTTERY_REFILL_STEP
+#define OTTERY_REFILL_STEP 4
+#endif
+#if OTTERY_REFILL_STEP < 1 || OTTERY_N_BLOCKS % OTTERY_REFILL_STEP != 0
+#error "OTTERY_REFILL_STEP has to divide OTTERY_N_BLOCKS"
+#endif
+/* We make one step as soon as we start on a buffer, and the others every
+   this many bytes after, so the spare is done well before we need it. */
+#define REFILL_STRIDE \
+  ((OTTERY_BUFLEN - OTTERY_KEYLEN) / (OTTERY_N_BLOCKS / OTTERY_REFILL_STEP))
+
+/*
+  Make the next OTTERY_REFILL_STEP blocks of the next buffer in the spare.
+*/
+static void
+ottery_refill_step(struct ottery_rng *st)
+{
+  chacha20_blocks_at(RNG_BUF(st) + OTTERY_BUFLEN - OTTERY_KEYLEN,
+                     st->spare_blocks, OTTERY_REFILL_STEP,
+                     RNG_SPARE(st) + st->spare_blocks * CHACHA_BLOCKSIZE, 0);
+  st->spare_blocks += OTTERY_REFILL_STEP;
+  if (st->spare_blocks == OTTERY_N_BLOCKS)
+    st->spare_next = UINT_MAX;
+  else
+    st->spare_next += REFILL_STRIDE;
+}
+
+/*
+  Forget whatever we've made of the next buffer, and start over with the
+  next call.
+*/
+static inline void
+ottery_refill_reset(struct ottery_rng *st)
+{
+  if (st->spare_blocks)
+    memwipe(RNG_SPARE(st), st->spare_blocks * CHACHA_BLOCKSIZE);
+  st->spare_blocks = 0;
+  st->spare_next = 0;
+}
+#endif
+
+/*
+  Helper: generate a new buffer in 'st' from the key at the end of the
+  current one.  If there's a spare ready, use that instead.
+*/
+static void
+ottery_next_buffer(struct ottery_rng *st)
+{
+  ++st->count;
+#ifdef OTTERY_INCREMENTAL_REFILL
+  if (st->spare_blocks)
+    {
+      /* Finish the spare if we got here first, and switch to it. */
+      if (st->spare_blocks < OTTERY_N_BLOCKS)
+        chacha20_blocks_at(RNG_BUF(st) + OTTERY_BUFLEN - OTTERY_KEYLEN,
+                           st->spare_blocks,
+                           OTTERY_N_BLOCKS - st->spare_blocks,
+                           RNG_SPARE(st) + st->spare_blocks * CHACHA_BLOCKSIZE,
+                           0);
+      memwipe(RNG_BUF(st), OTTERY_BUFLEN);
+      st->cur ^= 1;
+      st->spare_blocks = 0;
+      st->spare_next = 0;
+      return;
+    }
+  st->spare_next = 0;
+#endif
+  if (st->spare_state == SPARE_READY)
+    {
+      /* The spare didn't come from this buffer's key, so we throw it and
+         the rest of this buffer away. */
+      memwipe(RNG_BUF(st), OTTERY_BUFLEN);
+      st->cur ^= 1;
+      st->spare_state = SPARE_EMPTY;
+    }
+  else
+    {
+      chacha20_blocks(RNG_BUF(st) + OTTERY_BUFLEN - OTTERY_KEYLEN,
+                      OTTERY_N_BLOCKS, RNG_BUF(st));
+    }
+}
+
 /*
   Helper function to implement the slow-path of ottery_bytes.
 
@@ -147,32 +408,49 @@ ottery_bytes_slow(struct ottery_rng *st, u8 *out, size_t n,
                   size_t available_bytes)
 {
   /* First, give them the bytes that we have. */
-  memcpy(out, st->buf + st->idx, available_bytes);
+  memcpy(out, RNG_BUF(st) + st->idx, available_bytes);
   out += available_bytes;
   n -= available_bytes;
 
-  /* Then, so long as we're giving them a whole buffer at once, generate
-     more buffers and copy them out.
-
-     The original libottery had an optimization for this case, where it
-     write data straight into the output buffer.  But doing it this way
-     simplifies the code a lot.
+  /* Then, so long as they have room for a whole buffer, generate it
+     straight into their output.  The last KEYLEN bytes of each buffer are
+     the next key: we copy them back into st->buf, and then overwrite them
+     with the next buffer's output.  (We only do this when n >= BUFLEN, so
+     that at least KEYLEN more bytes of output will land on top of them
+     before we return.)
   */
-  while (n > OTTERY_BUFLEN - OTTERY_KEYLEN)
+#ifdef OTTERY_INCREMENTAL_REFILL
+  /* That changes the key at the end of the buffer, so the spare is no
+     good. */
+  if (n >= OTTERY_BUFLEN)
+    ottery_refill_reset(st);
+#endif
+  while (n >= OTTERY_BUFLEN)
     {
       ++st->count;
-      chacha20_blocks(st->buf + OTTERY_BUFLEN - OTTERY_KEYLEN, OTTERY_N_BLOCKS, st->buf);
-      memcpy(out, st->buf, OTTERY_BUFLEN - OTTERY_KEYLEN);
+      chacha20_blocks(RNG_BUF(st) + OTTERY_BUFLEN - OTTERY_KEYLEN, OTTERY_N_BLOCKS, out);
+      memcpy(RNG_BUF(st) + OTTERY_BUFLEN - OTTERY_KEYLEN,
+             out + OTTERY_BUFLEN - OTTERY_KEYLEN,
+             OTTERY_KEYLEN);
+      out += (OTTERY_BUFLEN - OTTERY_KEYLEN);
+      n -= (OTTERY_BUFLEN - OTTERY_KEYLEN);
+    }
+
+  /* If they want more than a buffer's worth of output, but don't have room
+     for the key too, we generate into st->buf and copy it out. */
+  if (n > OTTERY_BUFLEN - OTTERY_KEYLEN)
+    {
+      ottery_next_buffer(st);
+      memcpy(out, RNG_BUF(st), OTTERY_BUFLEN - OTTERY_KEYLEN);
       out += (OTTERY_BUFLEN - OTTERY_KEYLEN);
       n -= (OTTERY_BUFLEN - OTTERY_KEYLEN);
     }
 
   /* Now we're going to generate one more fresh block, and only give part
      of it out. (We might give it all, but no more.) */
-  ++st->count;
-  chacha20_blocks(st->buf + OTTERY_BUFLEN - OTTERY_KEYLEN, OTTERY_N_BLOCKS, st->buf);
-  memcpy(out, st->buf, n);
-  memset(st->buf, 0, n);
+  ottery_next_buffer(st);
+  memcpy(out, RNG_BUF(st), n);
+  memset(RNG_BUF(st), 0, n);
   st->idx = (unsigned)n;
 }
 
@@ -190,9 +468,13 @@ ottery_bytes(struct ottery_rng *st, void * const output, size_t n)
       /* Fast path: we don't need to generate more bytes; we can fulfil
          this from our buffer.
       */
-      memcpy(out, st->buf + st->idx, n);
-      memset(st->buf + st->idx, 0, n);
+      memcpy(out, RNG_BUF(st) + st->idx, n);
+      memset(RNG_BUF(st) + st->idx, 0, n);
       st->idx += n;
+#ifdef OTTERY_INCREMENTAL_REFILL
+      if (UNLIKELY(st->idx >= st->spare_next))
+        ottery_refill_step(st);
+#endif
     }
   else
     {
@@ -202,13 +484,83 @@ ottery_bytes(struct ottery_rng *st, void * const output, size_t n)
 
 
 /*
-  Replace the existing material in 'st' with material generated using 'key'
+  Replace the existing material in 'st' with material generated using 'key'.
+  The first time, 'st' has to be all zeros.
 */
 static void
 ottery_setkey(struct ottery_rng *st, const unsigned char key[OTTERY_KEYLEN])
 {
-  chacha20_blocks(key, OTTERY_N_BLOCKS, st->buf);
+  /* Anything in the spare came from the old key, so it has to go. */
+  if (st->spare_state == SPARE_FILLING)
+    {
+      st->spare_state = SPARE_STALE;
+    }
+  else if (st->spare_state != SPARE_STALE)
+    {
+      memwipe(RNG_SPARE(st), OTTERY_BUFLEN);
+      st->spare_state = SPARE_EMPTY;
+    }
+#ifdef OTTERY_INCREMENTAL_REFILL
+  st->spare_blocks = 0;
+  st->spare_next = 0;
+#endif
+
+  chacha20_blocks(key, OTTERY_N_BLOCKS, RNG_BUF(st));
   st->idx = 0;
   st->count = 0;
 }
 
+/*
+  If it's time to start on a spare buffer for 'st', take a key for it from
+  the stream, store the key in 'key', and return the buffer to fill.
+  Otherwise return NULL.
+
+  Callers must hold the lock.  If we return a buffer, the caller must fill
+  it with ottery_fill_spare() (without the lock, if they like), and then
+  call ottery_spare_done() with the lock held again.
+*/
+static inline u8 *
+ottery_claim_spare(struct ottery_rng *st, u8 key[OTTERY_KEYLEN])
+{
+#ifdef OTTERY_INCREMENTAL_REFILL
+  /* The spare is already spoken for. */
+  (void)st;
+  (void)key;
+  return NULL;
+#else
+  if (LIKELY(st->spare_state != SPARE_EMPTY || st->idx < SPARE_CLAIM_AFTER))
+    return NULL;
+  ottery_bytes(st, key, OTTERY_KEYLEN);
+  st->spare_state = SPARE_FILLING;
+  return RNG_SPARE(st);
+#endif
+}
+
+/*
+  Generate a spare buffer into 'spare' from 'key', and wipe the key.
+*/
+static inline void
+ottery_fill_spare(u8 *spare, u8 key[OTTERY_KEYLEN])
+{
+  chacha20_blocks(key, OTTERY_N_BLOCKS, spare);
+  memwipe(key, OTTERY_KEYLEN);
+}
+
+/*
+  Mark the spare buffer in 'st' as ready to use, unless we rekeyed while it
+  was being filled.  Callers must hold the lock.
+*/
+static inline void
+ottery_spare_done(struct ottery_rng *st)
+{
+  if (st->spare_state == SPARE_FILLING)
+    {
+      st->spare_state = SPARE_READY;
+    }
+  else
+    {
+      memwipe(RNG_SPARE(st), OTTERY_BUFLEN);
+      st->spare_state = SPARE_EMPTY;
+    }
+}
+
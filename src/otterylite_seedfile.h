@@ -0,0 +1,156 @@
+/* otterylite_seedfile.h -- keep some seed material in a file between runs */
+
+/*
+  To the extent possible under law, Nick Mathewson has waived all copyright and
+  related or neighboring rights to libottery-lite, using the creative commons
+  "cc0" public domain dedication.  See doc/cc0.txt or
+  <http://creativecommons.org/publicdomain/zero/1.0/> for full details.
+*/
+
+/*
+  This works like OpenBSD's random.seed.  If the application names a seed
+  file, the next full seed reads it and mixes it into the key, and then
+  overwrites it with fresh output before anybody sees any, so that no two
+  runs start from the same file.  A restart can then get a good key from
+  the file and one quick strong source, instead of waiting for everything
+  (or for the fallback kludge, on a machine that has nothing better).
+
+  We only trust a file that's a regular file, not a symlink, that belongs
+  to us, and that nobody else can read or write.  If it's there and we don't
+  trust it, we leave it alone.  And the file only counts toward our
+  entropy status once we've replaced it and fsynced the replacement:
+  otherwise the next run could start from the same file as this one.
+*/
+
+#ifndef OTTERYLITE_SEEDFILE_H_INCLUDED
+#define OTTERYLITE_SEEDFILE_H_INCLUDED
+
+/* How many bytes we keep in the seed file. */
+#define SEED_FILE_LEN 64
+
+#ifndef _WIN32
+#define USING_SEED_FILE
+
+#ifdef PATH_MAX
+#define SEED_FILE_PATH_MAX PATH_MAX
+#else
+#define SEED_FILE_PATH_MAX 1024
+#endif
+
+/* Protects ottery_seed_file_path and ottery_seed_file_unread. */
+DECLARE_INITIALIZED_LOCK(static, ottery_seed_file_mutex)
+/* The name of the seed file, or "" if we don't have one. */
+static char ottery_seed_file_path[SEED_FILE_PATH_MAX];
+/* Set if we have a seed file that the next full seed should read. */
+static int ottery_seed_file_unread;
+
+/*
+  Open the seed file at 'path' for reading and writing, with 'flags' added.
+  Return the fd, or -1 with errno set if we can't, or (with EPERM) if it
+  isn't a file we trust.
+*/
+static int
+ottery_seed_file_open_(const char *path, int flags)
+{
+  struct stat st;
+  int fd;
+
+  fd = open(path, O_RDWR | O_CLOEXEC | O_NOFOLLOW | flags, 0600);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+      st.st_uid != geteuid() || (st.st_mode & (S_IRWXG | S_IRWXO)))
+    {
+      close(fd);
+      errno = EPERM;
+      return -1;
+    }
+  return fd;
+}
+
+/*
+  If there's a seed file we haven't read yet, open it (making it if it's
+  missing), store the fd in *'fd_out', and read up to SEED_FILE_LEN bytes
+  of it into 'out'.  Return how many bytes we got.  Return -1 if there's
+  no seed file, or we can't use it.
+
+  The caller has to pass the fd to ottery_seed_file_done_() later.
+*/
+static int
+ottery_seed_file_read_(u8 *out, int *fd_out)
+{
+  ssize_t r;
+  int fd, n = 0;
+
+  GET_STATIC_LOCK(ottery_seed_file_mutex);
+  if (!ottery_seed_file_unread)
+    {
+      RELEASE_STATIC_LOCK(ottery_seed_file_mutex);
+      return -1;
+    }
+  ottery_seed_file_unread = 0;
+  fd = ottery_seed_file_open_(ottery_seed_file_path, O_CREAT);
+  RELEASE_STATIC_LOCK(ottery_seed_file_mutex);
+  if (fd < 0)
+    return -1;
+
+  while (n < SEED_FILE_LEN)
+    {
+      r = read(fd, out + n, SEED_FILE_LEN - n);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        break;
+      n += (int)r;
+    }
+
+  *fd_out = fd;
+  return n;
+}
+
+/*
+  Replace the contents of the seed file open on 'fd' with the
+  SEED_FILE_LEN bytes in 'seed', make sure they're on the disk, and close
+  it.  Return 0 on success.  If 'seed' is NULL, or we fail, close it
+  anyway, tell the next full seed to read it again, and return -1.
+
+  We write over the old contents in place, instead of truncating the file
+  first: on most filesystems, giving back the old block and allocating a
+  new one costs a lot more than the write.
+*/
+static int
+ottery_seed_file_done_(int fd, const u8 *seed)
+{
+  struct stat st;
+  ssize_t r;
+  int n = 0;
+
+  while (seed && n < SEED_FILE_LEN)
+    {
+      r = pwrite(fd, seed + n, SEED_FILE_LEN - n, n);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        break;
+      n += (int)r;
+    }
+  if (n == SEED_FILE_LEN && fstat(fd, &st) == 0 &&
+      st.st_size > SEED_FILE_LEN && ftruncate(fd, SEED_FILE_LEN) < 0)
+    n = 0;
+  if (n == SEED_FILE_LEN && fsync(fd) < 0)
+    n = 0;
+  if (close(fd) < 0)
+    n = 0;
+
+  if (n == SEED_FILE_LEN)
+    return 0;
+
+  GET_STATIC_LOCK(ottery_seed_file_mutex);
+  if (ottery_seed_file_path[0])
+    ottery_seed_file_unread = 1;
+  RELEASE_STATIC_LOCK(ottery_seed_file_mutex);
+  return -1;
+}
+#endif
+
+#endif /* OTTERYLITE_SEEDFILE_H_INCLUDED */
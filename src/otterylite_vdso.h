@@ -0,0 +1,184 @@
+/* otterylite_vdso.h -- call getrandom() through the Linux vDSO */
+
+/*
+  To the extent possible under law, Nick Mathewson has waived all copyright and
+  related or neighboring rights to libottery-lite, using the creative commons
+  "cc0" public domain dedication.  See doc/cc0.txt or
+  <http://creativecommons.org/publicdomain/zero/1.0/> for full details.
+*/
+
+/*
+  Linux 6.11 and later can export a getrandom() from the vDSO, which runs
+  in userspace, and only enters the kernel when it needs a new key.  It
+  wants a chunk of opaque state from each caller, allocated the way the
+  kernel tells us.  We only keep one chunk, and take a lock to use it: we
+  don't call getrandom() very often.
+
+  If the vDSO doesn't have the function, we say -ENOSYS, and the caller
+  can make the system call instead.
+*/
+
+#ifndef OTTERYLITE_VDSO_H_INCLUDED
+#define OTTERYLITE_VDSO_H_INCLUDED
+
+/* What the vDSO tells us about how to allocate its state. */
+struct ottery_vgetrandom_params {
+  uint32_t size_of_opaque_state;
+  uint32_t mmap_prot;
+  uint32_t mmap_flags;
+  uint32_t reserved[13];
+};
+
+typedef long (*ottery_vgetrandom_fn)(void *buf, size_t len, unsigned flags,
+                                     void *opaque_state, size_t opaque_len);
+
+DECLARE_INITIALIZED_LOCK(static, ottery_vgetrandom_mutex)
+/* 0 if we haven't looked for the vDSO function yet; 1 if we found it and
+   have its state; -1 if we can't use it. */
+static int ottery_vgetrandom_status;
+static ottery_vgetrandom_fn ottery_vgetrandom_fn_;
+static void *ottery_vgetrandom_state;
+static size_t ottery_vgetrandom_state_len;
+
+/*
+  Look up the function called 'name' in the vDSO.  Return NULL if there
+  isn't a vDSO, or it doesn't have one.
+
+  We find the symbols through the sysv hash table, as the kernel's own
+  example parser does; every vDSO with getrandom has one.
+*/
+static void *
+ottery_vdso_sym_(const char *name)
+{
+  const ElfW(Ehdr) *eh;
+  const ElfW(Phdr) *ph;
+  const ElfW(Dyn) *dyn = NULL;
+  const ElfW(Sym) *symtab = NULL;
+  const char *strtab = NULL;
+  const uint32_t *hash = NULL;
+  uintptr_t base, load_offset = 0;
+  int i, found_load = 0;
+  uint32_t j;
+
+  base = (uintptr_t)getauxval(AT_SYSINFO_EHDR);
+  if (!base)
+    return NULL;
+  eh = (const ElfW(Ehdr) *)base;
+  if (memcmp(eh->e_ident, ELFMAG, SELFMAG))
+    return NULL;
+
+  /* The addresses in the vDSO are relative to where it thinks it's
+     loaded. */
+  ph = (const ElfW(Phdr) *)(base + eh->e_phoff);
+  for (i = 0; i < eh->e_phnum; ++i)
+    {
+      if (ph[i].p_type == PT_LOAD && !found_load)
+        {
+          load_offset = base + ph[i].p_offset - ph[i].p_vaddr;
+          found_load = 1;
+        }
+      else if (ph[i].p_type == PT_DYNAMIC)
+        {
+          dyn = (const ElfW(Dyn) *)(base + ph[i].p_offset);
+        }
+    }
+  if (!found_load || !dyn)
+    return NULL;
+
+  for (; dyn->d_tag != DT_NULL; ++dyn)
+    {
+      switch (dyn->d_tag)
+        {
+        case DT_SYMTAB:
+          symtab = (const ElfW(Sym) *)(dyn->d_un.d_ptr + load_offset);
+          break;
+        case DT_STRTAB:
+          strtab = (const char *)(dyn->d_un.d_ptr + load_offset);
+          break;
+        case DT_HASH:
+          hash = (const uint32_t *)(dyn->d_un.d_ptr + load_offset);
+          break;
+        default:
+          break;
+        }
+    }
+  if (!symtab || !strtab || !hash)
+    return NULL;
+
+  /* hash[1] is the number of symbols. */
+  for (j = 0; j < hash[1]; ++j)
+    {
+      const ElfW(Sym) *sym = &symtab[j];
+      if (ELF64_ST_TYPE(sym->st_info) != STT_FUNC ||
+          sym->st_shndx == SHN_UNDEF)
+        continue;
+      if (!strcmp(strtab + sym->st_name, name))
+        return (void *)(sym->st_value + load_offset);
+    }
+  return NULL;
+}
+
+/*
+  Find the vDSO getrandom, and make it some state.  Return 0 if we can use
+  it, -1 if not.  Callers must hold ottery_vgetrandom_mutex.
+*/
+static int
+ottery_vgetrandom_init_(void)
+{
+  struct ottery_vgetrandom_params params;
+  ottery_vgetrandom_fn fn;
+  long page = sysconf(_SC_PAGESIZE);
+  void *st;
+
+  if (ottery_vgetrandom_status)
+    return ottery_vgetrandom_status > 0 ? 0 : -1;
+  ottery_vgetrandom_status = -1;
+
+  /* It's got different names on different architectures. */
+  fn = (ottery_vgetrandom_fn) ottery_vdso_sym_("__vdso_getrandom");
+  if (!fn)
+    fn = (ottery_vgetrandom_fn) ottery_vdso_sym_("__kernel_getrandom");
+  if (!fn)
+    return -1;
+
+  /* This is how you ask it what state it wants. */
+  memset(&params, 0, sizeof(params));
+  if (fn(NULL, 0, 0, &params, ~(size_t)0) != 0)
+    return -1;
+  if (page <= 0 || params.size_of_opaque_state == 0 ||
+      params.size_of_opaque_state > (unsigned long)page)
+    return -1;
+
+  /* The state mustn't cross a page, so give it a whole one.  The kernel
+     asks for flags that wipe it on fork, which is what we want. */
+  st = mmap(NULL, page, params.mmap_prot, params.mmap_flags, -1, 0);
+  if (st == MAP_FAILED)
+    return -1;
+
+  ottery_vgetrandom_fn_ = fn;
+  ottery_vgetrandom_state = st;
+  ottery_vgetrandom_state_len = params.size_of_opaque_state;
+  ottery_vgetrandom_status = 1;
+  return 0;
+}
+
+/*
+  As the getrandom system call, but through the vDSO: return the number of
+  bytes we wrote into 'out', or a negative errno.  Return -ENOSYS if there's
+  no vDSO getrandom.
+*/
+static int
+ottery_vgetrandom_(void *out, size_t n, unsigned flags)
+{
+  long r = -ENOSYS;
+
+  GET_STATIC_LOCK(ottery_vgetrandom_mutex);
+  if (ottery_vgetrandom_init_() == 0)
+    r = ottery_vgetrandom_fn_(out, n, flags, ottery_vgetrandom_state,
+                              ottery_vgetrandom_state_len);
+  RELEASE_STATIC_LOCK(ottery_vgetrandom_mutex);
+
+  return (int)r;
+}
+
+#endif /* OTTERYLITE_VDSO_H_INCLUDED */
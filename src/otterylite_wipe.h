@@ -29,6 +29,20 @@
 
 #define memwipe(p, n) SecureZeroMemory((p), (n))
 
+#elif defined(__GNUC__)
+
+/*
+  Telling the compiler that an asm statement might read the memory at 'p'
+  keeps it from eliminating the memset, and lets us clear big buffers a
+  word at a time rather than a byte at a time.
+*/
+static inline void
+memwipe(void *p, size_t n)
+{
+  memset(p, 0, n);
+  asm volatile ("" : : "r" (p) : "memory");
+}
+
 #else
 
 static inline void
@@ -0,0 +1,167 @@
+/*
+   To the extent possible under law, Nick Mathewson has waived all copyright and
+   related or neighboring rights to libottery-lite, using the creative commons
+   "cc0" public domain dedication.  See doc/cc0.txt or
+   <http://creativecommons.org/publicdomain/zero/1.0/> for full details.
+ */
+
+#ifdef OTTERY_ASYNC_RESEED
+
+/* Wait up to a few seconds for the worker to give us a new key. */
+static int
+async_wait_for_seed(unsigned counter)
+{
+  int i;
+  unsigned c;
+
+  for (i = 0; i < 500; ++i)
+    {
+      LOCK();
+      c = ottery_seed_counter;
+      UNLOCK();
+      if (c == counter)
+        return 0;
+      usleep(10000);
+    }
+  return -1;
+}
+
+static void
+test_async_reseed(void *arg)
+{
+  (void)arg;
+
+  ottery_random();
+  tt_int_op(ottery_seed_counter, ==, 1);
+
+  /* Crossing the line only asks the worker. */
+  ottery_testing_seed_delay_usec = 100000;
+  RNG_PTR->count = RESEED_AFTER_BLOCKS + 1;
+  BUMP_GENERATION(); /* So that any local RNGs look at the global one. */
+  ottery_random();
+  tt_int_op(ottery_seed_counter, ==, 1);
+  tt_int_op(ottery_async_pending, ==, 1);
+  tt_int_op(ottery_async_pid, ==, getpid());
+
+  /* Asking again doesn't do anything while we wait. */
+  BUMP_GENERATION();
+  ottery_random();
+  tt_int_op(ottery_seed_counter, ==, 1);
+
+  /* And then the worker gives us a new key. */
+  tt_int_op(0, ==, async_wait_for_seed(2));
+  LOCK();
+  tt_int_op(ottery_async_pending, ==, 0);
+  tt_int_op(RNG_PTR->count, ==, 0);
+  tt_int_op(ottery_entropy_status, ==, 2);
+  tt_assert(ottery_reseed_nsec >= 100000000);
+  UNLOCK();
+
+  /* A manual reseed still happens right away. */
+  ottery_need_reseed();
+  ottery_random();
+  tt_int_op(ottery_seed_counter, ==, 3);
+
+end:
+  ottery_testing_seed_delay_usec = 0;
+}
+
+static void
+test_async_limit(void *arg)
+{
+  (void)arg;
+
+  ottery_random();
+
+  /* If the worker takes too long, we stop waiting for it. */
+  ottery_testing_seed_delay_usec = 300000;
+  RNG_PTR->count = RESEED_AFTER_BLOCKS + 1;
+  BUMP_GENERATION();
+  ottery_random();
+  tt_int_op(ottery_async_pending, ==, 1);
+  LOCK();
+  RNG_PTR->count = ottery_async_count_limit + 1;
+  BUMP_GENERATION();
+  UNLOCK();
+  ottery_random();
+  tt_int_op(ottery_seed_counter, ==, 2);
+  tt_int_op(ottery_async_pending, ==, 0);
+
+  /* When it does come back, we don't want what it has. */
+  usleep(500000);
+  tt_int_op(ottery_seed_counter, ==, 2);
+
+end:
+  ottery_testing_seed_delay_usec = 0;
+}
+
+static void
+test_async_interval(void *arg)
+{
+  (void)arg;
+
+  ottery_random();
+
+  /* How long we wait for the worker follows the reseed interval. */
+  ottery_set_reseed_interval(100 * (OTTERY_BUFLEN - OTTERY_KEYLEN), 20);
+  ottery_testing_seed_delay_usec = 300000;
+  RNG_PTR->count = 101;
+  BUMP_GENERATION();
+  ottery_random();
+  LOCK();
+  tt_int_op(ottery_async_pending, ==, 1);
+  tt_int_op(ottery_async_count_limit, ==, 101 + 100 / ASYNC_RESEED_PATIENCE);
+  tt_assert(ottery_async_time_limit <=
+            ottery_coarse_sec() + 20 / ASYNC_RESEED_PATIENCE);
+  UNLOCK();
+
+end:
+  ottery_testing_seed_delay_usec = 0;
+}
+
+static void
+test_async_fork(void *arg)
+{
+  int status = 0;
+  pid_t child;
+
+  (void)arg;
+
+  ottery_random();
+  RNG_PTR->count = RESEED_AFTER_BLOCKS + 1;
+  BUMP_GENERATION();
+  ottery_random();
+  tt_int_op(0, ==, async_wait_for_seed(2));
+
+  /* A child gets its own worker. */
+  if ((child = fork()) == 0)
+    {
+      unsigned counter;
+      alarm(10);
+      ottery_random();
+      counter = ottery_seed_counter;
+      RNG_PTR->count = RESEED_AFTER_BLOCKS + 1;
+      BUMP_GENERATION();
+      ottery_random();
+      if (ottery_async_pid != getpid())
+        exit(1);
+      exit(async_wait_for_seed(counter + 1) == 0 ? 0 : 1);
+    }
+  tt_int_op(child, >, 0);
+  tt_int_op(child, ==, waitpid(child, &status, 0));
+  tt_assert(WIFEXITED(status));
+  tt_int_op(0, ==, WEXITSTATUS(status));
+
+end:
+  ;
+}
+
+static struct testcase_t async_tests[] = {
+  { "reseed", test_async_reseed, TT_FORK, NULL, NULL },
+  { "limit", test_async_limit, TT_FORK, NULL, NULL },
+  { "interval", test_async_interval, TT_FORK, NULL, NULL },
+  { "fork", test_async_fork, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
+
+#endif
@@ -72,6 +72,198 @@ dump_chacha20_test_vectors(void *arg)
   X("mus brains sit, morbo vel malefi", "cia? De ", 704);
 }
 
+/*
+  Make sure that chacha20_blocks() matches the reference implementation for
+  every number of blocks, whichever implementation it uses.
+*/
+static void
+test_chacha_blocks(void *arg)
+{
+  const u8 key[OTTERY_KEYLEN] = "Any sufficiently advanced keystream.";
+  u8 expected[CHACHA_BLOCKSIZE * 40], got[CHACHA_BLOCKSIZE * 40];
+  uint32_t x[16];
+  size_t n;
+
+  (void)arg;
+
+  for (n = 0; n <= 40; ++n)
+    {
+      x[0] = 1634760805u;
+      x[1] = 857760878u;
+      x[2] = 2036477234u;
+      x[3] = 1797285236u;
+      read_u32_le(&x[4], key, 8);
+      x[12] = 0;
+      x[13] = 0;
+      read_u32_le(&x[14], key + 32, 2);
+      memset(expected, 0, sizeof(expected));
+      memset(got, 0, sizeof(got));
+
+      chacha20_blocks_ref_(x, n, expected);
+      chacha20_blocks(key, n, got);
+
+      tt_mem_op(got, ==, expected, sizeof(got));
+    }
+end:
+  ;
+}
+
+#if defined(OTTERY_HAVE_SSE2) || defined(OTTERY_HAVE_VECTOR_EXT)
+/*
+  Make sure that 'fn', which does 'width' blocks at a time, matches the
+  reference implementation, including when the block counter wraps.  (We
+  give it aligned output, so that this works for the _nt_ kernels too.)
+*/
+static void
+check_chacha_kernel(void (*fn)(uint32_t *, size_t, unsigned char *),
+                    size_t width)
+{
+  static const uint32_t counters[][2] = {
+    { 0, 0 }, { 5, 0 }, { 0xfffffffe, 0 }, { 0xfffffffd, 7 },
+    { 0xffffffff, 0xffffffff },
+  };
+  u8 expected[CHACHA_BLOCKSIZE * 48];
+  u8 got_space[CHACHA_BLOCKSIZE * 48 + CHACHA_NT_ALIGN], *got;
+  uint32_t x1[16], x2[16];
+  unsigned i;
+  size_t n;
+  int j;
+
+  got = got_space + (-(uintptr_t)got_space & (CHACHA_NT_ALIGN - 1));
+
+  for (i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i)
+    {
+      for (n = 0; n <= 48; n += width)
+        {
+          for (j = 0; j < 16; ++j)
+            x1[j] = (uint32_t)(j + 1) * 0x9e3779b9u + i;
+          x1[12] = counters[i][0];
+          x1[13] = counters[i][1];
+          memcpy(x2, x1, sizeof(x1));
+          memset(expected, 0, sizeof(expected));
+          memset(got, 0, sizeof(expected));
+
+          chacha20_blocks_ref_(x1, n, expected);
+          fn(x2, n, got);
+
+          tt_mem_op(got, ==, expected, sizeof(expected));
+          tt_mem_op(x2, ==, x1, sizeof(x1));
+        }
+    }
+end:
+  ;
+}
+#endif
+
+#ifdef OTTERY_HAVE_SSE2
+static void
+test_chacha_sse2(void *arg)
+{
+  (void)arg;
+  check_chacha_kernel(chacha20_blocks_sse2_, CHACHA_SSE2_BLOCKS);
+  check_chacha_kernel(chacha20_blocks_sse2_nt_, CHACHA_SSE2_BLOCKS);
+}
+#endif
+
+#ifdef OTTERY_HAVE_VECTOR_EXT
+static void
+test_chacha_generic(void *arg)
+{
+  (void)arg;
+  check_chacha_kernel(chacha20_blocks_vec_, CHACHA_VEC_BLOCKS);
+}
+#endif
+
+#ifdef OTTERY_HAVE_X86_DISPATCH
+static void
+test_chacha_avx2(void *arg)
+{
+  (void)arg;
+  if (0 == (cpu_features_() & CPU_AVX2))
+    tt_skip();
+  check_chacha_kernel(chacha20_blocks_avx2_, CHACHA_AVX2_BLOCKS);
+  check_chacha_kernel(chacha20_blocks_avx2_nt_, CHACHA_AVX2_BLOCKS);
+end:
+  ;
+}
+
+static void
+test_chacha_avx512(void *arg)
+{
+  (void)arg;
+  if (0 == (cpu_features_() & CPU_AVX512F))
+    tt_skip();
+  check_chacha_kernel(chacha20_blocks_avx512_, CHACHA_AVX512_BLOCKS);
+  check_chacha_kernel(chacha20_blocks_avx512_nt_, CHACHA_AVX512_BLOCKS);
+end:
+  ;
+}
+#endif
+
+static void
+test_chacha_parallel(void *arg)
+{
+  /* Big enough that we really start threads, and not a whole number of
+     PARALLEL_BLOCK_ALIGN blocks. */
+  const size_t sizes[] = {
+    0, 1, 17, 4 * (PARALLEL_MIN_BYTES_PER_THREAD / CHACHA_BLOCKSIZE) + 37,
+  };
+  const int threads[] = { 0, 1, 2, 3, 4, 7 };
+  const size_t max_blocks = sizes[3];
+  u8 key[CHACHA_KEYLEN + CHACHA_IVLEN] =
+    "All happy keystreams are alike; each u";
+  u8 *expected = malloc(max_blocks * CHACHA_BLOCKSIZE);
+  u8 *got_space = malloc(max_blocks * CHACHA_BLOCKSIZE + CHACHA_NT_ALIGN);
+  u8 *got;
+  unsigned i, j;
+  int nt;
+
+  (void)arg;
+  tt_assert(expected);
+  tt_assert(got_space);
+  /* Aligned, so that the non-temporal stores really happen. */
+  got = got_space + (-(uintptr_t)got_space & (CHACHA_NT_ALIGN - 1));
+
+  chacha20_blocks(key, max_blocks, expected);
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+      for (j = 0; j < sizeof(threads) / sizeof(threads[0]); ++j)
+        {
+          for (nt = 0; nt <= 1; ++nt)
+            {
+              memset(got, 0, max_blocks * CHACHA_BLOCKSIZE);
+              chacha20_blocks_parallel(key, sizes[i], got, threads[j], nt);
+              tt_mem_op(got, ==, expected, sizes[i] * CHACHA_BLOCKSIZE);
+              tt_assert(iszero(got + sizes[i] * CHACHA_BLOCKSIZE,
+                               (max_blocks - sizes[i]) * CHACHA_BLOCKSIZE));
+            }
+        }
+    }
+
+end:
+  if (expected)
+    free(expected);
+  if (got_space)
+    free(got_space);
+}
+
+static struct testcase_t chacha_tests[] = {
+  { "blocks", test_chacha_blocks, 0, NULL, NULL },
+  { "parallel", test_chacha_parallel, 0, NULL, NULL },
+#ifdef OTTERY_HAVE_SSE2
+  { "sse2", test_chacha_sse2, 0, NULL, NULL },
+#endif
+#ifdef OTTERY_HAVE_VECTOR_EXT
+  { "generic", test_chacha_generic, 0, NULL, NULL },
+#endif
+#ifdef OTTERY_HAVE_X86_DISPATCH
+  { "avx2", test_chacha_avx2, 0, NULL, NULL },
+  { "avx512", test_chacha_avx512, 0, NULL, NULL },
+#endif
+  END_OF_TESTCASES
+};
+
 static struct testcase_t chacha_testvectors_tests[] = {
   { "make_chacha_testvectors", dump_chacha20_test_vectors,
     TT_OFF_BY_DEFAULT, NULL, 0 },
@@ -0,0 +1,92 @@
+/*
+   To the extent possible under law, Nick Mathewson has waived all copyright and
+   related or neighboring rights to libottery-lite, using the creative commons
+   "cc0" public domain dedication.  See doc/cc0.txt or
+   <http://creativecommons.org/publicdomain/zero/1.0/> for full details.
+ */
+
+#ifdef OTTERY_EAGER_INIT
+
+static void
+test_eager_ready(void *arg)
+{
+  pthread_t thread;
+
+  (void)arg;
+
+  /* The helper thread seeded the RNG without anybody asking.  (main()
+     undid that before running the tests; see undo_eager_init().) */
+  tt_assert(eager_loaded_magic_ok);
+  tt_int_op(eager_loaded_seed_counter, ==, 1);
+  tt_int_op(eager_loaded_init_state, ==, INIT_IDLE);
+
+  /* Once it has, the first call doesn't need to. */
+  tt_int_op(0, ==, pthread_create(&thread, NULL, ottery_eager_init_fn_,
+                                  NULL));
+  tt_int_op(0, ==, pthread_join(thread, NULL));
+  tt_int_op(ottery_seed_counter, ==, 1);
+  ottery_random();
+  tt_int_op(ottery_seed_counter, ==, 1);
+
+end:
+  ;
+}
+
+#define EAGER_N_FORKS 20
+
+static volatile int eager_stop;
+
+static void *
+eager_reseed_fn(void *arg)
+{
+  (void)arg;
+  while (!eager_stop)
+    {
+      ottery_need_reseed();
+      ottery_random();
+    }
+  return NULL;
+}
+
+static void
+test_eager_fork(void *arg)
+{
+  /* However busy the other threads are with the entropy sources, a child
+     never inherits one of our locks held. */
+  pthread_t thread;
+  int started = 0, i, status;
+  pid_t child;
+
+  (void)arg;
+  ottery_eager_join_();
+  tt_int_op(0, ==, pthread_create(&thread, NULL, eager_reseed_fn, NULL));
+  started = 1;
+
+  for (i = 0; i < EAGER_N_FORKS; ++i)
+    {
+      if ((child = fork()) == 0)
+        {
+          alarm(10);
+          ottery_need_reseed();
+          ottery_random();
+          exit(0);
+        }
+      tt_int_op(child, >, 0);
+      tt_int_op(child, ==, waitpid(child, &status, 0));
+      tt_assert(WIFEXITED(status));
+      tt_int_op(0, ==, WEXITSTATUS(status));
+    }
+
+end:
+  eager_stop = 1;
+  if (started)
+    pthread_join(thread, NULL);
+}
+
+static struct testcase_t eager_tests[] = {
+  { "ready", test_eager_ready, TT_FORK, NULL, NULL },
+  { "fork", test_eager_fork, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
+
+#endif
@@ -129,6 +129,72 @@ end:
   if (strlen(dir))
     rmdir(dir);
 }
+
+static void
+test_entropy_device_cache(void *arg)
+{
+  u8 buf[ENTROPY_CHUNK];
+  unsigned flags;
+  int fd, next_fd;
+
+  (void)arg;
+
+  /* 1. Opening the devices ahead of time leaves urandom open. */
+  ottery_devices_close();
+  tt_int_op(ottery_urandom_cache.fd, ==, -1);
+  tt_int_op(0, ==, ottery_devices_open());
+  fd = ottery_urandom_cache.fd;
+  tt_int_op(fd, >=, 0);
+
+  /* 2. Reading from it doesn't reopen it, and closes the copy of the fd
+     that it read from. */
+  next_fd = dup(0);
+  close(next_fd);
+  tt_int_op(ENTROPY_CHUNK, ==, ottery_getentropy_dev_urandom(buf, &flags));
+  tt_int_op(fd, ==, ottery_urandom_cache.fd);
+  tt_assert(!iszero(buf, sizeof(buf)));
+  tt_int_op(next_fd, ==, dup(0));
+  close(next_fd);
+
+  /* 3. If somebody closes it on us, we notice, and open it again. */
+  close(fd);
+  memset(buf, 0, sizeof(buf));
+  tt_int_op(ENTROPY_CHUNK, ==, ottery_getentropy_dev_urandom(buf, &flags));
+  tt_int_op(ottery_urandom_cache.fd, >=, 0);
+  tt_assert(!iszero(buf, sizeof(buf)));
+
+  /* 4. And closing them closes them. */
+  ottery_devices_close();
+  tt_int_op(ottery_urandom_cache.fd, ==, -1);
+  tt_int_op(ottery_hwrandom_cache.fd, ==, -1);
+
+end:
+  ;
+}
+#endif
+
+#ifdef USING_VGETRANDOM
+static void
+test_entropy_vgetrandom(void *arg)
+{
+  u8 buf1[ENTROPY_CHUNK], buf2[ENTROPY_CHUNK];
+
+  (void)arg;
+
+  memset(buf1, 0, sizeof(buf1));
+  memset(buf2, 0, sizeof(buf2));
+  if (ottery_vgetrandom_(buf1, sizeof(buf1), 0) == -ENOSYS)
+    tt_skip(); /* No vDSO getrandom on this kernel. */
+
+  tt_int_op(ottery_vgetrandom_status, ==, 1);
+  tt_int_op(ENTROPY_CHUNK, ==, ottery_vgetrandom_(buf2, sizeof(buf2), 0));
+  tt_assert(!iszero(buf1, sizeof(buf1)));
+  tt_assert(!iszero(buf2, sizeof(buf2)));
+  tt_mem_op(buf1, !=, buf2, sizeof(buf1));
+
+end:
+  ;
+}
 #endif
 
 #define TEST_ENTROPY_DISP_FUNC(name, val)             \
@@ -153,27 +219,30 @@ TEST_ENTROPY_DISP_FUNC(d, 'd')
 TEST_ENTROPY_DISP_FUNC(e, 'e')
 
 static struct entropy_source test_sources[] = {
-  { "a", entropy_source_fn_a, 1, 1, 0 },
-  { "b", entropy_source_fn_b, 2, 1, 0 },
-  { "c", entropy_source_fn_c, 4, 2, 0 },
-  { "d", entropy_source_fn_d, 8, 2, 0 },
-  { "e", entropy_source_fn_e, 16, 4, 0 },
+  { "a", entropy_source_fn_a, 1, 1, 0, 0 },
+  { "b", entropy_source_fn_b, 2, 1, 0, 0 },
+  { "c", entropy_source_fn_c, 4, 2, 0, 0 },
+  { "d", entropy_source_fn_d, 8, 2, 0, 0 },
+  { "e", entropy_source_fn_e, 16, 4, 0, 0 },
 };
 
+typedef int (*getentropy_impl_fn)(unsigned char *, int *,
+                                  const struct entropy_source * const, int);
+
 static void
 test_entropy_dispatcher(void *arg)
 {
 #define N 5
   u8 buf[ENTROPY_CHUNK * (N + 1)];
   int status = -10;
-  (void)arg;
+  getentropy_impl_fn impl = (getentropy_impl_fn)arg;
 
   memset(buf, 0, sizeof(buf));
 
   /* Straightforward case. We skip b and d because we had others in the same
    * group */
   tt_int_op(ENTROPY_CHUNK * 3, ==,
-            ottery_getentropy_impl(buf, &status, test_sources, N));
+            impl(buf, &status, test_sources, N));
 
   tt_mem_op("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
             "cccccccccccccccccccccccccccccccc"
@@ -188,7 +257,7 @@ test_entropy_dispatcher(void *arg)
   entropy_source_fn_a_fails = -2;
   entropy_source_fn_c_fails = -1;
   tt_int_op(ENTROPY_CHUNK * 3, ==,
-            ottery_getentropy_impl(buf, &status, test_sources, N));
+            impl(buf, &status, test_sources, N));
   tt_mem_op("bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"
             "dddddddddddddddddddddddddddddddd"
             "eeeeeeeeeeeeeeeeeeeeeeeeeeeeeeee", ==, buf, ENTROPY_CHUNK * 3);
@@ -201,7 +270,7 @@ test_entropy_dispatcher(void *arg)
   entropy_source_fn_a_fails = 3;
   entropy_source_fn_c_fails = 5;
   tt_int_op(ENTROPY_CHUNK * 3 + 8, ==,
-            ottery_getentropy_impl(buf, &status, test_sources, N));
+            impl(buf, &status, test_sources, N));
   tt_mem_op("aaa" "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"
             "ccccc" "dddddddddddddddddddddddddddddddd"
             "eeeeeeeeeeeeeeeeeeeeeeeeeeeeeeee", ==, buf, ENTROPY_CHUNK * 3 + 8);
@@ -216,7 +285,7 @@ test_entropy_dispatcher(void *arg)
   entropy_source_fn_a_fails = 0;
   entropy_source_fn_c_fails = 0;
   tt_int_op(ENTROPY_CHUNK * 2, ==,
-            ottery_getentropy_impl(buf, &status, test_sources, N));
+            impl(buf, &status, test_sources, N));
   tt_mem_op("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
             "cccccccccccccccccccccccccccccccc", ==, buf, ENTROPY_CHUNK * 2);
   tt_assert(iszero(buf + ENTROPY_CHUNK * 2, ENTROPY_CHUNK * (N - 1)));
@@ -227,7 +296,7 @@ test_entropy_dispatcher(void *arg)
   status = -10;
   entropy_source_fn_c_fails = -1;
   tt_int_op(ENTROPY_CHUNK * 2, ==,
-            ottery_getentropy_impl(buf, &status, test_sources, N));
+            impl(buf, &status, test_sources, N));
   tt_mem_op("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
             "dddddddddddddddddddddddddddddddd", ==, buf, ENTROPY_CHUNK * 2);
   tt_assert(iszero(buf + ENTROPY_CHUNK * 2, ENTROPY_CHUNK * (N - 1)));
@@ -241,7 +310,7 @@ test_entropy_dispatcher(void *arg)
   entropy_source_fn_a_fails = -1;
   test_sources[1].getentropy_fn = NULL;
   tt_int_op(ENTROPY_CHUNK * 2, ==,
-            ottery_getentropy_impl(buf, &status, test_sources, N));
+            impl(buf, &status, test_sources, N));
   tt_mem_op("dddddddddddddddddddddddddddddddd"
             "eeeeeeeeeeeeeeeeeeeeeeeeeeeeeeee", ==, buf, ENTROPY_CHUNK * 2);
   tt_assert(iszero(buf + ENTROPY_CHUNK * 2, ENTROPY_CHUNK * (N - 1)));
@@ -256,7 +325,7 @@ test_entropy_dispatcher(void *arg)
   entropy_source_fn_c_fails = -1;
   entropy_source_fn_d_fails = -1;
   tt_int_op(ENTROPY_CHUNK, ==,
-            ottery_getentropy_impl(buf, &status, test_sources, N));
+            impl(buf, &status, test_sources, N));
   tt_mem_op("eeeeeeeeeeeeeeeeeeeeeeeeeeeeeeee", ==, buf, ENTROPY_CHUNK * 1);
   tt_assert(iszero(buf + ENTROPY_CHUNK, ENTROPY_CHUNK * N));
   tt_int_op(status, ==, 1);
@@ -266,7 +335,7 @@ test_entropy_dispatcher(void *arg)
   status = -10;
   entropy_source_fn_e_fails = -1;
   tt_int_op(0, ==,
-            ottery_getentropy_impl(buf, &status, test_sources, N));
+            impl(buf, &status, test_sources, N));
   tt_assert(iszero(buf, sizeof(buf)));
   tt_int_op(status, ==, -1);
 
@@ -279,7 +348,7 @@ test_entropy_dispatcher(void *arg)
   entropy_source_fn_d_fails = 8;
   entropy_source_fn_e_fails = 6;
   tt_int_op(33, ==,
-            ottery_getentropy_impl(buf, &status, test_sources, N));
+            impl(buf, &status, test_sources, N));
   tt_mem_op("aaaaabbbbbbbbbbccccddddddddeeeeee", ==, buf, 33);
   tt_assert(iszero(buf + 33, sizeof(buf) - 33));
   tt_int_op(status, ==, 0);
@@ -289,12 +358,147 @@ end:
 #undef N
 }
 
+#ifdef USING_PARALLEL_ENTROPY
+static int entropy_source_slow_calls = 0;
+static int
+entropy_source_fn_slow(u8 *out, unsigned *flags_out)
+{
+  struct timespec ts = { 0, 300 * 1000 * 1000 };
+  ++entropy_source_slow_calls;
+  nanosleep(&ts, NULL);
+  *flags_out = 0;
+  memset(out, 's', ENTROPY_CHUNK);
+  return ENTROPY_CHUNK;
+}
+
+static void
+test_entropy_parallel_deadline(void *arg)
+{
+  struct entropy_source sources[3] = {
+    { "slow", entropy_source_fn_slow, 1, 1, 0, 50 },
+    { "a", entropy_source_fn_a, 2, 1, 0, 0 },
+    { "avoided", entropy_source_fn_slow, 4, 2, FLAG_AVOID, 0 },
+  };
+  u8 buf[ENTROPY_CHUNK * 4];
+  struct timespec start, end;
+  long msec;
+  int status = -10;
+
+  (void)arg;
+  memset(buf, 0, sizeof(buf));
+
+  /* We don't wait for the slow source: it counts as having failed, so we
+     use 'a' instead.  And since 'a' is strong, we never call the Avoided
+     one at all. */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  tt_int_op(ENTROPY_CHUNK, ==,
+            ottery_getentropy_parallel_impl(buf, &status, sources, 3));
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  msec = (end.tv_sec - start.tv_sec) * 1000 +
+    (end.tv_nsec - start.tv_nsec) / 1000000;
+  tt_int_op(msec, <, 250);
+  tt_mem_op("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", ==, buf, ENTROPY_CHUNK);
+  tt_assert(iszero(buf + ENTROPY_CHUNK, sizeof(buf) - ENTROPY_CHUNK));
+  tt_int_op(status, ==, 2);
+  tt_int_op(entropy_source_slow_calls, ==, 1);
+
+  /* If 'a' fails, we need the Avoided one, and we wait for it. */
+  memset(buf, 0, sizeof(buf));
+  entropy_source_fn_a_fails = -1;
+  tt_int_op(ENTROPY_CHUNK, ==,
+            ottery_getentropy_parallel_impl(buf, &status, sources, 3));
+  tt_mem_op("ssssssssssssssssssssssssssssssss", ==, buf, ENTROPY_CHUNK);
+  tt_int_op(status, ==, 2);
+  tt_int_op(entropy_source_slow_calls, ==, 3);
+
+end:
+  ;
+}
+#endif
+
+#define N 5
+static void
+test_entropy_memo(void *arg)
+{
+  u8 buf[ENTROPY_CHUNK * (N + 1)];
+  struct entropy_source_memo memo[N];
+  int status = -10;
+
+  (void)arg;
+  memset(memo, 0, sizeof(memo));
+
+  /* a isn't supported, and c fails.  So we get b, d, and e. */
+  entropy_source_fn_a_fails = -2;
+  entropy_source_fn_c_fails = -1;
+  tt_int_op(ENTROPY_CHUNK * 3, ==,
+            ottery_getentropy_impl_(buf, &status, test_sources, N,
+                                    NULL, memo));
+  tt_int_op(memo[0].unsupported, ==, 1);
+  tt_int_op(memo[2].unsupported, ==, 0);
+  tt_int_op(memo[2].failures, ==, 1);
+  tt_int_op(memo[2].skip, ==, 1);
+
+  /* Even once they work, we skip a forever, and c this time. */
+  entropy_source_fn_a_fails = 0;
+  entropy_source_fn_c_fails = 0;
+  memset(buf, 0, sizeof(buf));
+  tt_int_op(ENTROPY_CHUNK * 3, ==,
+            ottery_getentropy_impl_(buf, &status, test_sources, N,
+                                    NULL, memo));
+  tt_mem_op("bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"
+            "dddddddddddddddddddddddddddddddd"
+            "eeeeeeeeeeeeeeeeeeeeeeeeeeeeeeee", ==, buf, ENTROPY_CHUNK * 3);
+  tt_int_op(memo[2].skip, ==, 0);
+
+  /* Next time we try c again, and it works, so we forget it failed. */
+  memset(buf, 0, sizeof(buf));
+  tt_int_op(ENTROPY_CHUNK * 3, ==,
+            ottery_getentropy_impl_(buf, &status, test_sources, N,
+                                    NULL, memo));
+  tt_mem_op("bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"
+            "cccccccccccccccccccccccccccccccc"
+            "eeeeeeeeeeeeeeeeeeeeeeeeeeeeeeee", ==, buf, ENTROPY_CHUNK * 3);
+  tt_int_op(memo[2].failures, ==, 0);
+
+  /* If c keeps failing, we back off further each time. */
+  entropy_source_fn_c_fails = -1;
+  ottery_getentropy_impl_(buf, &status, test_sources, N, NULL, memo);
+  tt_int_op(memo[2].skip, ==, 1);
+  ottery_getentropy_impl_(buf, &status, test_sources, N, NULL, memo);
+  ottery_getentropy_impl_(buf, &status, test_sources, N, NULL, memo);
+  tt_int_op(memo[2].skip, ==, 3);
+  tt_int_op(memo[2].failures, ==, 2);
+
+end:
+  ;
+}
+
+static void
+test_entropy_memo_reset(void *arg)
+{
+  (void)arg;
+
+  entropy_source_memos[0].unsupported = 1;
+  entropy_source_memos[1].skip = 5;
+  ottery_entropy_memo_reset(entropy_sources[0].id);
+  tt_int_op(entropy_source_memos[0].unsupported, ==, 0);
+  tt_int_op(entropy_source_memos[1].skip, ==, 5);
+
+  OTTERY_PUBLIC_FN2 (reprobe_entropy)();
+  tt_int_op(entropy_source_memos[1].skip, ==, 0);
+
+end:
+  ;
+}
+#undef N
+
 #define ENTROPY(name, flags)                                             \
   { #name, test_entropy_source, TT_FORK | (flags), &entropy_source_setup, \
     (void*)ottery_getentropy_ ## name }
 
 static struct testcase_t entropy_tests[] = {
   ENTROPY(rdrand, 0),
+  ENTROPY(rdseed, OT_ENT_IFFY),
   ENTROPY(getrandom, 0),
   ENTROPY(getentropy, 0),
   ENTROPY(cryptgenrandom, 0),
@@ -307,8 +511,20 @@ static struct testcase_t entropy_tests[] = {
   ENTROPY(fallback_kludge, 0),
 #ifndef _WIN32
   { "generic_device", test_entropy_generic_device, TT_FORK, NULL, NULL },
+  { "device_cache", test_entropy_device_cache, TT_FORK, NULL, NULL },
+#endif
+#ifdef USING_VGETRANDOM
+  { "vgetrandom", test_entropy_vgetrandom, TT_FORK, NULL, NULL },
+#endif
+  { "dispatcher", test_entropy_dispatcher, TT_FORK, &passthrough_setup,
+    (void*)ottery_getentropy_impl },
+  { "memo", test_entropy_memo, TT_FORK, NULL, NULL },
+  { "memo_reset", test_entropy_memo_reset, TT_FORK, NULL, NULL },
+#ifdef USING_PARALLEL_ENTROPY
+  { "dispatcher_parallel", test_entropy_dispatcher, TT_FORK,
+    &passthrough_setup, (void*)ottery_getentropy_parallel_impl },
+  { "parallel_deadline", test_entropy_parallel_deadline, TT_FORK, NULL, NULL },
 #endif
-  { "dispatcher", test_entropy_dispatcher, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -12,6 +12,8 @@ struct fork_test_data {
   pid_t child;
   int forked;
   int shouldcrash;
+  /* Act as if MADV_WIPEONFORK didn't work. */
+  int no_wipeonfork;
 };
 
 static void *
@@ -19,7 +21,7 @@ setup_fork_data(const struct testcase_t *tc)
 {
   struct fork_test_data *d = calloc(1, sizeof(*d));
 
-  (void)tc;
+  d->no_wipeonfork = tc->setup_data != NULL;
   if (pipe(d->pipefds) < 0)
     {
       TT_GRIPE(("pipe failed: %s", strerror(errno)));
@@ -134,6 +136,62 @@ end:
 }
 #endif
 
+#ifdef MADV_WIPEONFORK
+static void
+test_fork_backend_wipeonfork(void *arg)
+{
+  /* Let's make sure MADV_WIPEONFORK works */
+  char *cp;
+  pid_t child;
+  int status = 0;
+
+  (void)arg;
+
+  cp = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+  tt_assert(cp);
+  memcpy(cp, "Hello", 5);
+
+  if (madvise(cp, 4096, MADV_WIPEONFORK) < 0)
+    tt_skip(); /* Older than Linux 4.14 */
+
+  if ((child = fork()) == 0)
+    exit(iszero((void*)cp, 5) ? 0 : 1);
+
+  tt_int_op(child, ==, waitpid(child, &status, 0));
+  tt_assert(WIFEXITED(status));
+  tt_int_op(0, ==, WEXITSTATUS(status));
+  /* Only the child's copy gets wiped. */
+  tt_mem_op(cp, ==, "Hello", 5);
+end:
+  if (cp)
+    munmap(cp, 4096);
+}
+#endif
+
+#ifdef USING_WIPEONFORK
+static void
+test_fork_wipeonfork_per_rng(void *arg)
+{
+  /* Whether MADV_WIPEONFORK worked belongs to each RNG: allocating
+     another one mustn't change what we know about the first. */
+  struct ottery_rng *a = NULL, *b = NULL;
+
+  (void)arg;
+
+  tt_int_op(0, ==, ALLOCATE_RNG(a));
+  if (a->wipeonfork_failed)
+    tt_skip(); /* Older than Linux 4.14 */
+  a->wipeonfork_failed = 1;
+  tt_int_op(0, ==, ALLOCATE_RNG(b));
+  tt_int_op(a->wipeonfork_failed, ==, 1);
+  tt_int_op(b->wipeonfork_failed, ==, 0);
+
+end:
+  FREE_RNG(a);
+  FREE_RNG(b);
+}
+#endif
+
 #if defined(INHERIT_NONE) || defined(MADV_DONTFORK)
 static void
 test_fork_backend_inherit_none(void *arg)
@@ -178,6 +236,7 @@ test_fork_handling(void *arg)
   struct fork_test_data *d = arg;
   u8 buf[64], buf2[32];
   int in_child = 0;
+  unsigned n_getentropy;
 
   DECLARE_STATE();
 
@@ -188,10 +247,22 @@ test_fork_handling(void *arg)
 #endif
 
   INIT_STATE();
+  STAY_ON_ONE_CPU();
 
   OTTERY_PUBLIC_FN (random_buf)(OTTERY_STATE_ARG_OUT COMMA buf, 64);
   tt_int_op(STATE_FIELD(seed_counter), ==, 1);
 
+#ifdef USING_WIPEONFORK
+  if (d->no_wipeonfork)
+    {
+      /* Pretend we're on a kernel older than 4.14, so the child gets a
+         copy of the RNG, and has to notice the new pid. */
+      tt_int_op(0, ==, madvise(RNG_PTR, sizeof(*RNG_PTR), MADV_KEEPONFORK));
+      RNG_PTR->wipeonfork_failed = 1;
+    }
+#endif
+
+  n_getentropy = ottery_testing_getentropy_calls;
   if ((d->child = fork()))
     {
       IN_PARENT(d);
@@ -199,7 +270,7 @@ test_fork_handling(void *arg)
       tt_int_op(ottery_fork_count, ==, 0);
 #endif
       OTTERY_PUBLIC_FN (random_buf)(OTTERY_STATE_ARG_OUT COMMA buf, 32);
-      tt_int_op(RNG_PTR->idx, ==, 96);
+      tt_int_op(OUTPUT_RNG_PTR->idx, ==, 96);
     }
   else
     {
@@ -209,7 +280,10 @@ test_fork_handling(void *arg)
 #endif
       OTTERY_PUBLIC_FN (random_buf)(OTTERY_STATE_ARG_OUT COMMA buf2, 32);
       tt_int_op(STATE_FIELD(seed_counter), ==, 2);
-      tt_int_op(RNG_PTR->idx, ==, 32);
+      tt_int_op(OUTPUT_RNG_PTR->idx, ==, 32);
+      /* The child got its new key without a full seed. */
+      tt_int_op(ottery_testing_getentropy_calls, ==, n_getentropy);
+      tt_int_op(STATE_FIELD(entropy_status), ==, 2);
       write(d->pipefds[1], buf2, 32);
 
       /* Make sure we only reinit once! */
@@ -233,6 +307,76 @@ end:
     }
 }
 
+#define N_SIBLINGS 2
+static void
+test_fork_siblings(void *arg)
+{
+  /* A prefork server's children all start from the same parent state;
+     make sure they still end up with their own streams. */
+  u8 buf[32], child_bufs[N_SIBLINGS][32];
+  pid_t children[N_SIBLINGS];
+  int fds[N_SIBLINGS][2];
+  int i, status;
+
+  DECLARE_STATE();
+
+  for (i = 0; i < N_SIBLINGS; ++i)
+    fds[i][0] = fds[i][1] = -1;
+
+  INIT_STATE();
+  OTTERY_PUBLIC_FN (random_buf)(OTTERY_STATE_ARG_OUT COMMA buf, 32);
+
+#ifdef USING_WIPEONFORK
+  if (arg)
+    {
+      tt_int_op(0, ==, madvise(RNG_PTR, sizeof(*RNG_PTR), MADV_KEEPONFORK));
+      RNG_PTR->wipeonfork_failed = 1;
+    }
+#else
+  (void)arg;
+#endif
+
+  for (i = 0; i < N_SIBLINGS; ++i)
+    {
+      tt_int_op(0, ==, pipe(fds[i]));
+      if ((children[i] = fork()) == 0)
+        {
+          const unsigned n_getentropy = ottery_testing_getentropy_calls;
+          OTTERY_PUBLIC_FN (random_buf)(OTTERY_STATE_ARG_OUT COMMA buf, 32);
+          if (write(fds[i][1], buf, 32) != 32)
+            exit(1);
+          exit(ottery_testing_getentropy_calls == n_getentropy ? 0 : 2);
+        }
+      tt_int_op(children[i], >, 0);
+    }
+
+  for (i = 0; i < N_SIBLINGS; ++i)
+    {
+      tt_int_op(32, ==, read(fds[i][0], child_bufs[i], 32));
+      tt_int_op(children[i], ==, waitpid(children[i], &status, 0));
+      tt_assert(WIFEXITED(status));
+      tt_int_op(0, ==, WEXITSTATUS(status));
+    }
+
+  /* Nobody's stream matches anybody else's. */
+  OTTERY_PUBLIC_FN (random_buf)(OTTERY_STATE_ARG_OUT COMMA buf, 32);
+  tt_mem_op(child_bufs[0], !=, child_bufs[1], 32);
+  for (i = 0; i < N_SIBLINGS; ++i)
+    tt_mem_op(buf, !=, child_bufs[i], 32);
+  tt_int_op(STATE_FIELD(seed_counter), ==, 1);
+
+end:
+  RELEASE_STATE();
+  for (i = 0; i < N_SIBLINGS; ++i)
+    {
+      if (fds[i][0] >= 0)
+        close(fds[i][0]);
+      if (fds[i][1] >= 0)
+        close(fds[i][1]);
+    }
+}
+#undef N_SIBLINGS
+
 static struct testcase_t fork_tests[] = {
 #if defined(INHERIT_NONE) || defined(MADV_DONTFORK)
   { "backend/inherit_none", test_fork_backend_inherit_none,
@@ -243,6 +387,17 @@ static struct testcase_t fork_tests[] = {
     TT_FORK, &fork_data_setup, NULL },
 #endif
   { "handling", test_fork_handling, TT_FORK, &fork_data_setup, NULL },
+  { "siblings", test_fork_siblings, TT_FORK, NULL, NULL },
+#ifdef MADV_WIPEONFORK
+  { "backend/wipeonfork", test_fork_backend_wipeonfork, TT_FORK, NULL, NULL },
+#endif
+#ifdef USING_WIPEONFORK
+  { "handling_no_wipeonfork", test_fork_handling,
+    TT_FORK, &fork_data_setup, (void*)"1" },
+  { "siblings_no_wipeonfork", test_fork_siblings,
+    TT_FORK, &passthrough_setup, (void*)"1" },
+  { "wipeonfork_per_rng", test_fork_wipeonfork_per_rng, TT_FORK, NULL, NULL },
+#endif
 
   END_OF_TESTCASES
 };
@@ -13,6 +13,7 @@
 #include "tinytest_macros.h"
 
 #ifndef _WIN32
+#include <sys/resource.h>
 #include <sys/wait.h>
 #endif
 
@@ -20,6 +21,23 @@ static int iszero(u8 *, size_t);
 
 #define OT_ENT_IFFY TT_FIRST_USER_FLAG
 
+/* A setup that hands each test its setup_data, which must not be NULL. */
+static void *
+setup_passthrough(const struct testcase_t *tc)
+{
+  return tc->setup_data;
+}
+static int
+cleanup_passthrough(const struct testcase_t *tc, void *arg)
+{
+  (void)tc;
+  (void)arg;
+  return 1;
+}
+static struct testcase_setup_t passthrough_setup = {
+  setup_passthrough, cleanup_passthrough
+};
+
 #ifdef OTTERY_STRUCT
 #define DECLARE_STATE() struct ottery_state *state
 #define INIT_STATE() \
@@ -32,6 +50,52 @@ static int iszero(u8 *, size_t);
 #define RELEASE_STATE()
 #endif
 
+/*
+  The RNG that the last call took its output from.  With a local RNG, the
+  global one (RNG_PTR) only gives out keys.
+*/
+#if defined(OTTERY_THREAD_LOCAL_RNG)
+#define OUTPUT_RNG_PTR (ottery_thread.rng)
+#elif defined(OTTERY_PER_CPU_RNG)
+#define OUTPUT_RNG_PTR (ottery_current_shard->local.rng)
+#else
+#define OUTPUT_RNG_PTR RNG_PTR
+#endif
+
+#ifdef OTTERY_EAGER_INIT
+/*
+  What the helper thread had done by the time main() started.  See
+  undo_eager_init().
+*/
+static int eager_loaded_magic_ok;
+static unsigned eager_loaded_seed_counter;
+static int eager_loaded_init_state;
+#endif
+
+/*
+  With OTTERY_ASYNC_RESEED, a routine reseed happens on the worker thread,
+  a little after the call that found it due.  A test that wants to see it
+  should wait until the seed counter gets to 'counter'.
+*/
+#ifdef OTTERY_ASYNC_RESEED
+static int async_wait_for_seed(unsigned counter);
+#define WAIT_FOR_RESEED(counter)                        \
+  tt_int_op(0, ==, async_wait_for_seed(counter))
+#else
+#define WAIT_FOR_RESEED(counter) ((void)0)
+#endif
+
+/*
+  Per-CPU RNGs only stay put if we do.  A test that wants one call to pick
+  up where the last one left off should call this first.
+*/
+#ifdef OTTERY_PER_CPU_RNG
+static int pin_to_current_cpu(void);
+#define STAY_ON_ONE_CPU() ((void) pin_to_current_cpu())
+#else
+#define STAY_ON_ONE_CPU() ((void)0)
+#endif
+
 #include "test_blake2.c"
 #include "test_chacha.c"
 #include "test_entropy.c"
@@ -39,6 +103,10 @@ static int iszero(u8 *, size_t);
 #include "test_rng_core.c"
 #include "test_shallow.c"
 #include "test_egd.c"
+#include "test_thread.c"
+#include "test_percpu.c"
+#include "test_eager.c"
+#include "test_async.c"
 
 static int
 iszero(u8 *p, size_t n)
@@ -51,8 +119,50 @@ iszero(u8 *p, size_t n)
   return 1;
 }
 
+#ifdef OTTERY_PER_CPU_RNG
+/*
+  Keep this process on the CPU it's running on now.  Return that CPU, or -1
+  on failure.
+*/
+static int
+pin_to_current_cpu(void)
+{
+  unsigned long mask[PERCPU_MAX_CPUS / (8 * sizeof(unsigned long))];
+  const unsigned bits = 8 * sizeof(unsigned long);
+  const unsigned cpu = percpu_current_cpu_();
+
+  memset(mask, 0, sizeof(mask));
+  mask[cpu / bits] |= 1ul << (cpu % bits);
+  if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) < 0)
+    return -1;
+  return (int)cpu;
+}
+#endif
+
+#ifdef OTTERY_EAGER_INIT
+/*
+  The helper thread starts seeding the RNG as soon as we get loaded, but
+  most of the tests want to see the first seed for themselves.  So we wait
+  for it, make a note of what it did for eager/ready, and put the state
+  back the way we found it.
+*/
+static void
+undo_eager_init(void)
+{
+  ottery_eager_join_();
+  eager_loaded_magic_ok = OTTERY_MAGIC_IS_OKAY(ottery_magic);
+  eager_loaded_seed_counter = ottery_seed_counter;
+  eager_loaded_init_state = ottery_init_state;
+
+  ottery_teardown();
+  ottery_seed_counter = 0;
+  ottery_entropy_status = 0;
+}
+#endif
+
 static struct testgroup_t groups[] = {
   { "blake2/", blake2_tests },
+  { "chacha/", chacha_tests },
   { "chacha_dump/", chacha_testvectors_tests },
   { "entropy/", entropy_tests },
 #ifndef _WIN32
@@ -61,11 +171,26 @@ static struct testgroup_t groups[] = {
   { "rng_core/", rng_core_tests },
   { "shallow/", shallow_tests },
   { "egd/", egd_tests },
+#ifdef OTTERY_THREAD_LOCAL_RNG
+  { "thread/", thread_tests },
+#endif
+#ifdef OTTERY_PER_CPU_RNG
+  { "percpu/", percpu_tests },
+#endif
+#ifdef OTTERY_EAGER_INIT
+  { "eager/", eager_tests },
+#endif
+#ifdef OTTERY_ASYNC_RESEED
+  { "async/", async_tests },
+#endif
   END_OF_GROUPS
 };
 
 int
 main(int c, const char **v)
 {
+#ifdef OTTERY_EAGER_INIT
+  undo_eager_init();
+#endif
   return tinytest_main(c, v, groups);
 }
@@ -0,0 +1,157 @@
+/*
+   To the extent possible under law, Nick Mathewson has waived all copyright and
+   related or neighboring rights to libottery-lite, using the creative commons
+   "cc0" public domain dedication.  See doc/cc0.txt or
+   <http://creativecommons.org/publicdomain/zero/1.0/> for full details.
+ */
+
+#ifdef OTTERY_PER_CPU_RNG
+
+static void
+test_percpu_cpuset(void *arg)
+{
+  unsigned short map[PERCPU_MAX_CPUS];
+  unsigned long mask[PERCPU_MAX_CPUS / (8 * sizeof(unsigned long))];
+  const unsigned bits = 8 * sizeof(unsigned long);
+  unsigned cpu, n, n_set = 0, next = 0;
+
+  (void)arg;
+
+  memset(mask, 0, sizeof(mask));
+  tt_int_op(syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask), >, 0);
+
+  n = percpu_cpuset_(map);
+  for (cpu = 0; cpu < PERCPU_MAX_CPUS; ++cpu)
+    {
+      tt_int_op(map[cpu], <, n);
+      if (mask[cpu / bits] & (1ul << (cpu % bits)))
+        {
+          /* The CPUs we can use get their own shards, in order. */
+          tt_int_op(map[cpu], ==, next);
+          ++next;
+          ++n_set;
+        }
+    }
+  tt_int_op(n, ==, n_set);
+
+  tt_int_op(percpu_current_cpu_(), <, PERCPU_MAX_CPUS);
+  cpu = percpu_current_cpu_();
+  tt_assert(mask[cpu / bits] & (1ul << (cpu % bits)));
+
+end:
+  ;
+}
+
+static void
+test_percpu_pool_size(void *arg)
+{
+  int cpu;
+
+  (void)arg;
+
+  /* Pin ourselves to one CPU before the pool exists: we should only get
+     one shard, however big the machine is. */
+  cpu = pin_to_current_cpu();
+  tt_int_op(cpu, >=, 0);
+
+  tt_ptr_op(ottery_shards, ==, NULL);
+  ottery_random();
+  tt_int_op(ottery_n_shards, ==, 1);
+  tt_int_op(ottery_shard_map[cpu], ==, 0);
+
+end:
+  ;
+}
+
+static void
+test_percpu_rekey(void *arg)
+{
+  struct ottery_shard *s;
+  struct ottery_rng *rng;
+  unsigned generation;
+  u8 key[OTTERY_KEYLEN];
+  (void)arg;
+
+  STAY_ON_ONE_CPU();
+  ottery_random();
+  tt_int_op(ottery_seed_counter, ==, 1);
+  s = ottery_current_shard;
+  tt_assert(s != NULL);
+  rng = s->local.rng;
+  tt_assert(rng != NULL);
+  tt_ptr_op(rng, !=, RNG_PTR);
+  generation = s->local.generation;
+  memcpy(key, RNG_BUF(rng) + OTTERY_BUFLEN - OTTERY_KEYLEN, OTTERY_KEYLEN);
+
+  /* When the global RNG needs a reseed, so does the shard. */
+  ottery_need_reseed();
+  ottery_random();
+  tt_int_op(ottery_seed_counter, ==, 2);
+  tt_int_op(generation, !=, s->local.generation);
+  tt_mem_op(key, !=, RNG_BUF(rng) + OTTERY_BUFLEN - OTTERY_KEYLEN,
+            OTTERY_KEYLEN);
+
+  /* Flushing added entropy also gives it a new key. */
+  generation = s->local.generation;
+  ottery_addrandom((const u8 *)"xyzzy", 5);
+  ottery_flush_addrandom();
+  ottery_random();
+  tt_int_op(generation, !=, s->local.generation);
+
+  /* Teardown wipes the shards; we make new ones next time. */
+  ottery_teardown();
+  tt_ptr_op(s->local.rng, ==, NULL);
+  ottery_random();
+  tt_assert(s->local.rng != NULL);
+
+end:
+  ;
+}
+
+static void
+test_percpu_fork(void *arg)
+{
+  u8 buf[32], buf2[32];
+  int fds[2] = { -1, -1 };
+  pid_t child;
+  int status = 0;
+
+  (void)arg;
+
+  ottery_random_buf(buf, sizeof(buf));
+  tt_int_op(0, ==, pipe(fds));
+
+  if ((child = fork()) == 0)
+    {
+      ottery_random_buf(buf2, sizeof(buf2));
+      if (write(fds[1], buf2, sizeof(buf2)) != sizeof(buf2))
+        exit(1);
+      exit(ottery_current_shard->local.pid == getpid() ? 0 : 1);
+    }
+  tt_int_op(child, >, 0);
+
+  tt_int_op(sizeof(buf2), ==, read(fds[0], buf2, sizeof(buf2)));
+  tt_int_op(child, ==, waitpid(child, &status, 0));
+  tt_assert(WIFEXITED(status));
+  tt_int_op(0, ==, WEXITSTATUS(status));
+
+  /* The child didn't reuse the parent's stream. */
+  ottery_random_buf(buf, sizeof(buf));
+  tt_mem_op(buf, !=, buf2, 32);
+
+end:
+  if (fds[0] >= 0)
+    close(fds[0]);
+  if (fds[1] >= 0)
+    close(fds[1]);
+}
+
+static struct testcase_t percpu_tests[] = {
+  { "cpuset", test_percpu_cpuset, TT_FORK, NULL, NULL },
+  { "pool_size", test_percpu_pool_size, TT_FORK, NULL, NULL },
+  { "rekey", test_percpu_rekey, TT_FORK, NULL, NULL },
+  { "fork", test_percpu_fork, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
+
+#endif /* OTTERY_PER_CPU_RNG */
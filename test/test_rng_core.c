@@ -18,11 +18,12 @@ test_rng_core_construction_short(void *arg)
 
   (void)arg;
 
+  memset(&rng, 0, sizeof(rng));
   ottery_setkey(&rng, key);
   chacha20_blocks(key, OTTERY_BUFLEN / 64, stream);
   chacha20_blocks(stream + OTTERY_BUFLEN - OTTERY_KEYLEN, OTTERY_BUFLEN / 64, stream + OTTERY_BUFLEN - OTTERY_KEYLEN);
 
-  tt_assert(!iszero(rng.buf, 1500));
+  tt_assert(!iszero(RNG_BUF(&rng), 1500));
 
   for (i = 0; i < 1500; )
     {
@@ -46,11 +47,11 @@ test_rng_core_construction_short(void *arg)
 
       if (i < OTTERY_BUFLEN - OTTERY_KEYLEN)
         {
-          tt_assert(iszero(rng.buf, i));
+          tt_assert(iszero(RNG_BUF(&rng), i));
         }
       else
         {
-          tt_assert(iszero(rng.buf, i - (OTTERY_BUFLEN - OTTERY_KEYLEN)));
+          tt_assert(iszero(RNG_BUF(&rng), i - (OTTERY_BUFLEN - OTTERY_KEYLEN)));
         }
     }
 
@@ -64,12 +65,40 @@ end:
   ;
 }
 
+/*
+  Build the stream that an rng keyed with 'key' should produce over its
+  first 'nbufs' buffers, and return it in a newly allocated buffer.
+*/
+static u8 *
+make_rng_stream(const u8 *initial_key, int nbufs)
+{
+  u8 *stream = malloc((OTTERY_BUFLEN - OTTERY_KEYLEN) * nbufs + OTTERY_KEYLEN);
+  u8 key[OTTERY_KEYLEN], *keyp, *streamp;
+  int i;
+
+  if (!stream)
+    return NULL;
+
+  memcpy(key, initial_key, OTTERY_KEYLEN);
+  streamp = stream;
+  for (i = 0; i < nbufs; ++i)
+    {
+      chacha20_blocks(key, OTTERY_BUFLEN / 64, streamp);
+      keyp = streamp + OTTERY_BUFLEN - OTTERY_KEYLEN;
+      memcpy(key, keyp, OTTERY_KEYLEN);
+      memset(keyp, 0, OTTERY_KEYLEN);
+      streamp = keyp;
+    }
+
+  return stream;
+}
+
 static void
 test_rng_core_construction_long(void *arg)
 {
   const int nbufs = 30;
-  u8 *stream = malloc((OTTERY_BUFLEN - OTTERY_KEYLEN) * nbufs + OTTERY_KEYLEN), *streamp;
-  u8 key[OTTERY_KEYLEN] = "ottery:!THE NEW DANCE REMIX!1!ha1l3r15.", *keyp;
+  u8 *stream = NULL, *streamp;
+  u8 key[OTTERY_KEYLEN] = "ottery:!THE NEW DANCE REMIX!1!ha1l3r15.";
   u8 *tmp = malloc(5003);
   int i;
   struct ottery_rng rng;
@@ -77,26 +106,19 @@ test_rng_core_construction_long(void *arg)
 
   (void)arg;
 
+  memset(&rng, 0, sizeof(rng));
   ottery_setkey(&rng, key);
 
   tt_int_op(nbufs, <, RESEED_AFTER_BLOCKS);
 
+  stream = make_rng_stream(key, nbufs);
   tt_assert(stream);
   tt_assert(tmp);
 
-  streamp = stream;
+  streamlen = (OTTERY_BUFLEN - OTTERY_KEYLEN) * nbufs;
   for (i = 0; i < nbufs; ++i)
-    {
-      chacha20_blocks(key, OTTERY_BUFLEN / 64, streamp);
-      tt_assert(!iszero(streamp + OTTERY_BUFLEN - 16, 16));
-      keyp = streamp + OTTERY_BUFLEN - OTTERY_KEYLEN;
-      memcpy(key, keyp, OTTERY_KEYLEN);
-      memset(keyp, 0, OTTERY_KEYLEN);
-      streamp = keyp;
-    }
-
-  streamlen = (int)(streamp - stream);
-  tt_int_op(streamlen, ==, (OTTERY_BUFLEN - OTTERY_KEYLEN) * nbufs);
+    tt_assert(!iszero(stream + (OTTERY_BUFLEN - OTTERY_KEYLEN) * i +
+                      OTTERY_BUFLEN - OTTERY_KEYLEN - 16, 16));
 
   streamp = stream;
 
@@ -105,7 +127,7 @@ test_rng_core_construction_long(void *arg)
       /* CHECK COUNT */
       ottery_bytes(&rng, tmp, 5003);
       tt_mem_op(tmp, ==, streamp, 5003);
-      tt_assert(iszero(rng.buf, rng.idx));
+      tt_assert(iszero(RNG_BUF(&rng), rng.idx));
       streamp += 5003;
     }
 
@@ -116,8 +138,190 @@ end:
     free(tmp);
 }
 
+static void
+test_rng_core_buffer_boundaries(void *arg)
+{
+  /* Request sizes on either side of a buffer's worth of output. */
+  static const int lengths[] = {
+    OTTERY_BUFLEN - OTTERY_KEYLEN, OTTERY_BUFLEN - OTTERY_KEYLEN + 1,
+    OTTERY_BUFLEN - 1, OTTERY_BUFLEN, OTTERY_BUFLEN + 1,
+    2 * (OTTERY_BUFLEN - OTTERY_KEYLEN), 2 * OTTERY_BUFLEN - OTTERY_KEYLEN,
+    2 * OTTERY_BUFLEN, 1, 17, 3000,
+  };
+  const int nbufs = 40;
+  u8 *stream = NULL, *streamp;
+  u8 key[OTTERY_KEYLEN] = "ottery:don't forget the last 40 bytes..";
+  u8 tmp[3 * OTTERY_BUFLEN];
+  unsigned i;
+  struct ottery_rng rng;
+
+  (void)arg;
+
+  memset(&rng, 0, sizeof(rng));
+  ottery_setkey(&rng, key);
+  stream = make_rng_stream(key, nbufs);
+  tt_assert(stream);
+
+  streamp = stream;
+  for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i)
+    {
+      const int n = lengths[i];
+      memset(tmp, 0, sizeof(tmp));
+      ottery_bytes(&rng, tmp, n);
+      tt_mem_op(tmp, ==, streamp, n);
+      /* Nothing past the end of the request got touched. */
+      tt_assert(iszero(tmp + n, sizeof(tmp) - n));
+      tt_assert(iszero(RNG_BUF(&rng), rng.idx));
+      streamp += n;
+    }
+
+end:
+  if (stream)
+    free(stream);
+}
+
+#ifndef OTTERY_INCREMENTAL_REFILL
+static void
+test_rng_core_spare(void *arg)
+{
+  u8 key[OTTERY_KEYLEN] = "spare buffers are made out of thin air..";
+  u8 spare_key[OTTERY_KEYLEN], expected[OTTERY_BUFLEN];
+  u8 tmp[OTTERY_BUFLEN];
+  u8 *spare;
+  struct ottery_rng rng;
+
+  (void)arg;
+
+  memset(&rng, 0, sizeof(rng));
+  ottery_setkey(&rng, key);
+
+  /* Not time for a spare yet. */
+  ottery_bytes(&rng, tmp, SPARE_CLAIM_AFTER - 1);
+  tt_ptr_op(ottery_claim_spare(&rng, spare_key), ==, NULL);
+
+  /* Now it is.  The key comes out of the stream. */
+  ottery_bytes(&rng, tmp, 1);
+  memcpy(tmp, RNG_BUF(&rng) + rng.idx, OTTERY_KEYLEN);
+  spare = ottery_claim_spare(&rng, spare_key);
+  tt_ptr_op(spare, ==, RNG_SPARE(&rng));
+  tt_mem_op(spare_key, ==, tmp, OTTERY_KEYLEN);
+  tt_int_op(rng.idx, ==, SPARE_CLAIM_AFTER + OTTERY_KEYLEN);
+  tt_assert(iszero(RNG_BUF(&rng), rng.idx));
+  tt_int_op(rng.spare_state, ==, SPARE_FILLING);
+  /* Only one at a time. */
+  tt_ptr_op(ottery_claim_spare(&rng, tmp), ==, NULL);
+
+  chacha20_blocks(spare_key, OTTERY_N_BLOCKS, expected);
+  ottery_fill_spare(spare, spare_key);
+  tt_assert(iszero(spare_key, OTTERY_KEYLEN));
+  ottery_spare_done(&rng);
+  tt_int_op(rng.spare_state, ==, SPARE_READY);
+
+  /* When the buffer runs out, we switch to the spare. */
+  ottery_bytes(&rng, tmp, OTTERY_BUFLEN - OTTERY_KEYLEN - rng.idx);
+  tt_int_op(rng.count, ==, 0);
+  ottery_bytes(&rng, tmp, 64);
+  tt_mem_op(tmp, ==, expected, 64);
+  tt_int_op(rng.count, ==, 1);
+  tt_int_op(rng.spare_state, ==, SPARE_EMPTY);
+  tt_assert(iszero(RNG_SPARE(&rng), OTTERY_BUFLEN));
+
+  /* If we rekey while somebody's filling the spare, it gets thrown away. */
+  ottery_bytes(&rng, tmp, SPARE_CLAIM_AFTER);
+  spare = ottery_claim_spare(&rng, spare_key);
+  tt_assert(spare != NULL);
+  ottery_setkey(&rng, key);
+  tt_int_op(rng.spare_state, ==, SPARE_STALE);
+  tt_ptr_op(ottery_claim_spare(&rng, tmp), ==, NULL);
+  ottery_fill_spare(spare, spare_key);
+  ottery_spare_done(&rng);
+  tt_int_op(rng.spare_state, ==, SPARE_EMPTY);
+  tt_assert(iszero(RNG_SPARE(&rng), OTTERY_BUFLEN));
+
+  /* And we get the same stream as before. */
+  chacha20_blocks(key, OTTERY_N_BLOCKS, expected);
+  ottery_bytes(&rng, tmp, OTTERY_BUFLEN - OTTERY_KEYLEN);
+  tt_mem_op(tmp, ==, expected, OTTERY_BUFLEN - OTTERY_KEYLEN);
+
+end:
+  ;
+}
+#else
+static void
+test_rng_core_incremental(void *arg)
+{
+  const int nbufs = 6;
+  u8 key[OTTERY_KEYLEN] = "a little at a time, never all at once...";
+  u8 *stream = NULL, *streamp;
+  u8 tmp[OTTERY_BUFLEN * 2];
+  unsigned before;
+  struct ottery_rng rng;
+  int i;
+
+  (void)arg;
+
+  memset(&rng, 0, sizeof(rng));
+  ottery_setkey(&rng, key);
+  stream = make_rng_stream(key, nbufs);
+  tt_assert(stream);
+  streamp = stream;
+
+  tt_int_op(rng.spare_blocks, ==, 0);
+  for (i = 0; i < (OTTERY_BUFLEN - OTTERY_KEYLEN) * 3 / 4; ++i)
+    {
+      /* The next buffer is done before this one runs out, so switching
+         costs nothing ... */
+      if (rng.idx == OTTERY_BUFLEN - OTTERY_KEYLEN)
+        tt_int_op(rng.spare_blocks, ==, OTTERY_N_BLOCKS);
+      before = rng.count;
+      ottery_bytes(&rng, tmp, 4);
+      tt_mem_op(tmp, ==, streamp, 4);
+      streamp += 4;
+      /* ... and no call makes more than one step. */
+      if (rng.count == before)
+        tt_int_op(rng.spare_blocks, <=, OTTERY_REFILL_STEP * (rng.idx / REFILL_STRIDE + 1));
+      else
+        tt_int_op(rng.spare_blocks, ==, 0);
+    }
+  tt_int_op(rng.count, ==, 2);
+
+  /* The call that switches buffers doesn't make a step; the next one
+     does. */
+  ottery_bytes(&rng, tmp, 1);
+  tt_int_op(rng.spare_blocks, ==, 0);
+  ottery_bytes(&rng, tmp, 1);
+  tt_int_op(rng.spare_blocks, ==, OTTERY_REFILL_STEP);
+  streamp += 2;
+
+  /* A request that generates whole buffers straight into its output
+     throws away the part of the spare we've made, and we still get the
+     same stream. */
+  ottery_bytes(&rng, tmp, OTTERY_BUFLEN * 2);
+  tt_mem_op(tmp, ==, streamp, OTTERY_BUFLEN * 2);
+  tt_int_op(rng.spare_blocks, ==, 0);
+
+  /* So does rekeying. */
+  ottery_bytes(&rng, tmp, 1);
+  tt_int_op(rng.spare_blocks, ==, OTTERY_REFILL_STEP);
+  ottery_setkey(&rng, key);
+  tt_int_op(rng.spare_blocks, ==, 0);
+  ottery_bytes(&rng, tmp, OTTERY_BUFLEN * 2);
+  tt_mem_op(tmp, ==, stream, OTTERY_BUFLEN * 2);
+
+end:
+  if (stream)
+    free(stream);
+}
+#endif
+
 static struct testcase_t rng_core_tests[] = {
   { "short_requests", test_rng_core_construction_short, 0, NULL, NULL },
   { "long_requests", test_rng_core_construction_long, 0, NULL, NULL },
+  { "buffer_boundaries", test_rng_core_buffer_boundaries, 0, NULL, NULL },
+#ifndef OTTERY_INCREMENTAL_REFILL
+  { "spare", test_rng_core_spare, 0, NULL, NULL },
+#else
+  { "incremental", test_rng_core_incremental, 0, NULL, NULL },
+#endif
   END_OF_TESTCASES
 };
@@ -154,6 +154,82 @@ end:
   RELEASE_STATE();
 }
 
+static void
+test_shallow_buf_parallel(void *arg)
+{
+  const size_t n = 3 * PARALLEL_MIN_BYTES_PER_THREAD + 13;
+  u8 *buf1 = malloc(n + 16), *buf2 = malloc(n + 16);
+
+  DECLARE_STATE();
+  INIT_STATE();
+  (void)arg;
+
+  tt_assert(buf1);
+  tt_assert(buf2);
+  memset(buf1, 0xcc, n + 16);
+  memset(buf2, 0xcc, n + 16);
+
+  OTTERY_PUBLIC_FN (random_buf_parallel)(OTTERY_STATE_ARG_OUT COMMA buf1, n, 0);
+  OTTERY_PUBLIC_FN (random_buf_parallel)(OTTERY_STATE_ARG_OUT COMMA buf2, n, 3);
+
+  /* We stayed inside the buffer... */
+  tt_mem_op(buf1 + n, ==, "\xcc\xcc\xcc\xcc\xcc\xcc\xcc\xcc", 8);
+  tt_mem_op(buf2 + n, ==, "\xcc\xcc\xcc\xcc\xcc\xcc\xcc\xcc", 8);
+  /* ... filled all of it, with different keys each time. */
+  tt_mem_op(buf1 + n - 13, !=, buf2 + n - 13, 13);
+  tt_mem_op(buf1 + n / 2, !=, buf2 + n / 2, 64);
+  tt_assert(!iszero(buf1 + n - 64, 64));
+
+  /* Small requests work too. */
+  memset(buf1, 0xcc, 32);
+  OTTERY_PUBLIC_FN (random_buf_parallel)(OTTERY_STATE_ARG_OUT COMMA buf1, 20, 4);
+  tt_int_op(buf1[20], ==, 0xcc);
+
+end:
+  if (buf1)
+    free(buf1);
+  if (buf2)
+    free(buf2);
+  RELEASE_STATE();
+}
+
+static void
+test_shallow_buf_huge(void *arg)
+{
+  /* Big enough for non-temporal stores, with every possible misalignment
+     of the start and end. */
+  const size_t n = OTTERY_NONTEMPORAL_CUTOFF + 100;
+  u8 *buf = malloc(n + 128);
+  int offset;
+
+  DECLARE_STATE();
+  INIT_STATE();
+  (void)arg;
+
+  tt_assert(buf);
+
+  for (offset = 0; offset < 64; offset += 7)
+    {
+      memset(buf, 0xcc, n + 128);
+      OTTERY_PUBLIC_FN (random_buf)(OTTERY_STATE_ARG_OUT COMMA
+                                    buf + offset, n - offset);
+      /* We didn't write outside the buffer... */
+      if (offset)
+        tt_int_op(buf[offset - 1], ==, 0xcc);
+      tt_mem_op(buf + n, ==, "\xcc\xcc\xcc\xcc\xcc\xcc\xcc\xcc", 8);
+      /* ... and we filled the unaligned head and tail. */
+      tt_mem_op(buf + offset, !=, "\xcc\xcc\xcc\xcc", 4);
+      tt_mem_op(buf + n - 4, !=, "\xcc\xcc\xcc\xcc", 4);
+      tt_assert(!iszero(buf + offset, 64));
+      tt_assert(!iszero(buf + n - 64, 64));
+    }
+
+end:
+  if (buf)
+    free(buf);
+  RELEASE_STATE();
+}
+
 static void
 test_manual_reseed(void *arg)
 {
@@ -170,7 +246,51 @@ test_manual_reseed(void *arg)
   tt_int_op(STATE_FIELD(seed_counter), ==, 1);
   OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
   tt_int_op(STATE_FIELD(seed_counter), ==, 2);
-  tt_int_op(RNG_PTR->idx, ==, sizeof(unsigned));
+  tt_int_op(OUTPUT_RNG_PTR->idx, ==, sizeof(unsigned));
+
+end:
+  RELEASE_STATE();
+}
+
+static void
+test_reseed_policy(void *arg)
+{
+  unsigned n_getentropy;
+
+  DECLARE_STATE();
+  (void)arg;
+  INIT_STATE();
+
+  OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
+  tt_int_op(STATE_FIELD(seed_counter), ==, 1);
+  n_getentropy = ottery_testing_getentropy_calls;
+
+  /* By default, a routine reseed only asks one source. */
+  RNG_PTR->count = RESEED_AFTER_BLOCKS + 1;
+  BUMP_GENERATION(); /* So that any local RNGs look at the global one. */
+  OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
+  WAIT_FOR_RESEED(2);
+  tt_int_op(STATE_FIELD(seed_counter), ==, 2);
+  tt_int_op(ottery_testing_getentropy_calls, ==, n_getentropy);
+  tt_int_op(STATE_FIELD(entropy_status), ==, 2);
+
+  /* But a manual reseed asks them all. */
+  OTTERY_PUBLIC_FN2 (need_reseed)(OTTERY_STATE_ARG_OUT);
+  OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
+  tt_int_op(STATE_FIELD(seed_counter), ==, 3);
+  tt_int_op(ottery_testing_getentropy_calls, ==, n_getentropy + 1);
+  tt_int_op(STATE_FIELD(want_full_seed), ==, 0);
+
+  /* And so does every reseed, if we ask for that. */
+  OTTERY_PUBLIC_FN2 (set_reseed_policy)(OTTERY_STATE_ARG_OUT COMMA
+                                        OTTERY_RESEED_FULL);
+  RNG_PTR->count = RESEED_AFTER_BLOCKS + 1;
+  BUMP_GENERATION(); /* So that any local RNGs look at the global one. */
+  OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
+  WAIT_FOR_RESEED(4);
+  tt_int_op(STATE_FIELD(seed_counter), ==, 4);
+  tt_int_op(ottery_testing_getentropy_calls, ==, n_getentropy + 2);
+  tt_assert(OTTERY_PUBLIC_FN2 (last_reseed_nsec)(OTTERY_STATE_ARG_OUT) > 0);
 
 end:
   RELEASE_STATE();
@@ -181,31 +301,105 @@ test_auto_reseed(void *arg)
 {
   unsigned i = 0;
   u8 buf[550];
-  const unsigned count = (OTTERY_BUFLEN - OTTERY_KEYLEN) * RESEED_AFTER_BLOCKS;
-  const unsigned blocks = (count + sizeof(buf)) / sizeof(buf);
+  /* Each buffer ends with the next key.  Most of them also give up another
+     key from their output for the spare buffer, and the reseed can come a
+     little early because of the jitter, so we can't say exactly when the
+     reseed happens. */
+  const unsigned lo =
+    (OTTERY_BUFLEN - 2 * OTTERY_KEYLEN) *
+    (RESEED_AFTER_BLOCKS - RESEED_AFTER_BLOCKS / RESEED_JITTER) / sizeof(buf);
+  const unsigned hi =
+    ((OTTERY_BUFLEN - OTTERY_KEYLEN) * RESEED_AFTER_BLOCKS + sizeof(buf)) /
+    sizeof(buf);
 
   DECLARE_STATE();
   INIT_STATE();
   (void)arg;
 
-  for (i = 0; i < blocks + 20; ++i)
+#ifdef USING_LOCAL_RNG
+  /* The global RNG only makes keys for the local ones, so it never
+     generates enough to reseed this way.  See test_thread.c and
+     test_percpu.c for how the local RNGs get new keys. */
+  tt_skip();
+#endif
+
+  for (i = 0; i < hi + 20; ++i)
     {
       OTTERY_PUBLIC_FN (random_buf)(OTTERY_STATE_ARG_OUT COMMA buf, sizeof(buf));
       /* printf("i=%d, count=%d\n", i, (int) RNG_PTR->count); */
-      if (i <= blocks)
+      if (i < lo)
         {
           tt_int_op(STATE_FIELD(seed_counter), ==, 1);
         }
-      else
+      else if (i > hi)
         {
+          /* With OTTERY_ASYNC_RESEED, the worker might not be done yet. */
+          WAIT_FOR_RESEED(2);
           tt_int_op(STATE_FIELD(seed_counter), ==, 2);
         }
+      else
+        {
+          tt_int_op(STATE_FIELD(seed_counter), <=, 2);
+        }
     }
 
 end:
   RELEASE_STATE();
 }
 
+static void
+test_reseed_interval(void *arg)
+{
+  unsigned i, at_count, differ = 0;
+  uint64_t now;
+
+  DECLARE_STATE();
+  (void)arg;
+  INIT_STATE();
+
+  OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
+  tt_int_op(STATE_FIELD(reseed_at_count), <=, RESEED_AFTER_BLOCKS);
+  tt_int_op(STATE_FIELD(reseed_at_count), >=,
+            RESEED_AFTER_BLOCKS - RESEED_AFTER_BLOCKS / RESEED_JITTER);
+  now = ottery_coarse_sec();
+  tt_assert(STATE_FIELD(reseed_at_time) <= now + RESEED_AFTER_SECONDS);
+  tt_assert(STATE_FIELD(reseed_at_time) + 1 >=
+            now + RESEED_AFTER_SECONDS - RESEED_AFTER_SECONDS / RESEED_JITTER);
+
+  /* We can ask for a different schedule. */
+  OTTERY_PUBLIC_FN2 (set_reseed_interval)(OTTERY_STATE_ARG_OUT COMMA
+                                          100 * (OTTERY_BUFLEN - OTTERY_KEYLEN),
+                                          10);
+  tt_int_op(STATE_FIELD(reseed_at_count), <=, 100);
+  tt_int_op(STATE_FIELD(reseed_at_count), >=, 75);
+  tt_assert(STATE_FIELD(reseed_at_time) <= ottery_coarse_sec() + 10);
+
+  /* Once the clock runs out, we reseed. */
+  STATE_FIELD(reseed_at_time) = ottery_coarse_sec();
+  BUMP_GENERATION(); /* So that any local RNGs look at the global one. */
+  OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
+  WAIT_FOR_RESEED(2);
+  tt_int_op(STATE_FIELD(seed_counter), ==, 2);
+  tt_assert(STATE_FIELD(reseed_at_time) > ottery_coarse_sec());
+
+  /* Every reseed gets a different jitter. */
+  at_count = STATE_FIELD(reseed_at_count);
+  for (i = 0; i < 8; ++i)
+    {
+      STATE_FIELD(reseed_at_time) = 0;
+      BUMP_GENERATION();
+      OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
+      WAIT_FOR_RESEED(3 + i);
+      if (STATE_FIELD(reseed_at_count) != at_count)
+        ++differ;
+    }
+  tt_int_op(STATE_FIELD(seed_counter), ==, 10);
+  tt_int_op(differ, >, 0);
+
+end:
+  RELEASE_STATE();
+}
+
 static void
 test_shallow_status_1(void *arg)
 {
@@ -287,6 +481,7 @@ test_shallow_addrandom(void *arg)
 {
   u8 buf[600] = "708901345660";
   u8 b2[OTTERY_DIGEST_LEN * 2];
+  u8 pool[OTTERY_DIGEST_LEN];
   u8 newkey[OTTERY_DIGEST_LEN];
   u8 next[CHACHA_BLOCKSIZE];
 
@@ -298,28 +493,92 @@ test_shallow_addrandom(void *arg)
 
   INIT_STATE();
 
+#ifdef USING_LOCAL_RNG
+  /* We predict the next output from the global RNG's buffer, but the
+     output comes from a local RNG.  test_thread.c and test_percpu.c check
+     that addrandom gives the local RNGs new keys. */
+  tt_skip();
+#endif
+
   OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
   tt_int_op(RNG_PTR->idx, ==, sizeof(unsigned));
   OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
   tt_int_op(RNG_PTR->idx, ==, sizeof(unsigned) * 2);
 
-  /* Reconstruct the key we'll see */
-  memcpy(b2, RNG_PTR->buf + RNG_PTR->idx, OTTERY_DIGEST_LEN);
+  /* Adding entropy only touches the pool. */
+  OTTERY_PUBLIC_FN2 (addrandom)(OTTERY_STATE_ARG_OUT COMMA buf, sizeof(buf));
+  tt_int_op(RNG_PTR->idx, ==, sizeof(unsigned) * 2);
+  tt_int_op(STATE_FIELD(pool_state), ==, POOL_ADDED);
+
+  /* Reconstruct the key we'll see when we flush the pool */
+  memset(b2, 0, OTTERY_DIGEST_LEN);
   ottery_digest(b2 + OTTERY_DIGEST_LEN, buf, sizeof(buf));
+  ottery_digest(pool, b2, sizeof(b2));
+  tt_mem_op(pool, ==, STATE_FIELD(pool), OTTERY_DIGEST_LEN);
+  memcpy(b2, RNG_BUF(RNG_PTR) + RNG_PTR->idx, OTTERY_DIGEST_LEN);
+  memcpy(b2 + OTTERY_DIGEST_LEN, pool, OTTERY_DIGEST_LEN);
   ottery_digest(newkey, b2, sizeof(b2));
 
   chacha20_blocks(newkey, 1, next);
 
-  OTTERY_PUBLIC_FN2 (addrandom)(OTTERY_STATE_ARG_OUT COMMA buf, sizeof(buf));
+  OTTERY_PUBLIC_FN2 (flush_addrandom)(OTTERY_STATE_ARG_OUT);
   tt_int_op(RNG_PTR->idx, ==, 0);
+  tt_int_op(STATE_FIELD(pool_state), ==, POOL_EMPTY);
+  tt_assert(iszero(STATE_FIELD(pool), OTTERY_DIGEST_LEN));
 
   u = OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
 
   tt_mem_op(&u, ==, next, 4);
 
-  /* And let's make sure this is a no-op */
+  /* And let's make sure these are no-ops */
   tt_int_op(RNG_PTR->idx, ==, sizeof(unsigned));
   OTTERY_PUBLIC_FN2 (addrandom)(OTTERY_STATE_ARG_OUT COMMA buf, -1);
+  OTTERY_PUBLIC_FN2 (flush_addrandom)(OTTERY_STATE_ARG_OUT);
+  tt_int_op(RNG_PTR->idx, ==, sizeof(unsigned));
+
+end:
+  RELEASE_STATE();
+}
+
+static void
+test_shallow_addrandom_lazy(void *arg)
+{
+  unsigned count;
+  int i;
+
+  DECLARE_STATE();
+
+  (void)arg;
+
+  INIT_STATE();
+
+#ifdef USING_LOCAL_RNG
+  /* The local RNGs only look at the pool when they want a new key, and
+     then it gets folded in at once.  test_thread.c checks that adding to
+     the pool doesn't make them want one. */
+  tt_skip();
+#endif
+
+  OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
+
+  /* However much we add, the key stays put until the buffer runs out. */
+  for (i = 0; i < 100; ++i)
+    {
+      OTTERY_PUBLIC_FN2 (addrandom)(OTTERY_STATE_ARG_OUT COMMA
+                                    (const u8 *)&i, sizeof(i));
+      OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
+      tt_int_op(RNG_PTR->idx, ==, sizeof(unsigned) * (i + 2));
+    }
+  tt_int_op(STATE_FIELD(pool_state), ==, POOL_WAITING);
+  count = RNG_PTR->count;
+
+  /* Once we're on a new buffer, the next call folds the pool in. */
+  while (RNG_PTR->count == count)
+    OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
+  tt_int_op(STATE_FIELD(pool_state), ==, POOL_WAITING);
+  OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
+  tt_int_op(STATE_FIELD(pool_state), ==, POOL_EMPTY);
+  tt_int_op(RNG_PTR->count, ==, 0);
   tt_int_op(RNG_PTR->idx, ==, sizeof(unsigned));
 
 end:
@@ -344,20 +603,242 @@ end:
   ;
 }
 
+#ifndef OTTERY_STRUCT
+#define SHALLOW_N_THREADS 8
+
+static void *
+shallow_thread_fn(void *arg)
+{
+  u8 *out = arg;
+  int i;
+  for (i = 0; i < 2000; ++i)
+    ottery_random_buf(out, 64);
+  return NULL;
+}
+
+static void
+test_shallow_threads(void *arg)
+{
+  /* Many threads at once: whatever kind of lock we have had better keep
+     them from stepping on each other. */
+  pthread_t threads[SHALLOW_N_THREADS];
+  u8 out[SHALLOW_N_THREADS][64];
+  int i, j;
+  (void)arg;
+
+  memset(out, 0, sizeof(out));
+  for (i = 0; i < SHALLOW_N_THREADS; ++i)
+    tt_int_op(0, ==, pthread_create(&threads[i], NULL, shallow_thread_fn,
+                                    out[i]));
+  for (i = 0; i < SHALLOW_N_THREADS; ++i)
+    tt_int_op(0, ==, pthread_join(threads[i], NULL));
+
+  tt_int_op(ottery_seed_counter, ==, 1);
+  for (i = 0; i < SHALLOW_N_THREADS; ++i)
+    {
+      tt_assert(!iszero(out[i], 64));
+      for (j = 0; j < i; ++j)
+        tt_mem_op(out[i], !=, out[j], 64);
+    }
+
+end:
+  ;
+}
+
+static void *
+shallow_init_fn(void *arg)
+{
+  (void)arg;
+  ottery_random();
+  return NULL;
+}
+
+static void
+test_shallow_init_waits(void *arg)
+{
+  /* While one thread does a slow first seed, the others should sleep, not
+     spin on the lock. */
+  pthread_t threads[SHALLOW_N_THREADS];
+  struct rusage ru;
+  long cpu_usec;
+  int i;
+  (void)arg;
+
+  ottery_testing_seed_delay_usec = 200000;
+  for (i = 0; i < SHALLOW_N_THREADS; ++i)
+    tt_int_op(0, ==, pthread_create(&threads[i], NULL, shallow_init_fn,
+                                    NULL));
+  for (i = 0; i < SHALLOW_N_THREADS; ++i)
+    tt_int_op(0, ==, pthread_join(threads[i], NULL));
+  ottery_testing_seed_delay_usec = 0;
+
+  tt_int_op(ottery_seed_counter, ==, 1);
+  tt_int_op(ottery_init_state, ==, INIT_IDLE);
+  tt_int_op(0, ==, getrusage(RUSAGE_SELF, &ru));
+  cpu_usec = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000L +
+    ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+  tt_int_op(cpu_usec, <, 100000);
+
+end:
+  ;
+}
+#endif
+
+#ifdef USING_SEED_FILE
+/* Read up to 'len' bytes of the file at 'path' into 'out', and return how
+   many we got. */
+static int
+read_whole_file(const char *path, u8 *out, size_t len)
+{
+  int fd = open(path, O_RDONLY), n;
+  if (fd < 0)
+    return -1;
+  n = (int)read(fd, out, len);
+  close(fd);
+  return n;
+}
+
+static void
+test_shallow_seed_file(void *arg)
+{
+  char path[] = "/tmp/ottery_seed_XXXXXX";
+  char toolong[SEED_FILE_PATH_MAX + 1];
+  u8 old[SEED_FILE_LEN], got[SEED_FILE_LEN + 1];
+  unsigned n_getentropy;
+  struct stat st;
+  size_t i;
+  int fd;
+
+  DECLARE_STATE();
+  (void)arg;
+
+  memset(toolong, 'x', sizeof(toolong) - 1);
+  toolong[sizeof(toolong) - 1] = '\0';
+  tt_int_op(-1, ==, OTTERY_PUBLIC_FN (set_seed_file)(toolong));
+  tt_int_op(errno, ==, ENAMETOOLONG);
+
+  fd = mkstemp(path);
+  tt_int_op(fd, >=, 0);
+  memset(old, 'x', sizeof(old));
+  tt_int_op(write(fd, old, sizeof(old)), ==, sizeof(old));
+  close(fd);
+
+  /* With a whole seed file, the first seed only asks one strong source,
+     and the next reseed asks them all. */
+  tt_int_op(0, ==, OTTERY_PUBLIC_FN (set_seed_file)(path));
+  n_getentropy = ottery_testing_getentropy_calls;
+  INIT_STATE();
+  OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
+  tt_int_op(STATE_FIELD(seed_counter), ==, 1);
+  tt_int_op(ottery_testing_getentropy_calls, ==, n_getentropy);
+  tt_int_op(STATE_FIELD(entropy_status), ==, 2);
+  tt_int_op(STATE_FIELD(want_full_seed), ==, 1);
+
+  /* We replaced what was in it right away. */
+  tt_int_op(read_whole_file(path, got, sizeof(got)), ==, SEED_FILE_LEN);
+  tt_mem_op(got, !=, old, SEED_FILE_LEN);
+  memcpy(old, got, SEED_FILE_LEN);
+
+  /* And we only read it once. */
+  OTTERY_PUBLIC_FN2 (need_reseed)(OTTERY_STATE_ARG_OUT);
+  OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
+  tt_int_op(STATE_FIELD(seed_counter), ==, 2);
+  tt_int_op(ottery_testing_getentropy_calls, ==, n_getentropy + 1);
+  tt_int_op(read_whole_file(path, got, sizeof(got)), ==, SEED_FILE_LEN);
+  tt_mem_op(got, ==, old, SEED_FILE_LEN);
+
+  /* We refuse a file that other people can read, and leave it alone. */
+  tt_int_op(0, ==, chmod(path, 0644));
+  tt_int_op(-1, ==, OTTERY_PUBLIC_FN (set_seed_file)(path));
+  tt_int_op(errno, ==, EPERM);
+  /* Or one that somebody else owns, even if only they can read it.  (We
+     can only give it away if we're root.) */
+  tt_int_op(0, ==, chmod(path, 0600));
+  if (geteuid() == 0)
+    {
+      tt_int_op(0, ==, chown(path, 1, (gid_t)-1));
+      tt_int_op(-1, ==, OTTERY_PUBLIC_FN (set_seed_file)(path));
+      tt_int_op(errno, ==, EPERM);
+      tt_int_op(0, ==, chown(path, 0, (gid_t)-1));
+    }
+  tt_int_op(0, ==, chmod(path, 0644));
+  OTTERY_PUBLIC_FN2 (need_reseed)(OTTERY_STATE_ARG_OUT);
+  OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
+  tt_int_op(STATE_FIELD(seed_counter), ==, 3);
+  tt_int_op(ottery_testing_getentropy_calls, ==, n_getentropy + 2);
+  tt_int_op(read_whole_file(path, got, sizeof(got)), ==, SEED_FILE_LEN);
+  tt_mem_op(got, ==, old, SEED_FILE_LEN);
+
+  /* If there isn't one, we read the sources as usual, and make it. */
+  tt_int_op(0, ==, unlink(path));
+  tt_int_op(0, ==, OTTERY_PUBLIC_FN (set_seed_file)(path));
+  OTTERY_PUBLIC_FN2 (need_reseed)(OTTERY_STATE_ARG_OUT);
+  OTTERY_PUBLIC_FN (random)(OTTERY_STATE_ARG_OUT);
+  tt_int_op(STATE_FIELD(seed_counter), ==, 4);
+  tt_int_op(ottery_testing_getentropy_calls, ==, n_getentropy + 3);
+  tt_int_op(read_whole_file(path, got, sizeof(got)), ==, SEED_FILE_LEN);
+  tt_int_op(0, ==, stat(path, &st));
+  tt_int_op(st.st_mode & 0777, ==, 0600);
+
+  /* A whole file doesn't stand in for live entropy.  If there isn't any,
+     we fail, and keep the file for next time. */
+  fd = open(path, O_WRONLY | O_TRUNC);
+  tt_int_op(fd, >=, 0);
+  memset(old, 'y', sizeof(old));
+  tt_int_op(write(fd, old, sizeof(old)), ==, sizeof(old));
+  close(fd);
+  tt_int_op(0, ==, OTTERY_PUBLIC_FN (set_seed_file)(path));
+  for (i = 0; i < N_ENTROPY_SOURCES; ++i)
+    entropy_source_memos[i].unsupported = 1;
+  tt_int_op(-1, ==, ottery_seed(OTTERY_STATE_ARG_OUT COMMA 0));
+  tt_int_op(STATE_FIELD(seed_counter), ==, 4);
+  tt_int_op(ottery_seed_file_unread, ==, 1);
+  tt_int_op(read_whole_file(path, got, sizeof(got)), ==, SEED_FILE_LEN);
+  tt_mem_op(got, ==, old, SEED_FILE_LEN);
+
+  OTTERY_PUBLIC_FN2 (reprobe_entropy)();
+  tt_int_op(0, ==, ottery_seed(OTTERY_STATE_ARG_OUT COMMA 0));
+  tt_int_op(STATE_FIELD(seed_counter), ==, 5);
+  tt_int_op(STATE_FIELD(entropy_status), ==, 2);
+  tt_int_op(ottery_seed_file_unread, ==, 0);
+  tt_int_op(read_whole_file(path, got, sizeof(got)), ==, SEED_FILE_LEN);
+  tt_mem_op(got, !=, old, SEED_FILE_LEN);
+
+  tt_int_op(0, ==, OTTERY_PUBLIC_FN (set_seed_file)(NULL));
+  tt_int_op(ottery_seed_file_unread, ==, 0);
+
+end:
+  unlink(path);
+  RELEASE_STATE();
+}
+#endif
+
 static struct testcase_t shallow_tests[] = {
   { "unsigned", test_shallow_unsigned, TT_FORK, NULL, NULL },
   { "range", test_shallow_uniform, TT_FORK, NULL, NULL },
   { "buf", test_shallow_buf, TT_FORK, NULL, NULL },
+  { "buf_parallel", test_shallow_buf_parallel, TT_FORK, NULL, NULL },
+  { "buf_huge", test_shallow_buf_huge, TT_FORK, NULL, NULL },
   { "reseed_manually", test_manual_reseed, TT_FORK, NULL, NULL },
   { "reseed_after_data", test_auto_reseed, TT_FORK, NULL, NULL },
+  { "reseed_policy", test_reseed_policy, TT_FORK, NULL, NULL },
+  { "reseed_interval", test_reseed_interval, TT_FORK, NULL, NULL },
   { "status_1", test_shallow_status_1, TT_FORK, NULL, NULL },
   { "status_2", test_shallow_status_2, TT_FORK, NULL, NULL },
   { "status_3", test_shallow_status_3, TT_FORK, NULL, NULL },
   { "addrandom", test_shallow_addrandom, TT_FORK, NULL, NULL },
+  { "addrandom_lazy", test_shallow_addrandom_lazy, TT_FORK, NULL, NULL },
+#ifdef USING_SEED_FILE
+  { "seed_file", test_shallow_seed_file, TT_FORK, NULL, NULL },
+#endif
 
 #ifdef OTTERY_STRUCT
   { "sizeof", test_shallow_sizeof, TT_FORK, NULL, NULL },
 #endif
   { "teardown", test_shallow_teardown, TT_FORK, NULL, NULL },
+#ifndef OTTERY_STRUCT
+  { "threads", test_shallow_threads, TT_FORK, NULL, NULL },
+  { "init_waits", test_shallow_init_waits, TT_FORK, NULL, NULL },
+#endif
   END_OF_TESTCASES
 };
@@ -0,0 +1,214 @@
+/*
+   To the extent possible under law, Nick Mathewson has waived all copyright and
+   related or neighboring rights to libottery-lite, using the creative commons
+   "cc0" public domain dedication.  See doc/cc0.txt or
+   <http://creativecommons.org/publicdomain/zero/1.0/> for full details.
+ */
+
+#ifdef OTTERY_THREAD_LOCAL_RNG
+
+struct thread_test_result {
+  struct ottery_rng *rng;
+  unsigned generation;
+  u8 buf[64];
+};
+
+static void *
+thread_test_fn(void *arg)
+{
+  struct thread_test_result *r = arg;
+  ottery_random_buf(r->buf, sizeof(r->buf));
+  r->rng = ottery_thread.rng;
+  r->generation = ottery_thread.generation;
+  return NULL;
+}
+
+static void
+test_thread_separate_rngs(void *arg)
+{
+  struct thread_test_result r[2];
+  pthread_t threads[2];
+  u8 buf[64];
+  int i;
+
+  (void)arg;
+  memset(r, 0, sizeof(r));
+
+  ottery_random_buf(buf, sizeof(buf));
+  tt_assert(ottery_thread.rng != NULL);
+  tt_ptr_op(ottery_thread.rng, !=, RNG_PTR);
+  tt_int_op(ottery_seed_counter, ==, 1);
+
+  for (i = 0; i < 2; ++i)
+    tt_int_op(0, ==, pthread_create(&threads[i], NULL, thread_test_fn, &r[i]));
+  for (i = 0; i < 2; ++i)
+    tt_int_op(0, ==, pthread_join(threads[i], NULL));
+
+  /* Every thread got its own RNG, with its own key. */
+  tt_assert(r[0].rng != NULL);
+  tt_assert(r[1].rng != NULL);
+  tt_ptr_op(r[0].rng, !=, ottery_thread.rng);
+  tt_ptr_op(r[1].rng, !=, ottery_thread.rng);
+  tt_mem_op(r[0].buf, !=, r[1].buf, 64);
+  tt_mem_op(r[0].buf, !=, buf, 64);
+  tt_mem_op(r[1].buf, !=, buf, 64);
+
+  /* None of that needed another seed. */
+  tt_int_op(ottery_seed_counter, ==, 1);
+
+end:
+  ;
+}
+
+static void
+test_thread_rekey(void *arg)
+{
+  struct ottery_rng *rng;
+  unsigned generation, seeds, i;
+  u8 key[OTTERY_KEYLEN];
+  (void)arg;
+
+  ottery_random();
+  rng = ottery_thread.rng;
+  generation = ottery_thread.generation;
+  memcpy(key, RNG_BUF(rng) + OTTERY_BUFLEN - OTTERY_KEYLEN, OTTERY_KEYLEN);
+
+  /* Nothing changes the key while we're just using it... */
+  ottery_random();
+  tt_int_op(generation, ==, ottery_thread.generation);
+
+  /* ...but when the global RNG needs a reseed, so does this one. */
+  ottery_need_reseed();
+  ottery_random();
+  tt_int_op(ottery_seed_counter, ==, 2);
+  tt_int_op(generation, !=, ottery_thread.generation);
+  tt_ptr_op(rng, ==, ottery_thread.rng);
+  tt_mem_op(key, !=, RNG_BUF(rng) + OTTERY_BUFLEN - OTTERY_KEYLEN,
+            OTTERY_KEYLEN);
+
+  /* Flushing added entropy also gives us a new key. */
+  generation = ottery_thread.generation;
+  ottery_addrandom((const u8 *)"xyzzy", 5);
+  ottery_flush_addrandom();
+  ottery_random();
+  tt_int_op(generation, !=, ottery_thread.generation);
+
+  /* So does generating too much data. */
+  generation = ottery_thread.generation;
+  rng->count = RESEED_AFTER_BLOCKS + 1;
+  ottery_random();
+  tt_int_op(generation, ==, ottery_thread.generation);
+  tt_int_op(rng->count, <=, 1);
+
+  /* ...where "too much" is whatever the reseed interval says. */
+  ottery_set_reseed_interval(10 * (OTTERY_BUFLEN - OTTERY_KEYLEN), 0);
+  ottery_random();
+  tt_int_op(ottery_thread.rekey_blocks, ==, 10);
+  rng->count = 10;
+  ottery_random();
+  tt_int_op(rng->count, ==, 10);
+  rng->count = 11;
+  ottery_random();
+  tt_int_op(rng->count, <=, 1);
+
+  /* When the global RNG's reseed is due by the clock, we notice at the
+     start of the next buffer. */
+  seeds = ottery_seed_counter;
+  ottery_reseed_at_time = 0;
+  for (i = 0; i < 2 * OTTERY_BUFLEN && ottery_seed_counter == seeds; ++i)
+    ottery_random();
+  tt_int_op(ottery_seed_counter, ==, seeds + 1);
+  tt_int_op(i, >, 1);
+
+end:
+  ;
+}
+
+static void
+test_thread_addrandom(void *arg)
+{
+  struct ottery_rng *rng;
+  unsigned generation, count;
+  int i;
+  (void)arg;
+
+  ottery_random();
+  rng = ottery_thread.rng;
+  generation = ottery_generation;
+  count = rng->count;
+
+  /* However much we add, nobody gets a new key just for that... */
+  for (i = 0; i < 100; ++i)
+    {
+      ottery_addrandom((const u8 *)&i, sizeof(i));
+      ottery_random();
+    }
+  tt_int_op(generation, ==, ottery_generation);
+  tt_int_op(generation, ==, ottery_thread.generation);
+  tt_int_op(rng->count, >=, count);
+  tt_int_op(ottery_pool_state, ==, POOL_ADDED);
+
+  /* ...but the next key this thread gets has it folded in, without
+     making the other threads get new keys too. */
+  rng->count = ottery_thread.rekey_blocks + 1;
+  ottery_random();
+  tt_int_op(rng->count, <=, 1);
+  tt_int_op(ottery_pool_state, ==, POOL_EMPTY);
+  tt_int_op(generation, ==, ottery_generation);
+  tt_int_op(ottery_seed_counter, ==, 1);
+
+end:
+  ;
+}
+
+#ifndef _WIN32
+static void
+test_thread_fork(void *arg)
+{
+  u8 buf[32], buf2[32];
+  int fds[2] = { -1, -1 };
+  pid_t child;
+  int status = 0;
+
+  (void)arg;
+
+  ottery_random_buf(buf, sizeof(buf));
+  tt_int_op(0, ==, pipe(fds));
+
+  if ((child = fork()) == 0)
+    {
+      ottery_random_buf(buf2, sizeof(buf2));
+      if (write(fds[1], buf2, sizeof(buf2)) != sizeof(buf2))
+        exit(1);
+      exit(ottery_thread.pid == getpid() ? 0 : 1);
+    }
+  tt_int_op(child, >, 0);
+
+  tt_int_op(sizeof(buf2), ==, read(fds[0], buf2, sizeof(buf2)));
+  tt_int_op(child, ==, waitpid(child, &status, 0));
+  tt_assert(WIFEXITED(status));
+  tt_int_op(0, ==, WEXITSTATUS(status));
+
+  /* The child didn't reuse the parent's stream. */
+  ottery_random_buf(buf, sizeof(buf));
+  tt_mem_op(buf, !=, buf2, 32);
+
+end:
+  if (fds[0] >= 0)
+    close(fds[0]);
+  if (fds[1] >= 0)
+    close(fds[1]);
+}
+#endif
+
+static struct testcase_t thread_tests[] = {
+  { "separate_rngs", test_thread_separate_rngs, TT_FORK, NULL, NULL },
+  { "rekey", test_thread_rekey, TT_FORK, NULL, NULL },
+  { "addrandom", test_thread_addrandom, TT_FORK, NULL, NULL },
+#ifndef _WIN32
+  { "fork", test_thread_fork, TT_FORK, NULL, NULL },
+#endif
+  END_OF_TESTCASES
+};
+
+#endif /* OTTERY_THREAD_LOCAL_RNG */